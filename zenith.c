@@ -4,19 +4,50 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <float.h>
 #include <math.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <dlfcn.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+#include <openssl/ssl.h>
+#include <openssl/err.h>
 
 #ifdef HAVE_SDL2
 #include <SDL2/SDL.h>
@@ -28,12 +59,29 @@
 #include <libtcc.h>
 #endif
 
+// The io_uring backend talks to the kernel directly, so it only needs the UAPI header
+#if defined(__linux__) && !defined(HAVE_IO_URING) && !defined(ZENITH_NO_IO_URING)
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#ifndef IORING_ACCEPT_MULTISHOT
+#undef HAVE_IO_URING
+#endif
+#endif
+
 #define MAX_LINE 8192
 #define MAX_VARS 2048
 #define MAX_FUNCTIONS 1024
 #define MAX_TOKENS 1024
 #define MAX_WINDOWS 64
 #define MAX_MODULES 128
+#define MAX_ROUTES 256
 #define VERSION "0.4.0-beta"
 #define MODULE_PATH "/usr/local/lib/zenith/modules"
 
@@ -54,6 +102,11 @@ typedef enum {
     TOK_TRY, TOK_CATCH, TOK_THROW, TOK_FINALLY,
     TOK_ASYNC, TOK_AWAIT, TOK_PROMISE,
     TOK_TYPEOF, TOK_INSTANCEOF, TOK_DELETE_KW,
+    TOK_WEBSOCKET, TOK_BROADCAST, TOK_SUBSCRIBE, TOK_LINES, TOK_FLUSH, TOK_WALK, TOK_BYTES, TOK_TEXT, TOK_JSON_PARSE, TOK_JSON_STRINGIFY, TOK_CSV_READ,
+    TOK_KV_OPEN, TOK_KV_GET, TOK_KV_PUT, TOK_KV_DELETE, TOK_KV_KEYS, TOK_KV_COMPACT,
+    TOK_HASH_INIT, TOK_HASH_UPDATE, TOK_HASH_FINAL, TOK_HASH_FILE, TOK_HMAC,
+    TOK_CIPHER_KEY, TOK_CIPHER_ENCRYPT, TOK_CIPHER_DECRYPT,
+    TOK_HEX_ENCODE, TOK_HEX_DECODE, TOK_BASE64_ENCODE, TOK_BASE64_DECODE,
     TOK_LPAREN, TOK_RPAREN, TOK_LBRACE, TOK_RBRACE, TOK_LBRACKET, TOK_RBRACKET,
     TOK_COMMA, TOK_COLON, TOK_SEMICOLON, TOK_DOT, TOK_QUESTION, TOK_AT,
     TOK_PLUS, TOK_MINUS, TOK_STAR, TOK_SLASH, TOK_PERCENT, TOK_POWER,
@@ -70,7 +123,8 @@ typedef struct Token {
 
 typedef enum {
     VAL_NULL, VAL_NUMBER, VAL_STRING, VAL_BOOL, VAL_ARRAY, VAL_DICT, 
-    VAL_FUNCTION, VAL_WINDOW, VAL_COMPILED, VAL_MODULE, VAL_UNDEFINED
+    VAL_FUNCTION, VAL_WINDOW, VAL_COMPILED, VAL_MODULE, VAL_UNDEFINED, VAL_ITERATOR, VAL_FILE,
+    VAL_PROMISE, VAL_BYTES, VAL_KV, VAL_HASH, VAL_CIPHER
 } ValueType;
 
 typedef struct Value Value;
@@ -88,6 +142,7 @@ typedef struct {
     int param_count;
     Token *body_tokens;
     int body_token_count;
+    bool is_async;
 } Function;
 
 typedef struct {
@@ -109,12 +164,61 @@ typedef struct {
 } ZenithWindow;
 #endif
 
+// A read-only file mapping shared by every string value that points into it
+typedef struct {
+    int refs;
+    void *base;
+    size_t size;
+} FileMapping;
+
+// A lazy sequence consumed by for-in. Copies of the value share one
+// iterator, so advancing any of them advances all.
+typedef struct Iterator {
+    int refs;
+    // Returns the next item, owned by the caller, or NULL once exhausted
+    Value *(*next)(struct Iterator *it);
+    void (*release)(struct Iterator *it);
+    void *state;
+} Iterator;
+
+struct FileHandle;
+void file_handle_retain(struct FileHandle *h);
+void file_handle_release(struct FileHandle *h);
+struct KvStore;
+void kv_retain(struct KvStore *kv);
+void kv_release(struct KvStore *kv);
+struct HashState;
+void hash_retain(struct HashState *h);
+void hash_release(struct HashState *h);
+struct CipherKey;
+void cipher_key_retain(struct CipherKey *k);
+void cipher_key_release(struct CipherKey *k);
+
+// The eventual result of an async call; await blocks until a pool thread
+// has filled it in
+typedef struct Promise {
+    int refs;
+    bool done;
+    struct Value *result;
+    pthread_mutex_t lock;
+    pthread_cond_t settled;
+} Promise;
+
+void promise_release(Promise *p);
+
 typedef struct Value {
     ValueType type;
+    // Set when data.string or data.bytes lives in a file mapping rather than on the heap
+    FileMapping *mapping;
     union {
         double number;
         char *string;
         bool boolean;
+        // Binary-safe: may hold NUL bytes, so the length is explicit
+        struct {
+            unsigned char *data;
+            size_t len;
+        } bytes;
         struct {
             Value **items;
             int count;
@@ -132,24 +236,62 @@ typedef struct Value {
 #endif
         void *compiled;
         Module *module;
+        Iterator *iterator;
+        struct FileHandle *file;
+        struct KvStore *kv;
+        struct HashState *hash;
+        struct CipherKey *cipher;
+        Promise *promise;
     } data;
 } Value;
 
-Variable vars[MAX_VARS];
-int var_count = 0;
+// Interpreter state is per thread so route handlers can run in parallel;
+// function definitions are shared and only ever appended to.
+__thread Variable vars[MAX_VARS];
+__thread int var_count = 0;
 Function funcs[MAX_FUNCTIONS];
 int func_count = 0;
+pthread_mutex_t funcs_lock = PTHREAD_MUTEX_INITIALIZER;
 Module modules[MAX_MODULES];
 int module_count = 0;
 bool repl_mode = false;
-int current_scope = 0;
+__thread int current_scope = 0;
 // Globals for return handling
-Value *return_val = NULL;
-bool is_returning = false;
+__thread Value *return_val = NULL;
+__thread bool is_returning = false;
+
+// Copy of the script's variables that every worker context starts from
+Variable *snapshot_vars = NULL;
+int snapshot_var_count = 0;
+
+typedef struct {
+    char *path;
+    char *method;
+    Function *handler;
+    bool websocket;
+    bool body_bytes;    // req["body"] as bytes instead of text
+} Route;
+
+Route routes[MAX_ROUTES];
+int route_count = 0;
 
 typedef struct {
     int port;
     char *root_dir;
+    int threads;
+    int processes;
+    long long max_body;
+    char *upload_dir;
+    bool metrics;
+    bool io_uring;
+    int max_conns;
+    long long max_pending;
+    double rate_limit;
+    double rate_burst;
+    int queue_timeout_ms;
+    char *cert;
+    char *key;
+    int listen_fd;
     bool running;
     pthread_t thread;
 } HTTPServer;
@@ -166,6 +308,7 @@ int window_count = 0;
 void execute_block(Token *tokens, int count, int *idx);
 void execute_statement(Token *tokens, int count, int *idx);
 Function *find_function(const char *name);
+Value *call_function(Function *func, Value **args, int arg_count, bool write_back);
 
 char *strdup_safe(const char *s) {
     if (!s) return NULL;
@@ -200,10 +343,21 @@ Value *create_value(ValueType type) {
     return v;
 }
 
+void file_mapping_release(FileMapping *m) {
+    if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(m->base, m->size);
+        free(m);
+    }
+}
+
 void free_value(Value *v) {
     if (!v) return;
-    if (v->type == VAL_STRING && v->data.string) {
+    if ((v->type == VAL_STRING || v->type == VAL_BYTES) && v->mapping) {
+        file_mapping_release(v->mapping);
+    } else if (v->type == VAL_STRING && v->data.string) {
         free(v->data.string);
+    } else if (v->type == VAL_BYTES) {
+        free(v->data.bytes.data);
     } else if (v->type == VAL_ARRAY) {
         for (int i = 0; i < v->data.array.count; i++) {
             free_value(v->data.array.items[i]);
@@ -216,6 +370,22 @@ void free_value(Value *v) {
         }
         free(v->data.dict.keys);
         free(v->data.dict.values);
+    } else if (v->type == VAL_ITERATOR) {
+        Iterator *it = v->data.iterator;
+        if (__atomic_sub_fetch(&it->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+            it->release(it);
+            free(it);
+        }
+    } else if (v->type == VAL_FILE) {
+        file_handle_release(v->data.file);
+    } else if (v->type == VAL_KV) {
+        kv_release(v->data.kv);
+    } else if (v->type == VAL_HASH) {
+        hash_release(v->data.hash);
+    } else if (v->type == VAL_CIPHER) {
+        cipher_key_release(v->data.cipher);
+    } else if (v->type == VAL_PROMISE) {
+        promise_release(v->data.promise);
     }
     free(v);
 }
@@ -225,8 +395,17 @@ Value *copy_value(Value *v) {
     Value *copy = create_value(v->type);
     if (v->type == VAL_NUMBER) {
         copy->data.number = v->data.number;
+    } else if ((v->type == VAL_STRING || v->type == VAL_BYTES) && v->mapping) {
+        // Mapped strings are immutable, so copies share the pages
+        __atomic_add_fetch(&v->mapping->refs, 1, __ATOMIC_RELAXED);
+        copy->mapping = v->mapping;
+        copy->data = v->data;
     } else if (v->type == VAL_STRING) {
         copy->data.string = strdup_safe(v->data.string);
+    } else if (v->type == VAL_BYTES) {
+        copy->data.bytes.len = v->data.bytes.len;
+        copy->data.bytes.data = malloc(v->data.bytes.len ? v->data.bytes.len : 1);
+        memcpy(copy->data.bytes.data, v->data.bytes.data, v->data.bytes.len);
     } else if (v->type == VAL_BOOL) {
         copy->data.boolean = v->data.boolean;
     } else if (v->type == VAL_ARRAY) {
@@ -250,15 +429,127 @@ Value *copy_value(Value *v) {
         copy->data.function = v->data.function;
     } else if (v->type == VAL_MODULE) {
         copy->data.module = v->data.module;
+    } else if (v->type == VAL_ITERATOR) {
+        __atomic_add_fetch(&v->data.iterator->refs, 1, __ATOMIC_RELAXED);
+        copy->data.iterator = v->data.iterator;
+    } else if (v->type == VAL_FILE) {
+        // Every copy writes through the same handle and buffer
+        file_handle_retain(v->data.file);
+        copy->data.file = v->data.file;
+    } else if (v->type == VAL_KV) {
+        kv_retain(v->data.kv);
+        copy->data.kv = v->data.kv;
+    } else if (v->type == VAL_HASH) {
+        hash_retain(v->data.hash);
+        copy->data.hash = v->data.hash;
+    } else if (v->type == VAL_CIPHER) {
+        cipher_key_retain(v->data.cipher);
+        copy->data.cipher = v->data.cipher;
+    } else if (v->type == VAL_PROMISE) {
+        __atomic_add_fetch(&v->data.promise->refs, 1, __ATOMIC_RELAXED);
+        copy->data.promise = v->data.promise;
     }
     return copy;
 }
 
+Value *make_string(const char *s) {
+    Value *v = create_value(VAL_STRING);
+    v->data.string = strdup_safe(s ? s : "");
+    return v;
+}
+
+Value *make_bytes(const void *data, size_t len) {
+    Value *v = create_value(VAL_BYTES);
+    v->data.bytes.data = malloc(len ? len : 1);
+    memcpy(v->data.bytes.data, data, len);
+    v->data.bytes.len = len;
+    return v;
+}
+
+// Counted data as a string, or as bytes when the caller asked for them. A
+// string ends at the first NUL, so binary data needs the "bytes" opt-in.
+Value *make_text_or_bytes(const char *data, size_t len, bool as_bytes) {
+    if (as_bytes) return make_bytes(data, len);
+    Value *v = create_value(VAL_STRING);
+    v->data.string = malloc(len + 1);
+    memcpy(v->data.string, data, len);
+    v->data.string[len] = 0;
+    return v;
+}
+
+// Keys of unknown kind (kv store keys): a string unless it holds a NUL byte
+// that a string would cut it short at
+Value *make_string_or_bytes(const char *data, size_t len) {
+    return make_text_or_bytes(data, len, memchr(data, 0, len) != NULL);
+}
+
+char *value_to_string(Value *v);
+char *json_stringify(Value *v, int indent);
+
+// The raw contents of a string or bytes value without copying; any other
+// value is rendered into *owned, which the caller frees
+const char *value_data(Value *v, size_t *len, char **owned) {
+    *owned = NULL;
+    if (v && v->type == VAL_BYTES) {
+        *len = v->data.bytes.len;
+        return (const char*)v->data.bytes.data;
+    }
+    if (v && v->type == VAL_STRING && v->data.string) {
+        *len = strlen(v->data.string);
+        return v->data.string;
+    }
+    *owned = value_to_string(v);
+    *len = strlen(*owned);
+    return *owned;
+}
+
+Value *make_number(double n) {
+    Value *v = create_value(VAL_NUMBER);
+    v->data.number = n;
+    return v;
+}
+
+Value *dict_get(Value *dict, const char *key) {
+    if (!dict || dict->type != VAL_DICT) return NULL;
+    for (int i = 0; i < dict->data.dict.count; i++) {
+        if (strcmp(dict->data.dict.keys[i], key) == 0) return dict->data.dict.values[i];
+    }
+    return NULL;
+}
+
+// Takes ownership of value
+void dict_set(Value *dict, const char *key, Value *value) {
+    for (int i = 0; i < dict->data.dict.count; i++) {
+        if (strcmp(dict->data.dict.keys[i], key) == 0) {
+            free_value(dict->data.dict.values[i]);
+            dict->data.dict.values[i] = value;
+            return;
+        }
+    }
+    if (dict->data.dict.count >= dict->data.dict.capacity) {
+        dict->data.dict.capacity *= 2;
+        dict->data.dict.keys = realloc(dict->data.dict.keys, dict->data.dict.capacity * sizeof(char*));
+        dict->data.dict.values = realloc(dict->data.dict.values, dict->data.dict.capacity * sizeof(Value*));
+    }
+    dict->data.dict.keys[dict->data.dict.count] = strdup_safe(key);
+    dict->data.dict.values[dict->data.dict.count] = value;
+    dict->data.dict.count++;
+}
+
+// Takes ownership of item
+void array_push(Value *arr, Value *item) {
+    if (arr->data.array.count >= arr->data.array.capacity) {
+        arr->data.array.capacity *= 2;
+        arr->data.array.items = realloc(arr->data.array.items, arr->data.array.capacity * sizeof(Value*));
+    }
+    arr->data.array.items[arr->data.array.count++] = item;
+}
+
 char *value_to_string(Value *v) {
     if (!v || v->type == VAL_NULL) return strdup("null");
     if (v->type == VAL_UNDEFINED) return strdup("undefined");
     
-    static char buffer[1024];
+    char buffer[1024];
     if (v->type == VAL_NUMBER) {
         if (v->data.number == (long)v->data.number) {
             snprintf(buffer, 1024, "%ld", (long)v->data.number);
@@ -268,6 +559,12 @@ char *value_to_string(Value *v) {
         return strdup(buffer);
     } else if (v->type == VAL_STRING) {
         return strdup_safe(v->data.string);
+    } else if (v->type == VAL_BYTES) {
+        // C string consumers see up to the first NUL, the rest is still copied
+        char *s = malloc(v->data.bytes.len + 1);
+        memcpy(s, v->data.bytes.data, v->data.bytes.len);
+        s[v->data.bytes.len] = 0;
+        return s;
     } else if (v->type == VAL_BOOL) {
         return strdup(v->data.boolean ? "true" : "false");
     } else if (v->type == VAL_ARRAY) {
@@ -284,6 +581,20 @@ char *value_to_string(Value *v) {
         sprintf(temp, "%s]", result);
         free(result);
         return temp;
+    } else if (v->type == VAL_DICT) {
+        return json_stringify(v, 0);
+    } else if (v->type == VAL_ITERATOR) {
+        return strdup("iterator");
+    } else if (v->type == VAL_FILE) {
+        return strdup("file");
+    } else if (v->type == VAL_KV) {
+        return strdup("kv");
+    } else if (v->type == VAL_HASH) {
+        return strdup("hash");
+    } else if (v->type == VAL_CIPHER) {
+        return strdup("cipher");
+    } else if (v->type == VAL_PROMISE) {
+        return strdup("promise");
     }
     return strdup("unknown");
 }
@@ -323,69 +634,311 @@ Value *get_var(const char *name) {
     return NULL;
 }
 
-Value *crypto_hash(const char *data, const char *algorithm) {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char*)data, strlen(data), hash);
-    
-    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        sprintf(hex + (i * 2), "%02x", hash[i]);
+void interpreter_snapshot_take(void) {
+    for (int i = 0; i < snapshot_var_count; i++) {
+        free(snapshot_vars[i].name);
+        free_value(snapshot_vars[i].value);
     }
-    hex[SHA256_DIGEST_LENGTH * 2] = 0;
+    free(snapshot_vars);
     
+    snapshot_vars = calloc(var_count > 0 ? var_count : 1, sizeof(Variable));
+    snapshot_var_count = var_count;
+    for (int i = 0; i < var_count; i++) {
+        snapshot_vars[i] = vars[i];
+        snapshot_vars[i].name = strdup_safe(vars[i].name);
+        snapshot_vars[i].value = copy_value(vars[i].value);
+    }
+}
+
+// Gives the calling thread its own copy of the script globals
+void interpreter_context_init(void) {
+    for (int i = 0; i < snapshot_var_count && i < MAX_VARS; i++) {
+        vars[i] = snapshot_vars[i];
+        vars[i].name = strdup_safe(snapshot_vars[i].name);
+        vars[i].value = copy_value(snapshot_vars[i].value);
+    }
+    var_count = snapshot_var_count < MAX_VARS ? snapshot_var_count : MAX_VARS;
+    current_scope = 0;
+    return_val = NULL;
+    is_returning = false;
+}
+
+void interpreter_context_free(void) {
+    while (var_count > 0) {
+        var_count--;
+        free(vars[var_count].name);
+        free_value(vars[var_count].value);
+    }
+}
+
+// Hex and base64. Hex is converted 16 bytes per step with SSE2; the tail,
+// and targets without SSE2, go through lookup tables, as base64 always does.
+typedef enum { CODEC_HEX, CODEC_BASE64, CODEC_BYTES } CodecEncoding;
+
+const char hex_digits[] = "0123456789abcdef";
+const char base64_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+const char base64url_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// Digit value + 1, so every character not listed is 0 without overlapping
+// designators; look up with hex_value()/base64_value(), which give -1 for those
+const unsigned char hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8,
+    ['8'] = 9, ['9'] = 10, ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+// Accepts both the standard and the URL-safe alphabet
+const unsigned char base64_values[256] = {
+    ['A'] = 1, ['B'] = 2, ['C'] = 3, ['D'] = 4, ['E'] = 5, ['F'] = 6, ['G'] = 7, ['H'] = 8,
+    ['I'] = 9, ['J'] = 10, ['K'] = 11, ['L'] = 12, ['M'] = 13, ['N'] = 14, ['O'] = 15, ['P'] = 16,
+    ['Q'] = 17, ['R'] = 18, ['S'] = 19, ['T'] = 20, ['U'] = 21, ['V'] = 22, ['W'] = 23, ['X'] = 24,
+    ['Y'] = 25, ['Z'] = 26, ['a'] = 27, ['b'] = 28, ['c'] = 29, ['d'] = 30, ['e'] = 31, ['f'] = 32,
+    ['g'] = 33, ['h'] = 34, ['i'] = 35, ['j'] = 36, ['k'] = 37, ['l'] = 38, ['m'] = 39, ['n'] = 40,
+    ['o'] = 41, ['p'] = 42, ['q'] = 43, ['r'] = 44, ['s'] = 45, ['t'] = 46, ['u'] = 47, ['v'] = 48,
+    ['w'] = 49, ['x'] = 50, ['y'] = 51, ['z'] = 52, ['0'] = 53, ['1'] = 54, ['2'] = 55, ['3'] = 56,
+    ['4'] = 57, ['5'] = 58, ['6'] = 59, ['7'] = 60, ['8'] = 61, ['9'] = 62, ['+'] = 63, ['-'] = 63,
+    ['/'] = 64, ['_'] = 64,
+};
+
+int hex_value(unsigned char c) {
+    return hex_values[c] - 1;
+}
+
+int base64_value(unsigned char c) {
+    return base64_values[c] - 1;
+}
+
+
+#ifdef __SSE2__
+// Nibble to lowercase hex digit: '0' + n, plus the gap up to 'a' when n > 9
+__m128i hex_digits_sse2(__m128i n) {
+    __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letters);
+}
+
+// Hex digits to nibbles; clears *valid when any byte is not a hex digit
+__m128i hex_nibbles_sse2(__m128i c, bool *valid) {
+    __m128i digit = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+    __m128i letter = _mm_sub_epi8(_mm_or_si128(c, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    // Unsigned range checks: x <= max exactly when min(x, max) == x
+    __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i is_letter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+    if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff) *valid = false;
+    return _mm_or_si128(_mm_and_si128(digit, is_digit),
+                        _mm_and_si128(_mm_add_epi8(letter, _mm_set1_epi8(10)), is_letter));
+}
+#endif
+
+// Writes len * 2 digits to dst (no terminator)
+void hex_encode_into(const unsigned char *src, size_t len, char *dst) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i low = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i hi = hex_digits_sse2(_mm_and_si128(_mm_srli_epi16(v, 4), low));
+        __m128i lo = hex_digits_sse2(_mm_and_si128(v, low));
+        _mm_storeu_si128((__m128i*)(dst + 2 * i), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(dst + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+#endif
+    for (; i < len; i++) {
+        dst[2 * i] = hex_digits[src[i] >> 4];
+        dst[2 * i + 1] = hex_digits[src[i] & 15];
+    }
+}
+
+// Writes len / 2 bytes to dst; false on odd length or a non-hex digit
+bool hex_decode_into(const char *src, size_t len, unsigned char *dst) {
+    if (len % 2) return false;
+    size_t i = 0;
+#ifdef __SSE2__
+    bool valid = true;
+    const __m128i low_byte = _mm_set1_epi16(0xff);
+    for (; i + 32 <= len; i += 32) {
+        __m128i a = hex_nibbles_sse2(_mm_loadu_si128((const __m128i*)(src + i)), &valid);
+        __m128i b = hex_nibbles_sse2(_mm_loadu_si128((const __m128i*)(src + i + 16)), &valid);
+        if (!valid) return false;
+        // Each 16-bit lane holds a high nibble in its low byte and the low nibble above it
+        a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, low_byte), 4), _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, low_byte), 4), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i*)(dst + i / 2), _mm_packus_epi16(a, b));
+    }
+#endif
+    for (; i < len; i += 2) {
+        int hi = hex_value(src[i]), lo = hex_value(src[i + 1]);
+        if ((hi | lo) < 0) return false;
+        dst[i / 2] = hi << 4 | lo;
+    }
+    return true;
+}
+
+// Writes the encoding to dst and returns its length; dst needs (len + 2) / 3 * 4 bytes.
+// url selects the URL-safe alphabet without padding.
+size_t base64_encode_into(const unsigned char *src, size_t len, char *dst, bool url) {
+    const char *digits = url ? base64url_digits : base64_digits;
+    char *out = dst;
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3) {
+        uint32_t n = (uint32_t)src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+        out[0] = digits[n >> 18];
+        out[1] = digits[(n >> 12) & 63];
+        out[2] = digits[(n >> 6) & 63];
+        out[3] = digits[n & 63];
+        out += 4;
+    }
+    if (i < len) {
+        uint32_t n = (uint32_t)src[i] << 16 | (i + 1 < len ? src[i + 1] << 8 : 0);
+        *out++ = digits[n >> 18];
+        *out++ = digits[(n >> 12) & 63];
+        if (i + 1 < len) *out++ = digits[(n >> 6) & 63];
+        else if (!url) *out++ = '=';
+        if (!url) *out++ = '=';
+    }
+    return out - dst;
+}
+
+// Either alphabet, with or without padding. Line breaks and other
+// whitespace (as in MIME or PEM bodies) are skipped. Padding ends the data:
+// only more padding or whitespace may follow it. dst needs len / 4 * 3 + 2
+// bytes; returns false on anything else that is not base64.
+bool base64_decode_into(const char *src, size_t len, unsigned char *dst, size_t *out_len) {
+    unsigned char *out = dst;
+    int pending[4], count = 0, pads = 0;
+    size_t i = 0;
+    for (;;) {
+        // Whole quads at once while the input is clean
+        for (; count == 0 && i + 4 <= len; i += 4) {
+            int a = base64_value(src[i]), b = base64_value(src[i + 1]);
+            int c = base64_value(src[i + 2]), d = base64_value(src[i + 3]);
+            if ((a | b | c | d) < 0) break;
+            uint32_t n = (uint32_t)a << 18 | b << 12 | c << 6 | d;
+            out[0] = n >> 16;
+            out[1] = n >> 8;
+            out[2] = n;
+            out += 3;
+        }
+        if (i >= len) break;
+        unsigned char ch = src[i++];
+        if (isspace(ch)) continue;
+        if (ch == '=') {
+            pads++;
+            continue;
+        }
+        if (pads || base64_value(ch) < 0) return false;
+        pending[count++] = base64_value(ch);
+        if (count == 4) {
+            uint32_t n = (uint32_t)pending[0] << 18 | pending[1] << 12 | pending[2] << 6 | pending[3];
+            out[0] = n >> 16;
+            out[1] = n >> 8;
+            out[2] = n;
+            out += 3;
+            count = 0;
+        }
+    }
+    // A quad of 2 or 3 characters takes 2 or 1 pads, or none at all; padding
+    // never stands alone
+    if (count == 1 || (pads && (count == 0 || pads != 4 - count))) return false;
+    if (count >= 2) *out++ = (pending[0] << 2) | (pending[1] >> 4);
+    if (count == 3) *out++ = (pending[1] << 4) | (pending[2] >> 2);
+    *out_len = out - dst;
+    return true;
+}
+
+// Reads an output-encoding argument; missing or null means hex
+bool codec_encoding(Value *v, CodecEncoding *out) {
+    *out = CODEC_HEX;
+    if (!v || v->type == VAL_NULL) return true;
+    if (v->type == VAL_STRING) {
+        if (strcmp(v->data.string, "hex") == 0) return true;
+        if (strcmp(v->data.string, "base64") == 0) return (*out = CODEC_BASE64), true;
+        if (strcmp(v->data.string, "bytes") == 0) return (*out = CODEC_BYTES), true;
+    }
+    printf("Error: encoding must be \"hex\", \"base64\" or \"bytes\"\n");
+    return false;
+}
+
+// Reads a text-or-bytes result argument; missing or null means "text"
+bool text_or_bytes(Value *v, const char *fn, bool *as_bytes) {
+    *as_bytes = false;
+    if (!v || v->type == VAL_NULL) return true;
+    if (v->type == VAL_STRING) {
+        if (strcmp(v->data.string, "text") == 0) return true;
+        if (strcmp(v->data.string, "bytes") == 0) return (*as_bytes = true), true;
+    }
+    printf("Error: %s() output must be \"text\" or \"bytes\"\n", fn);
+    return false;
+}
+
+Value *codec_encode(const unsigned char *data, size_t len, CodecEncoding encoding) {
+    if (encoding == CODEC_BYTES) return make_bytes(data, len);
     Value *v = create_value(VAL_STRING);
-    v->data.string = strdup(hex);
+    if (encoding == CODEC_BASE64) {
+        v->data.string = malloc((len + 2) / 3 * 4 + 1);
+        v->data.string[base64_encode_into(data, len, v->data.string, false)] = 0;
+    } else {
+        v->data.string = malloc(len * 2 + 1);
+        hex_encode_into(data, len, v->data.string);
+        v->data.string[len * 2] = 0;
+    }
     return v;
 }
 
-Value *crypto_encrypt_aes(const char *data, const char *key) {
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+// Returns NULL when hex has odd length or a non-hex digit
+unsigned char *crypto_unhex(const char *hex, size_t len, size_t *out_len) {
+    unsigned char *out = malloc(len / 2 + 1);
+    if (!hex_decode_into(hex, len, out)) {
+        free(out);
+        return NULL;
+    }
+    *out_len = len / 2;
+    return out;
+}
+
+// encrypt()/decrypt() reset one context per thread instead of allocating one per call
+__thread EVP_CIPHER_CTX *crypto_cipher_ctx = NULL;
+
+Value *crypto_encrypt_aes(const char *data, size_t data_len, const char *key, size_t key_len, CodecEncoding encoding) {
+    if (!crypto_cipher_ctx) crypto_cipher_ctx = EVP_CIPHER_CTX_new();
+    EVP_CIPHER_CTX *ctx = crypto_cipher_ctx;
     unsigned char iv[16];
     RAND_bytes(iv, 16);
     
     unsigned char key_hash[32];
-    SHA256((unsigned char*)key, strlen(key), key_hash);
+    SHA256((unsigned char*)key, key_len, key_hash);
     
-    unsigned char *ciphertext = malloc(strlen(data) + 32);
+    // iv | ciphertext, encoded in one pass
+    unsigned char *out = malloc(16 + data_len + 32);
+    memcpy(out, iv, 16);
+    unsigned char *ciphertext = out + 16;
     int len, ciphertext_len;
     
     EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key_hash, iv);
-    EVP_EncryptUpdate(ctx, ciphertext, &len, (unsigned char*)data, strlen(data));
+    EVP_EncryptUpdate(ctx, ciphertext, &len, (unsigned char*)data, data_len);
     ciphertext_len = len;
     EVP_EncryptFinal_ex(ctx, ciphertext + len, &len);
     ciphertext_len += len;
-    EVP_CIPHER_CTX_free(ctx);
-    
-    char *result = malloc((16 + ciphertext_len) * 2 + 1);
-    for (int i = 0; i < 16; i++) {
-        sprintf(result + (i * 2), "%02x", iv[i]);
-    }
-    for (int i = 0; i < ciphertext_len; i++) {
-        sprintf(result + (16 * 2) + (i * 2), "%02x", ciphertext[i]);
-    }
-    free(ciphertext);
+    EVP_CIPHER_CTX_reset(ctx);
     
-    Value *v = create_value(VAL_STRING);
-    v->data.string = result;
+    Value *v = codec_encode(out, 16 + ciphertext_len, encoding);
+    free(out);
     return v;
 }
 
-Value *crypto_decrypt_aes(const char *encrypted_hex, const char *key) {
-    int hex_len = strlen(encrypted_hex);
-    int data_len = hex_len / 2;
-    unsigned char *data = malloc(data_len);
-    
-    for (int i = 0; i < data_len; i++) {
-        sscanf(encrypted_hex + (i * 2), "%2hhx", &data[i]);
+// Takes iv | ciphertext as raw bytes
+Value *crypto_decrypt_aes(const unsigned char *data, size_t data_len, const char *key, size_t key_len, bool as_bytes) {
+    if (data_len < 16) {
+        printf("Error: decrypt() input is too short\n");
+        return create_value(VAL_NULL);
     }
-    
     unsigned char iv[16];
     memcpy(iv, data, 16);
     
     unsigned char key_hash[32];
-    SHA256((unsigned char*)key, strlen(key), key_hash);
+    SHA256((unsigned char*)key, key_len, key_hash);
     
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!crypto_cipher_ctx) crypto_cipher_ctx = EVP_CIPHER_CTX_new();
+    EVP_CIPHER_CTX *ctx = crypto_cipher_ctx;
     unsigned char *plaintext = malloc(data_len);
     int len, plaintext_len;
     
@@ -394,299 +947,7841 @@ Value *crypto_decrypt_aes(const char *encrypted_hex, const char *key) {
     plaintext_len = len;
     EVP_DecryptFinal_ex(ctx, plaintext + len, &len);
     plaintext_len += len;
-    EVP_CIPHER_CTX_free(ctx);
-    free(data);
+    EVP_CIPHER_CTX_reset(ctx);
     
-    plaintext[plaintext_len] = 0;
-    Value *v = create_value(VAL_STRING);
-    v->data.string = strdup((char*)plaintext);
+    Value *v = make_text_or_bytes((char*)plaintext, plaintext_len, as_bytes);
     free(plaintext);
     return v;
 }
 
-Value *crypto_generate_salt(int length) {
-    unsigned char salt[length];
-    RAND_bytes(salt, length);
-    
-    char *hex = malloc(length * 2 + 1);
-    for (int i = 0; i < length; i++) {
-        sprintf(hex + (i * 2), "%02x", salt[i]);
+Value *crypto_generate_salt(int length, CodecEncoding encoding) {
+    unsigned char salt[length];
+    RAND_bytes(salt, length);
+    return codec_encode(salt, length, encoding);
+}
+
+// Streaming digests: hash_init()/hash_update()/hash_final() keep an EVP
+// context across calls, and hash_file() feeds a file through one in large
+// windows so memory use does not grow with the file.
+#define HASH_FILE_WINDOW (64 << 20)
+
+typedef struct HashState {
+    int refs;
+    EVP_MD_CTX *ctx;  // NULL once hash_final() has run
+    pthread_mutex_t lock;
+} HashState;
+
+// Digests resolved by name once and kept for the life of the process. On
+// OpenSSL 3 an explicitly fetched EVP_MD also spares every init a provider
+// lookup. Entries are published by bumping count, so readers need no lock.
+#define DIGEST_CACHE_SIZE 64
+
+typedef struct {
+    char name[32];
+    const EVP_MD *md;
+} DigestCacheEntry;
+
+typedef struct {
+    DigestCacheEntry entries[DIGEST_CACHE_SIZE];
+    int count;
+    pthread_mutex_t lock;
+} DigestCache;
+
+DigestCache digest_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Short names scripts are likely to use, mapped to OpenSSL's
+const char *digest_aliases[][2] = {
+    { "sha-1", "sha1" }, { "sha-256", "sha256" }, { "sha-384", "sha384" }, { "sha-512", "sha512" },
+    { "sha3", "sha3-256" }, { "blake2b", "blake2b512" }, { "blake2s", "blake2s256" },
+};
+
+const EVP_MD *crypto_digest(const char *algorithm) {
+    char name[32];
+    size_t n = 0;
+    for (; algorithm[n] && n < sizeof(name) - 1; n++) name[n] = tolower((unsigned char)algorithm[n]);
+    name[n] = 0;
+    
+    int count = __atomic_load_n(&digest_cache.count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(digest_cache.entries[i].name, name) == 0) return digest_cache.entries[i].md;
+    }
+    
+    const char *lookup = name;
+    for (size_t i = 0; i < sizeof(digest_aliases) / sizeof(digest_aliases[0]); i++) {
+        if (strcmp(name, digest_aliases[i][0]) == 0) lookup = digest_aliases[i][1];
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    const EVP_MD *md = EVP_MD_fetch(NULL, lookup, NULL);
+#else
+    const EVP_MD *md = EVP_get_digestbyname(lookup);
+#endif
+    if (!md) {
+        printf("Error: unknown hash algorithm \"%s\"\n", algorithm);
+        return NULL;
+    }
+    pthread_mutex_lock(&digest_cache.lock);
+    count = digest_cache.count;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(digest_cache.entries[i].name, name) == 0) {
+            // Another thread got here first
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+            EVP_MD_free((EVP_MD*)md);
+#endif
+            md = digest_cache.entries[i].md;
+            count = -1;
+            break;
+        }
+    }
+    if (count >= 0 && count < DIGEST_CACHE_SIZE) {
+        strcpy(digest_cache.entries[count].name, name);
+        digest_cache.entries[count].md = md;
+        __atomic_store_n(&digest_cache.count, count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&digest_cache.lock);
+    return md;
+}
+
+// One context per thread, reset for each message instead of allocated
+__thread EVP_MD_CTX *crypto_md_ctx = NULL;
+
+Value *crypto_hash(const char *data, size_t data_len, const char *algorithm, CodecEncoding encoding) {
+    const EVP_MD *md = crypto_digest(algorithm);
+    if (!md) return create_value(VAL_NULL);
+    if (!crypto_md_ctx) crypto_md_ctx = EVP_MD_CTX_new();
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    if (EVP_DigestInit_ex(crypto_md_ctx, md, NULL) != 1 || EVP_DigestUpdate(crypto_md_ctx, data, data_len) != 1 ||
+        EVP_DigestFinal_ex(crypto_md_ctx, digest, &len) != 1) {
+        printf("Error: hash() failed for \"%s\"\n", algorithm);
+        return create_value(VAL_NULL);
+    }
+    return codec_encode(digest, len, encoding);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+EVP_MAC *crypto_hmac_mac = NULL;
+pthread_once_t crypto_hmac_once = PTHREAD_ONCE_INIT;
+__thread EVP_MAC_CTX *crypto_hmac_ctx = NULL;
+
+void crypto_hmac_fetch(void) {
+    crypto_hmac_mac = EVP_MAC_fetch(NULL, "HMAC", NULL);
+}
+#endif
+
+Value *crypto_hmac(const char *key, size_t key_len, const char *data, size_t data_len, const char *algorithm,
+                   CodecEncoding encoding) {
+    const EVP_MD *md = crypto_digest(algorithm);
+    if (!md) return create_value(VAL_NULL);
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    size_t len = 0;
+    bool ok;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    // The thread's MAC context is re-keyed per call rather than rebuilt
+    pthread_once(&crypto_hmac_once, crypto_hmac_fetch);
+    if (!crypto_hmac_ctx && crypto_hmac_mac) crypto_hmac_ctx = EVP_MAC_CTX_new(crypto_hmac_mac);
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*)EVP_MD_get0_name(md), 0),
+        OSSL_PARAM_construct_end()
+    };
+    // A zero-length key is legal HMAC but OpenSSL wants a non-NULL pointer
+    ok = crypto_hmac_ctx && EVP_MAC_init(crypto_hmac_ctx, (const unsigned char*)(key_len ? key : ""), key_len, params) == 1 &&
+         EVP_MAC_update(crypto_hmac_ctx, (const unsigned char*)data, data_len) == 1 &&
+         EVP_MAC_final(crypto_hmac_ctx, digest, &len, sizeof(digest)) == 1;
+#else
+    unsigned int out_len = 0;
+    ok = HMAC(md, key, key_len, (const unsigned char*)data, data_len, digest, &out_len) != NULL;
+    len = out_len;
+#endif
+    if (!ok) {
+        printf("Error: hmac() failed for \"%s\"\n", algorithm);
+        return create_value(VAL_NULL);
+    }
+    return codec_encode(digest, len, encoding);
+}
+
+Value *hash_init(const char *algorithm) {
+    const EVP_MD *md = crypto_digest(algorithm);
+    if (!md) return create_value(VAL_NULL);
+    HashState *h = calloc(1, sizeof(HashState));
+    h->refs = 1;
+    h->ctx = EVP_MD_CTX_new();
+    pthread_mutex_init(&h->lock, NULL);
+    EVP_DigestInit_ex(h->ctx, md, NULL);
+    Value *v = create_value(VAL_HASH);
+    v->data.hash = h;
+    return v;
+}
+
+bool hash_update(HashState *h, const void *data, size_t len) {
+    pthread_mutex_lock(&h->lock);
+    bool ok = h->ctx && EVP_DigestUpdate(h->ctx, data, len) == 1;
+    pthread_mutex_unlock(&h->lock);
+    return ok;
+}
+
+// Returns NULL when the digest was already finished
+Value *hash_final(HashState *h, CodecEncoding encoding) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    pthread_mutex_lock(&h->lock);
+    bool ok = h->ctx && EVP_DigestFinal_ex(h->ctx, digest, &len) == 1;
+    if (h->ctx) EVP_MD_CTX_free(h->ctx);
+    h->ctx = NULL;
+    pthread_mutex_unlock(&h->lock);
+    return ok ? codec_encode(digest, len, encoding) : NULL;
+}
+
+void hash_retain(HashState *h) {
+    __atomic_add_fetch(&h->refs, 1, __ATOMIC_RELAXED);
+}
+
+void hash_release(HashState *h) {
+    if (__atomic_sub_fetch(&h->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (h->ctx) EVP_MD_CTX_free(h->ctx);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+}
+
+// Regular files are mapped a window at a time; pipes and special files are read
+Value *hash_file(const char *path, const char *algorithm, CodecEncoding encoding) {
+    const EVP_MD *md = crypto_digest(algorithm);
+    if (!md) return create_value(VAL_NULL);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("Error: Cannot open %s: %s\n", path, strerror(errno));
+        return create_value(VAL_NULL);
+    }
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, md, NULL);
+    bool ok = true;
+    struct stat st;
+    off_t done = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        while (ok && done < st.st_size) {
+            size_t len = st.st_size - done < HASH_FILE_WINDOW ? st.st_size - done : HASH_FILE_WINDOW;
+            void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, done);
+            if (p == MAP_FAILED) break;
+            madvise(p, len, MADV_SEQUENTIAL);
+            ok = EVP_DigestUpdate(ctx, p, len) == 1;
+            munmap(p, len);
+            done += len;
+        }
+    }
+    // Whatever mapping did not cover (growth since fstat, or no mapping at all)
+    if (ok && (done == 0 || lseek(fd, done, SEEK_SET) == done)) {
+        size_t cap = 1 << 20;
+        char *buf = malloc(cap);
+        for (;;) {
+            ssize_t n = read(fd, buf, cap);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) ok = false;
+            if (n <= 0) break;
+            if (EVP_DigestUpdate(ctx, buf, n) != 1) ok = false;
+        }
+        free(buf);
+    }
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    if (ok) ok = EVP_DigestFinal_ex(ctx, digest, &len) == 1;
+    EVP_MD_CTX_free(ctx);
+    close(fd);
+    if (!ok) {
+        printf("Error: hash_file() failed on %s: %s\n", path, strerror(errno));
+        return create_value(VAL_NULL);
+    }
+    return codec_encode(digest, len, encoding);
+}
+
+// Key handles: cipher_key() derives the key once and keeps an encrypt and a
+// decrypt context initialised with it, so each message only sets a fresh
+// nonce. The AEAD modes emit nonce | ciphertext | tag; "aes-256-cbc" emits
+// iv | ciphertext like encrypt(), which can decrypt it.
+#define CIPHER_TAG_LEN 16
+#define CIPHER_PBKDF2_ROUNDS 100000
+
+typedef struct CipherKey {
+    int refs;
+    bool aead;
+    int nonce_len;
+    EVP_CIPHER_CTX *enc, *dec;
+    pthread_mutex_t lock;
+} CipherKey;
+
+// A 32-byte bytes key is used as is. Otherwise the key is stretched with
+// PBKDF2 when a salt is given, or hashed with SHA-256 like encrypt() does.
+Value *cipher_key_new(const char *key, size_t key_len, bool raw, const char *salt, size_t salt_len,
+                      const char *algorithm) {
+    const EVP_CIPHER *cipher = NULL;
+    if (strcasecmp(algorithm, "aes-256-gcm") == 0) cipher = EVP_aes_256_gcm();
+    else if (strcasecmp(algorithm, "chacha20-poly1305") == 0) cipher = EVP_chacha20_poly1305();
+    else if (strcasecmp(algorithm, "aes-256-cbc") == 0) cipher = EVP_aes_256_cbc();
+    if (!cipher) {
+        printf("Error: cipher_key() algorithm must be \"aes-256-gcm\", \"chacha20-poly1305\" or \"aes-256-cbc\", not \"%s\"\n", algorithm);
+        return create_value(VAL_NULL);
+    }
+    unsigned char derived[32];
+    if (raw && key_len == sizeof(derived) && !salt) {
+        memcpy(derived, key, sizeof(derived));
+    } else if (salt) {
+        PKCS5_PBKDF2_HMAC(key, key_len, (const unsigned char*)salt, salt_len, CIPHER_PBKDF2_ROUNDS,
+                          EVP_sha256(), sizeof(derived), derived);
+    } else {
+        SHA256((const unsigned char*)key, key_len, derived);
+    }
+    
+    CipherKey *k = calloc(1, sizeof(CipherKey));
+    k->refs = 1;
+    k->aead = EVP_CIPHER_mode(cipher) != EVP_CIPH_CBC_MODE;
+    k->nonce_len = EVP_CIPHER_iv_length(cipher);
+    k->enc = EVP_CIPHER_CTX_new();
+    k->dec = EVP_CIPHER_CTX_new();
+    pthread_mutex_init(&k->lock, NULL);
+    EVP_EncryptInit_ex(k->enc, cipher, NULL, derived, NULL);
+    EVP_DecryptInit_ex(k->dec, cipher, NULL, derived, NULL);
+    OPENSSL_cleanse(derived, sizeof(derived));
+    Value *v = create_value(VAL_CIPHER);
+    v->data.cipher = k;
+    return v;
+}
+
+void cipher_key_retain(CipherKey *k) {
+    __atomic_add_fetch(&k->refs, 1, __ATOMIC_RELAXED);
+}
+
+void cipher_key_release(CipherKey *k) {
+    if (__atomic_sub_fetch(&k->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    EVP_CIPHER_CTX_free(k->enc);
+    EVP_CIPHER_CTX_free(k->dec);
+    pthread_mutex_destroy(&k->lock);
+    free(k);
+}
+
+Value *cipher_encrypt(CipherKey *k, const char *data, size_t len, const char *aad, size_t aad_len,
+                      CodecEncoding encoding) {
+    unsigned char *out = malloc(k->nonce_len + len + 2 * CIPHER_TAG_LEN);
+    RAND_bytes(out, k->nonce_len);
+    int n, total;
+    pthread_mutex_lock(&k->lock);
+    // A NULL cipher and key keep the expanded key; only the nonce changes
+    bool ok = EVP_EncryptInit_ex(k->enc, NULL, NULL, NULL, out) == 1 &&
+              (!k->aead || !aad_len || EVP_EncryptUpdate(k->enc, NULL, &n, (const unsigned char*)aad, aad_len) == 1) &&
+              EVP_EncryptUpdate(k->enc, out + k->nonce_len, &n, (const unsigned char*)data, len) == 1;
+    total = k->nonce_len + n;
+    ok = ok && EVP_EncryptFinal_ex(k->enc, out + total, &n) == 1;
+    total += n;
+    if (ok && k->aead) {
+        ok = EVP_CIPHER_CTX_ctrl(k->enc, EVP_CTRL_AEAD_GET_TAG, CIPHER_TAG_LEN, out + total) == 1;
+        total += CIPHER_TAG_LEN;
+    }
+    pthread_mutex_unlock(&k->lock);
+    Value *v = ok ? codec_encode(out, total, encoding) : NULL;
+    free(out);
+    if (!v) printf("Error: cipher_encrypt() failed\n");
+    return v ? v : create_value(VAL_NULL);
+}
+
+// Fails (null) when the message was tampered with or the key is wrong
+Value *cipher_decrypt(CipherKey *k, const unsigned char *in, size_t len, const char *aad, size_t aad_len, bool as_bytes) {
+    size_t overhead = k->nonce_len + (k->aead ? CIPHER_TAG_LEN : 0);
+    if (len < overhead || (!k->aead && (len - overhead) % 16 != 0)) {
+        printf("Error: cipher_decrypt() input is too short or malformed\n");
+        return create_value(VAL_NULL);
+    }
+    size_t body = len - overhead;
+    unsigned char *out = malloc(body + 16);
+    int n, total = 0;
+    pthread_mutex_lock(&k->lock);
+    bool ok = EVP_DecryptInit_ex(k->dec, NULL, NULL, NULL, in) == 1 &&
+              (!k->aead || !aad_len || EVP_DecryptUpdate(k->dec, NULL, &n, (const unsigned char*)aad, aad_len) == 1) &&
+              EVP_DecryptUpdate(k->dec, out, &n, in + k->nonce_len, body) == 1;
+    total = n;
+    if (ok && k->aead) ok = EVP_CIPHER_CTX_ctrl(k->dec, EVP_CTRL_AEAD_SET_TAG, CIPHER_TAG_LEN,
+                                                (void*)(in + len - CIPHER_TAG_LEN)) == 1;
+    ok = ok && EVP_DecryptFinal_ex(k->dec, out + total, &n) == 1;
+    total += n;
+    pthread_mutex_unlock(&k->lock);
+    Value *v = ok ? make_text_or_bytes((char*)out, total, as_bytes) : NULL;
+    free(out);
+    if (!v) printf("Error: cipher_decrypt() authentication failed\n");
+    return v ? v : create_value(VAL_NULL);
+}
+
+// JSON. json_parse works in two stages, after simdjson. Stage 1 sweeps the
+// input 64 bytes at a time, building bitmasks of quotes, backslashes,
+// structural characters and whitespace (SSE2 compares where available, a
+// byte loop otherwise). From those it derives which bytes sit inside
+// strings with a prefix XOR and records an index of every structural
+// character, opening quote and scalar start. Stage 2 builds Values by
+// walking that index, so only string and number bytes are looked at again.
+#define JSON_MAX_DEPTH 1024
+
+typedef struct {
+    const char *buf;
+    size_t len;
+    uint32_t *index;
+    size_t count;
+    size_t pos;
+    int depth;
+    // Children of the containers being parsed; each container takes exactly
+    // its own slice once it closes, so no array is ever grown and copied
+    Value **items;
+    char **keys;
+    size_t top;
+    size_t cap;
+    const char *error;
+    size_t error_at;
+} JsonParser;
+
+typedef struct {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op;
+    uint64_t space;
+} JsonMasks;
+
+void json_block_masks(const unsigned char *p, JsonMasks *m) {
+#if defined(__SSE2__)
+    m->quote = m->backslash = m->op = m->space = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i * 16));
+        // '[' and ']' are '{' and '}' with the 0x20 bit clear
+        __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i op = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')), _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+        __m128i space = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        int shift = i * 16;
+        m->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << shift;
+        m->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << shift;
+        m->op |= (uint64_t)(uint16_t)_mm_movemask_epi8(op) << shift;
+        m->space |= (uint64_t)(uint16_t)_mm_movemask_epi8(space) << shift;
+    }
+#else
+    m->quote = m->backslash = m->op = m->space = 0;
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = 1ULL << i;
+        switch (p[i]) {
+            case '"': m->quote |= bit; break;
+            case '\\': m->backslash |= bit; break;
+            case '{': case '}': case '[': case ']': case ':': case ',': m->op |= bit; break;
+            case ' ': case '\t': case '\n': case '\r': m->space |= bit; break;
+        }
+    }
+#endif
+}
+
+// Characters escaped by a backslash: those after an odd-length run of them.
+// *carry says whether the previous block ended mid-escape.
+uint64_t json_escaped(uint64_t backslash, uint64_t *carry) {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    backslash &= ~*carry;
+    uint64_t follows_escape = backslash << 1 | *carry;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t even_starts;
+    *carry = __builtin_add_overflow(odd_starts, backslash, &even_starts);
+    return (even_bits ^ (even_starts << 1)) & follows_escape;
+}
+
+uint64_t json_prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+bool json_build_index(JsonParser *p) {
+    size_t cap = p->len / 8 + 128;
+    p->index = malloc(cap * sizeof(uint32_t));
+    uint64_t escape_carry = 0, in_string_carry = 0, scalar_carry = 0;
+    
+    for (size_t off = 0; off < p->len; off += 64) {
+        const unsigned char *block = (const unsigned char*)p->buf + off;
+        unsigned char tail[64];
+        if (p->len - off < 64) {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block, p->len - off);
+            block = tail;
+        }
+        JsonMasks m;
+        json_block_masks(block, &m);
+        
+        uint64_t quote = m.quote & ~json_escaped(m.backslash, &escape_carry);
+        // Set from each opening quote up to (not including) its closing quote
+        uint64_t in_string = json_prefix_xor(quote) ^ in_string_carry;
+        in_string_carry = (uint64_t)((int64_t)in_string >> 63);
+        uint64_t scalar = ~(m.op | m.space | quote | in_string);
+        uint64_t structural = (m.op & ~in_string) | (quote & in_string) |
+                              (scalar & ~(scalar << 1 | scalar_carry));
+        scalar_carry = scalar >> 63;
+        
+        if (p->count + 64 > cap) {
+            cap *= 2;
+            p->index = realloc(p->index, cap * sizeof(uint32_t));
+        }
+        while (structural) {
+            p->index[p->count++] = (uint32_t)(off + __builtin_ctzll(structural));
+            structural &= structural - 1;
+        }
+    }
+    if (in_string_carry) {
+        p->error = "unterminated string";
+        p->error_at = p->len;
+        return false;
+    }
+    return true;
+}
+
+Value *json_fail(JsonParser *p, const char *message, size_t at) {
+    if (!p->error) {
+        p->error = message;
+        p->error_at = at;
+    }
+    return NULL;
+}
+
+void json_put_utf8(char *out, size_t *n, uint32_t cp) {
+    if (cp < 0x80) {
+        out[(*n)++] = cp;
+    } else if (cp < 0x800) {
+        out[(*n)++] = 0xC0 | (cp >> 6);
+        out[(*n)++] = 0x80 | (cp & 0x3F);
+    } else if (cp < 0x10000) {
+        out[(*n)++] = 0xE0 | (cp >> 12);
+        out[(*n)++] = 0x80 | ((cp >> 6) & 0x3F);
+        out[(*n)++] = 0x80 | (cp & 0x3F);
+    } else {
+        out[(*n)++] = 0xF0 | (cp >> 18);
+        out[(*n)++] = 0x80 | ((cp >> 12) & 0x3F);
+        out[(*n)++] = 0x80 | ((cp >> 6) & 0x3F);
+        out[(*n)++] = 0x80 | (cp & 0x3F);
+    }
+}
+
+int json_hex4(const char *s) {
+    int v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = s[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= c - '0';
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') v |= (c | 0x20) - 'a' + 10;
+        else return -1;
+    }
+    return v;
+}
+
+// Decodes the string whose opening quote is at start; returns a heap copy
+char *json_parse_string(JsonParser *p, size_t start) {
+    const char *s = p->buf + start + 1;
+    const char *end = p->buf + p->len;
+    const char *close = s;
+    // Stage 1 already proved the closing quote exists; find it past any escapes
+    for (;;) {
+        close = memchr(close, '"', end - close);
+        size_t slashes = 0;
+        while (close - slashes > s && close[-1 - (ptrdiff_t)slashes] == '\\') slashes++;
+        if (slashes % 2 == 0) break;
+        close++;
+    }
+    
+    size_t raw_len = close - s;
+    // Control characters must be escaped inside strings
+    for (const char *q = s; q < close; q++) {
+        if ((unsigned char)*q < 0x20) {
+            json_fail(p, "control character in string", q - p->buf);
+            return NULL;
+        }
+    }
+    char *out = malloc(raw_len + 1);
+    const char *bs = memchr(s, '\\', raw_len);
+    if (!bs) {
+        memcpy(out, s, raw_len);
+        out[raw_len] = 0;
+        return out;
+    }
+    
+    size_t n = bs - s;
+    memcpy(out, s, n);
+    for (const char *q = bs; q < close; ) {
+        if (*q != '\\') {
+            out[n++] = *q++;
+            continue;
+        }
+        q++;
+        switch (*q++) {
+            case '"': out[n++] = '"'; break;
+            case '\\': out[n++] = '\\'; break;
+            case '/': out[n++] = '/'; break;
+            case 'b': out[n++] = '\b'; break;
+            case 'f': out[n++] = '\f'; break;
+            case 'n': out[n++] = '\n'; break;
+            case 'r': out[n++] = '\r'; break;
+            case 't': out[n++] = '\t'; break;
+            case 'u': {
+                int cp = close - q >= 4 ? json_hex4(q) : -1;
+                if (cp < 0) {
+                    free(out);
+                    json_fail(p, "bad \\u escape", q - p->buf);
+                    return NULL;
+                }
+                q += 4;
+                // A surrogate pair spells one code point outside the BMP
+                if (cp >= 0xD800 && cp < 0xDC00 && close - q >= 6 && q[0] == '\\' && q[1] == 'u') {
+                    int low = json_hex4(q + 2);
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                        q += 6;
+                    }
+                }
+                // A lone surrogate has no UTF-8 encoding
+                if (cp >= 0xD800 && cp < 0xE000) cp = 0xFFFD;
+                json_put_utf8(out, &n, cp);
+                break;
+            }
+            default:
+                free(out);
+                json_fail(p, "bad escape", q - 1 - p->buf);
+                return NULL;
+        }
+    }
+    out[n] = 0;
+    return out;
+}
+
+// Integers and short decimals convert exactly with one multiply or divide;
+// anything else goes to strtod
+// Parses a JSON-style decimal at s and returns the first byte after it, or NULL.
+// Shared by the JSON and CSV readers.
+const char *parse_decimal(const char *s, const char *end, double *out) {
+    static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const char *q = s;
+    bool neg = q < end && *q == '-';
+    if (neg) q++;
+    uint64_t mantissa = 0;
+    int digits = 0, exp10 = 0;
+    const char *first = q;
+    while (q < end && *q >= '0' && *q <= '9') {
+        if (digits < 19) mantissa = mantissa * 10 + (*q - '0');
+        else exp10++;
+        if (mantissa) digits++;
+        q++;
+    }
+    if (q == first) return NULL;
+    if (q < end && *q == '.') {
+        q++;
+        const char *frac = q;
+        while (q < end && *q >= '0' && *q <= '9') {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*q - '0');
+                exp10--;
+                if (mantissa) digits++;
+            }
+            q++;
+        }
+        if (q == frac) return NULL;
+    }
+    if (q < end && (*q == 'e' || *q == 'E')) {
+        q++;
+        bool exp_neg = q < end && *q == '-';
+        if (q < end && (*q == '-' || *q == '+')) q++;
+        const char *exp_start = q;
+        int e = 0;
+        while (q < end && *q >= '0' && *q <= '9') {
+            if (e < 100000) e = e * 10 + (*q - '0');
+            q++;
+        }
+        if (q == exp_start) return NULL;
+        exp10 += exp_neg ? -e : e;
+    }
+    if (digits < 19 && mantissa <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+        double d = (double)mantissa;
+        d = exp10 < 0 ? d / pow10[-exp10] : d * pow10[exp10];
+        *out = neg ? -d : d;
+        return q;
+    }
+    char tmp[128];
+    size_t n = q - s;
+    char *copy = n < sizeof(tmp) ? tmp : malloc(n + 1);
+    memcpy(copy, s, n);
+    copy[n] = 0;
+    *out = strtod(copy, NULL);
+    if (copy != tmp) free(copy);
+    return q;
+}
+
+// RFC 8259 numbers: no leading zeros, unlike what parse_decimal alone accepts
+bool json_parse_number(JsonParser *p, size_t start, double *out) {
+    const char *end = p->buf + p->len;
+    const char *digits = p->buf + start + (p->buf[start] == '-');
+    if (end - digits > 1 && digits[0] == '0' && digits[1] >= '0' && digits[1] <= '9') return false;
+    const char *q = parse_decimal(p->buf + start, end, out);
+    return q && (q == end || strchr(" \t\r\n,]}:", *q));
+}
+
+Value *json_parse_value(JsonParser *p) {
+    if (p->pos >= p->count) return json_fail(p, "unexpected end of input", p->len);
+    size_t at = p->index[p->pos++];
+    char c = p->buf[at];
+    
+    if (c == '{' || c == '[') {
+        if (++p->depth > JSON_MAX_DEPTH) return json_fail(p, "nesting too deep", at);
+        bool object = c == '{';
+        char close = object ? '}' : ']';
+        size_t base = p->top;
+        bool ok = true;
+        if (p->pos < p->count && p->buf[p->index[p->pos]] == close) {
+            p->pos++;
+        } else {
+            for (;;) {
+                char *key = NULL;
+                if (object) {
+                    size_t key_at = p->pos < p->count ? p->index[p->pos] : p->len;
+                    if (key_at >= p->len || p->buf[key_at] != '"') {
+                        json_fail(p, "expected a string key", key_at);
+                        ok = false;
+                        break;
+                    }
+                    p->pos++;
+                    key = json_parse_string(p, key_at);
+                    size_t colon = p->pos < p->count ? p->index[p->pos] : p->len;
+                    if (!key || colon >= p->len || p->buf[colon] != ':') {
+                        free(key);
+                        json_fail(p, "expected ':'", colon);
+                        ok = false;
+                        break;
+                    }
+                    p->pos++;
+                }
+                Value *item = json_parse_value(p);
+                if (!item) {
+                    free(key);
+                    ok = false;
+                    break;
+                }
+                if (p->top == p->cap) {
+                    p->cap = p->cap ? p->cap * 2 : 1024;
+                    p->items = realloc(p->items, p->cap * sizeof(Value*));
+                    p->keys = realloc(p->keys, p->cap * sizeof(char*));
+                }
+                p->keys[p->top] = key;
+                p->items[p->top++] = item;
+                
+                size_t sep = p->pos < p->count ? p->index[p->pos] : p->len;
+                char sc = sep < p->len ? p->buf[sep] : 0;
+                p->pos++;
+                if (sc == close) break;
+                if (sc != ',') {
+                    json_fail(p, object ? "expected ',' or '}'" : "expected ',' or ']'", sep);
+                    ok = false;
+                    break;
+                }
+            }
+        }
+        
+        size_t n = p->top - base;
+        p->top = base;
+        if (!ok) {
+            for (size_t i = base; i < base + n; i++) {
+                free(p->keys[i]);
+                free_value(p->items[i]);
+            }
+            return NULL;
+        }
+        p->depth--;
+        // Same layout create_value gives, sized to fit; capacity stays >= 1 so later growth can double it
+        size_t cap = n > 0 ? n : 1;
+        Value *v = calloc(1, sizeof(Value));
+        v->type = object ? VAL_DICT : VAL_ARRAY;
+        if (object) {
+            v->data.dict.keys = malloc(cap * sizeof(char*));
+            v->data.dict.values = malloc(cap * sizeof(Value*));
+            if (n > 0) {
+                memcpy(v->data.dict.keys, p->keys + base, n * sizeof(char*));
+                memcpy(v->data.dict.values, p->items + base, n * sizeof(Value*));
+            }
+            v->data.dict.count = n;
+            v->data.dict.capacity = cap;
+        } else {
+            v->data.array.items = malloc(cap * sizeof(Value*));
+            if (n > 0) memcpy(v->data.array.items, p->items + base, n * sizeof(Value*));
+            v->data.array.count = n;
+            v->data.array.capacity = cap;
+        }
+        // A repeated key keeps its first value, the one dict_get finds
+        return v;
+    }
+    
+    if (c == '"') {
+        char *s = json_parse_string(p, at);
+        if (!s) return NULL;
+        Value *v = create_value(VAL_STRING);
+        v->data.string = s;
+        return v;
+    }
+    
+    size_t rest = p->len - at;
+    const char *s = p->buf + at;
+    if (rest >= 4 && memcmp(s, "true", 4) == 0 && (rest == 4 || strchr(" \t\r\n,]}", s[4]))) {
+        Value *v = create_value(VAL_BOOL);
+        v->data.boolean = true;
+        return v;
+    }
+    if (rest >= 5 && memcmp(s, "false", 5) == 0 && (rest == 5 || strchr(" \t\r\n,]}", s[5]))) {
+        return create_value(VAL_BOOL);
+    }
+    if (rest >= 4 && memcmp(s, "null", 4) == 0 && (rest == 4 || strchr(" \t\r\n,]}", s[4]))) {
+        return create_value(VAL_NULL);
+    }
+    double d;
+    if ((c == '-' || (c >= '0' && c <= '9')) && json_parse_number(p, at, &d)) return make_number(d);
+    return json_fail(p, "unexpected character", at);
+}
+
+// Returns NULL after printing an error for malformed input
+Value *json_parse(const char *buf, size_t len) {
+    if (len > UINT32_MAX) {
+        printf("Error: json_parse: input larger than 4 GB\n");
+        return NULL;
+    }
+    JsonParser p = { .buf = buf, .len = len };
+    Value *v = NULL;
+    if (json_build_index(&p)) {
+        v = json_parse_value(&p);
+        if (v && p.pos < p.count) {
+            free_value(v);
+            v = json_fail(&p, "trailing characters", p.index[p.pos]);
+        }
+    }
+    if (!v) printf("Error: json_parse: %s at offset %zu\n", p.error, p.error_at);
+    free(p.index);
+    free(p.items);
+    free(p.keys);
+    return v;
+}
+
+// json_stringify writes straight into one growable buffer
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} JsonBuf;
+
+void json_reserve(JsonBuf *b, size_t n) {
+    if (b->len + n <= b->cap) return;
+    while (b->len + n > b->cap) b->cap = b->cap ? b->cap * 2 : 256;
+    b->data = realloc(b->data, b->cap);
+}
+
+void json_put(JsonBuf *b, const char *s, size_t n) {
+    json_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+void json_write_string(JsonBuf *b, const char *s, size_t n) {
+    json_reserve(b, n + 2);
+    b->data[b->len++] = '"';
+    size_t run = 0;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        json_put(b, s + run, i - run);
+        run = i + 1;
+        char esc[8];
+        switch (c) {
+            case '"': json_put(b, "\\\"", 2); break;
+            case '\\': json_put(b, "\\\\", 2); break;
+            case '\n': json_put(b, "\\n", 2); break;
+            case '\r': json_put(b, "\\r", 2); break;
+            case '\t': json_put(b, "\\t", 2); break;
+            case '\b': json_put(b, "\\b", 2); break;
+            case '\f': json_put(b, "\\f", 2); break;
+            default:
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                json_put(b, esc, 6);
+        }
+    }
+    json_put(b, s + run, n - run);
+    json_put(b, "\"", 1);
+}
+
+// Shortest digits that read back as the same double, by Grisu2 (Loitsch,
+// "Printing Floating-Point Numbers Quickly and Accurately with Integers"):
+// 64-bit integer arithmetic against a table of cached powers of ten, no
+// snprintf/strtod round trips. The output always reads back exactly and is
+// the shortest such form for all but a tiny fraction of inputs.
+typedef struct {
+    uint64_t f;
+    int e;
+} DiyFp;
+
+static const uint64_t grisu_powers_f[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+    0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL, 0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+    0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+    0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL, 0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+    0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+    0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL, 0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+    0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+    0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL, 0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+    0x9c40000000000000ULL, 0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+    0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL, 0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+    0x924d692ca61be758ULL, 0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+    0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL, 0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+    0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+    0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL, 0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+    0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+static const int16_t grisu_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954, -927,
+    -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635, -608,
+    -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316, -289,
+    -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30,
+    56, 83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614, 641, 667,
+    694, 720, 747, 774, 800, 827, 853, 880, 907, 933, 960, 986,
+    1013, 1039, 1066,
+};
+
+DiyFp diyfp_multiply(DiyFp a, DiyFp b) {
+    unsigned __int128 p = (unsigned __int128)a.f * b.f;
+    uint64_t h = (uint64_t)(p >> 64), l = (uint64_t)p;
+    // Round to nearest on the dropped low half
+    if (l & (1ULL << 63)) h++;
+    return (DiyFp){ h, a.e + b.e + 64 };
+}
+
+DiyFp diyfp_normalize(DiyFp v) {
+    int shift = __builtin_clzll(v.f);
+    return (DiyFp){ v.f << shift, v.e - shift };
+}
+
+void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+// Writes the digits of d > 0 to buf; the value is digits * 10^*k
+int grisu2(double d, char *buf, int *k) {
+    static const uint64_t pow10[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+        1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+        1000000000000000000ULL, 10000000000000000000ULL
+    };
+    const uint64_t hidden = 1ULL << 52;
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    int biased = (int)(bits >> 52) & 0x7FF;
+    uint64_t frac = bits & (hidden - 1);
+    DiyFp v = biased ? (DiyFp){ frac | hidden, biased - 1075 } : (DiyFp){ frac, -1074 };
+    
+    // Boundaries halfway to the neighbouring doubles
+    DiyFp plus = diyfp_normalize((DiyFp){ (v.f << 1) + 1, v.e - 1 });
+    DiyFp minus = v.f == hidden ? (DiyFp){ (v.f << 2) - 1, v.e - 2 } : (DiyFp){ (v.f << 1) - 1, v.e - 1 };
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+    
+    double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+    int kk = (int)dk;
+    if (dk - kk > 0.0) kk++;
+    int index = (kk >> 3) + 1;
+    *k = -(-348 + index * 8);
+    DiyFp c = { grisu_powers_f[index], grisu_powers_e[index] };
+    
+    DiyFp w = diyfp_multiply(diyfp_normalize(v), c);
+    DiyFp wp = diyfp_multiply(plus, c);
+    DiyFp wm = diyfp_multiply(minus, c);
+    wm.f++;
+    wp.f--;
+    
+    uint64_t delta = wp.f - wm.f;
+    uint64_t wp_w = wp.f - w.f;
+    DiyFp one = { 1ULL << -wp.e, wp.e };
+    uint32_t p1 = (uint32_t)(wp.f >> -one.e);
+    uint64_t p2 = wp.f & (one.f - 1);
+    int kappa = 1;
+    while (kappa < 10 && p1 >= pow10[kappa]) kappa++;
+    int len = 0;
+    
+    while (kappa > 0) {
+        uint32_t digit = p1 / (uint32_t)pow10[kappa - 1];
+        p1 %= (uint32_t)pow10[kappa - 1];
+        if (digit || len) buf[len++] = '0' + digit;
+        kappa--;
+        uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+        if (rest <= delta) {
+            *k += kappa;
+            grisu_round(buf, len, delta, rest, pow10[kappa] << -one.e, wp_w);
+            return len;
+        }
+    }
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        char digit = (char)(p2 >> -one.e);
+        if (digit || len) buf[len++] = '0' + digit;
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *k += kappa;
+            grisu_round(buf, len, delta, p2, one.f, -kappa < 20 ? wp_w * pow10[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+// Formats like JavaScript: plain notation for exponents -7..20, else 1.5e+300
+void json_write_number(JsonBuf *b, double d) {
+    if (!isfinite(d)) {
+        json_put(b, "null", 4);
+        return;
+    }
+    char tmp[40];
+    int n = 0;
+    if (d == 0) {
+        json_put(b, "0", 1);
+        return;
+    }
+    // Range check first: casting an out-of-range double to long long is undefined
+    if (fabs(d) < 1e15 && d == (double)(long long)d) {
+        n = snprintf(tmp, sizeof(tmp), "%lld", (long long)d);
+        json_put(b, tmp, n);
+        return;
+    }
+    
+    char digits[20];
+    int k;
+    int len = grisu2(fabs(d), digits, &k);
+    int point = len + k;
+    if (d < 0) tmp[n++] = '-';
+    if (point > 0 && point <= 21) {
+        for (int i = 0; i < point; i++) tmp[n++] = i < len ? digits[i] : '0';
+        if (len > point) {
+            tmp[n++] = '.';
+            for (int i = point; i < len; i++) tmp[n++] = digits[i];
+        }
+    } else if (point <= 0 && point > -6) {
+        tmp[n++] = '0';
+        tmp[n++] = '.';
+        for (int i = point; i < 0; i++) tmp[n++] = '0';
+        for (int i = 0; i < len; i++) tmp[n++] = digits[i];
+    } else {
+        tmp[n++] = digits[0];
+        if (len > 1) {
+            tmp[n++] = '.';
+            for (int i = 1; i < len; i++) tmp[n++] = digits[i];
+        }
+        n += snprintf(tmp + n, sizeof(tmp) - n, "e%+d", point - 1);
+    }
+    json_put(b, tmp, n);
+}
+
+void json_newline(JsonBuf *b, int indent, int level) {
+    if (indent <= 0) return;
+    json_reserve(b, 1 + (size_t)indent * level);
+    b->data[b->len++] = '\n';
+    memset(b->data + b->len, ' ', (size_t)indent * level);
+    b->len += (size_t)indent * level;
+}
+
+// Values JSON has no form for (functions, files, iterators, ...) become null
+void json_write_value(JsonBuf *b, Value *v, int indent, int level) {
+    if (!v) {
+        json_put(b, "null", 4);
+        return;
+    }
+    switch (v->type) {
+        case VAL_NUMBER: json_write_number(b, v->data.number); break;
+        case VAL_BOOL:
+            if (v->data.boolean) json_put(b, "true", 4);
+            else json_put(b, "false", 5);
+            break;
+        case VAL_STRING:
+            json_write_string(b, v->data.string ? v->data.string : "", v->data.string ? strlen(v->data.string) : 0);
+            break;
+        case VAL_BYTES: json_write_string(b, (const char*)v->data.bytes.data, v->data.bytes.len); break;
+        case VAL_ARRAY:
+        case VAL_DICT: {
+            bool object = v->type == VAL_DICT;
+            int count = object ? v->data.dict.count : v->data.array.count;
+            json_put(b, object ? "{" : "[", 1);
+            for (int i = 0; i < count; i++) {
+                if (i > 0) json_put(b, ",", 1);
+                json_newline(b, indent, level + 1);
+                if (object) {
+                    json_write_string(b, v->data.dict.keys[i], strlen(v->data.dict.keys[i]));
+                    json_put(b, indent > 0 ? ": " : ":", indent > 0 ? 2 : 1);
+                }
+                json_write_value(b, object ? v->data.dict.values[i] : v->data.array.items[i], indent, level + 1);
+            }
+            if (count > 0) json_newline(b, indent, level);
+            json_put(b, object ? "}" : "]", 1);
+            break;
+        }
+        default: json_put(b, "null", 4);
+    }
+}
+
+// indent > 0 pretty-prints with that many spaces per level
+char *json_stringify(Value *v, int indent) {
+    JsonBuf b = {0};
+    json_write_value(&b, v, indent, 0);
+    json_reserve(&b, 1);
+    b.data[b.len] = 0;
+    return b.data;
+}
+
+#ifdef HAVE_SDL2
+Value *graphics_create_window(const char *title, int width, int height, bool use_opengl) {
+    if (window_count >= MAX_WINDOWS) {
+        return create_value(VAL_NULL);
+    }
+    
+    static bool sdl_inited = false;
+    if (!sdl_inited) {
+        if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS) < 0) {
+            printf("SDL Error: %s\n", SDL_GetError());
+            return create_value(VAL_NULL);
+        }
+        sdl_inited = true;
+    }
+    
+    ZenithWindow *win = &windows[window_count++];
+    win->width = width;
+    win->height = height;
+    win->use_opengl = use_opengl;
+    win->running = true;
+    
+    Uint32 flags = SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE;
+    if (use_opengl) {
+        flags |= SDL_WINDOW_OPENGL;
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+    }
+    
+    win->window = SDL_CreateWindow(title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                    width, height, flags);
+    
+    if (!win->window) {
+        printf("Window Error: %s\n", SDL_GetError());
+        return create_value(VAL_NULL);
+    }
+    
+    if (use_opengl) {
+        win->gl_context = SDL_GL_CreateContext(win->window);
+        if (!win->gl_context) {
+            printf("GL Context Error: %s\n", SDL_GetError());
+            SDL_DestroyWindow(win->window);
+            return create_value(VAL_NULL);
+        }
+        SDL_GL_MakeCurrent(win->window, win->gl_context);
+        glViewport(0, 0, width, height);
+        glMatrixMode(GL_PROJECTION);
+        glLoadIdentity();
+        glOrtho(0, width, height, 0, -1, 1);
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+    } else {
+        win->renderer = SDL_CreateRenderer(win->window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+        if (!win->renderer) {
+            printf("Renderer Error: %s\n", SDL_GetError());
+            SDL_DestroyWindow(win->window);
+            return create_value(VAL_NULL);
+        }
+        SDL_SetRenderDrawBlendMode(win->renderer, SDL_BLENDMODE_BLEND);
+    }
+    
+    Value *v = create_value(VAL_WINDOW);
+    v->data.window = win;
+    return v;
+}
+
+void graphics_poll_events(ZenithWindow *win) {
+    while (SDL_PollEvent(&win->event)) {
+        if (win->event.type == SDL_QUIT) {
+            win->running = false;
+        }
+    }
+}
+
+void graphics_draw_rect(ZenithWindow *win, int x, int y, int w, int h, int r, int g, int b, int a) {
+    if (!win || !win->running) return;
+    
+    if (win->use_opengl) {
+        glColor4ub(r, g, b, a);
+        glBegin(GL_QUADS);
+        glVertex2i(x, y);
+        glVertex2i(x + w, y);
+        glVertex2i(x + w, y + h);
+        glVertex2i(x, y + h);
+        glEnd();
+    } else {
+        SDL_SetRenderDrawColor(win->renderer, r, g, b, a);
+        SDL_Rect rect = {x, y, w, h};
+        SDL_RenderFillRect(win->renderer, &rect);
+    }
+}
+
+void graphics_draw_circle(ZenithWindow *win, int cx, int cy, int radius, int r, int g, int b, int a) {
+    if (!win || !win->running || !win->renderer) return;
+    
+    SDL_SetRenderDrawColor(win->renderer, r, g, b, a);
+    
+    for (int w = 0; w < radius * 2; w++) {
+        for (int h = 0; h < radius * 2; h++) {
+            int dx = radius - w;
+            int dy = radius - h;
+            if ((dx*dx + dy*dy) <= (radius * radius)) {
+                SDL_RenderDrawPoint(win->renderer, cx + dx, cy + dy);
+            }
+        }
+    }
+}
+
+void graphics_clear(ZenithWindow *win, int r, int g, int b) {
+    if (!win || !win->running) return;
+    
+    if (win->use_opengl) {
+        glClearColor(r/255.0f, g/255.0f, b/255.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+    } else {
+        SDL_SetRenderDrawColor(win->renderer, r, g, b, 255);
+        SDL_RenderClear(win->renderer);
+    }
+}
+
+void graphics_present(ZenithWindow *win) {
+    if (!win || !win->running) return;
+    
+    graphics_poll_events(win);
+    
+    if (win->use_opengl) {
+        SDL_GL_SwapWindow(win->window);
+    } else {
+        SDL_RenderPresent(win->renderer);
+    }
+    
+    SDL_Delay(16);
+}
+#endif
+
+typedef struct {
+    const char *ext;
+    const char *mime;
+    bool compressible;
+} MimeType;
+
+static const MimeType mime_types[] = {
+    {".html", "text/html", true},
+    {".htm", "text/html", true},
+    {".css", "text/css", true},
+    {".js", "application/javascript", true},
+    {".json", "application/json", true},
+    {".png", "image/png", false},
+    {".jpg", "image/jpeg", false},
+    {".jpeg", "image/jpeg", false},
+    {".gif", "image/gif", false},
+    {".svg", "image/svg+xml", true},
+    {".ico", "image/x-icon", true},
+    {".txt", "text/plain", true},
+    {".pdf", "application/pdf", false},
+    {".zip", "application/zip", false},
+};
+
+#define MIME_TYPE_COUNT (sizeof(mime_types) / sizeof(mime_types[0]))
+
+const MimeType *find_mime_type(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext) return NULL;
+    
+    for (size_t i = 0; i < MIME_TYPE_COUNT; i++) {
+        if (strcmp(ext, mime_types[i].ext) == 0) return &mime_types[i];
+    }
+    return NULL;
+}
+
+const char* get_mime_type(const char *path) {
+    const MimeType *type = find_mime_type(path);
+    return type ? type->mime : "application/octet-stream";
+}
+
+bool is_compressible_path(const char *path) {
+    const MimeType *type = find_mime_type(path);
+    return type && type->compressible;
+}
+
+// Compressed bodies are cached by path and invalidated when the inode, size
+// or nanosecond mtime change, so a rewrite within the same second is noticed
+#define GZIP_CACHE_BUCKETS 256
+#define GZIP_CACHE_MAX_BYTES (64L * 1024 * 1024)
+#define GZIP_MIN_SIZE 256
+#define GZIP_MAX_SIZE (16L * 1024 * 1024)
+
+typedef struct GzipEntry {
+    char *path;
+    struct timespec mtim;
+    ino_t ino;
+    off_t size;
+    unsigned char *data;
+    size_t len;
+    int refs;
+    bool cached;
+    struct GzipEntry *next;
+    struct GzipEntry *older;
+    struct GzipEntry *newer;
+} GzipEntry;
+
+typedef struct {
+    GzipEntry *buckets[GZIP_CACHE_BUCKETS];
+    GzipEntry *oldest;
+    GzipEntry *newest;
+    size_t bytes;
+    pthread_mutex_t lock;
+} GzipCache;
+
+GzipCache gzip_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Orders two modification times at full resolution
+int mtime_cmp(const struct stat *a, const struct stat *b) {
+    if (a->st_mtim.tv_sec != b->st_mtim.tv_sec) return a->st_mtim.tv_sec < b->st_mtim.tv_sec ? -1 : 1;
+    if (a->st_mtim.tv_nsec != b->st_mtim.tv_nsec) return a->st_mtim.tv_nsec < b->st_mtim.tv_nsec ? -1 : 1;
+    return 0;
+}
+
+unsigned int hash_string(const char *s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void gzip_entry_free(GzipEntry *e) {
+    free(e->path);
+    free(e->data);
+    free(e);
+}
+
+// Caller holds gzip_cache.lock
+void gzip_cache_unlink(GzipEntry *e) {
+    GzipEntry **slot = &gzip_cache.buckets[hash_string(e->path) % GZIP_CACHE_BUCKETS];
+    while (*slot && *slot != e) slot = &(*slot)->next;
+    if (*slot) *slot = e->next;
+    
+    if (e->older) e->older->newer = e->newer;
+    else gzip_cache.oldest = e->newer;
+    if (e->newer) e->newer->older = e->older;
+    else gzip_cache.newest = e->older;
+    
+    gzip_cache.bytes -= e->len;
+    e->cached = false;
+    if (e->refs == 0) gzip_entry_free(e);
+}
+
+GzipEntry *gzip_cache_get(const char *path, const struct stat *st) {
+    pthread_mutex_lock(&gzip_cache.lock);
+    GzipEntry *e = gzip_cache.buckets[hash_string(path) % GZIP_CACHE_BUCKETS];
+    while (e && strcmp(e->path, path) != 0) e = e->next;
+    
+    if (e && (e->mtim.tv_sec != st->st_mtim.tv_sec || e->mtim.tv_nsec != st->st_mtim.tv_nsec ||
+              e->ino != st->st_ino || e->size != st->st_size)) {
+        gzip_cache_unlink(e);
+        e = NULL;
+    }
+    if (e) e->refs++;
+    pthread_mutex_unlock(&gzip_cache.lock);
+    return e;
+}
+
+GzipEntry *gzip_cache_put(const char *path, const struct stat *st, unsigned char *data, size_t len) {
+    GzipEntry *e = calloc(1, sizeof(GzipEntry));
+    e->path = strdup_safe(path);
+    e->mtim = st->st_mtim;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->data = data;
+    e->len = len;
+    e->refs = 1;
+    
+    if (len > GZIP_CACHE_MAX_BYTES / 4) return e;
+    
+    pthread_mutex_lock(&gzip_cache.lock);
+    GzipEntry **slot = &gzip_cache.buckets[hash_string(path) % GZIP_CACHE_BUCKETS];
+    for (GzipEntry *old = *slot; old; old = old->next) {
+        if (strcmp(old->path, path) == 0) {
+            gzip_cache_unlink(old);
+            break;
+        }
+    }
+    while (gzip_cache.oldest && gzip_cache.bytes + len > GZIP_CACHE_MAX_BYTES) {
+        gzip_cache_unlink(gzip_cache.oldest);
+    }
+    
+    e->next = *slot;
+    *slot = e;
+    e->older = gzip_cache.newest;
+    if (gzip_cache.newest) gzip_cache.newest->newer = e;
+    else gzip_cache.oldest = e;
+    gzip_cache.newest = e;
+    gzip_cache.bytes += len;
+    e->cached = true;
+    pthread_mutex_unlock(&gzip_cache.lock);
+    return e;
+}
+
+void gzip_entry_release(GzipEntry *e) {
+    pthread_mutex_lock(&gzip_cache.lock);
+    bool dead = --e->refs == 0 && !e->cached;
+    pthread_mutex_unlock(&gzip_cache.lock);
+    if (dead) gzip_entry_free(e);
+}
+
+unsigned char *gzip_compress(const unsigned char *in, size_t in_len, size_t *out_len) {
+    z_stream zs = {0};
+    // windowBits 15 + 16 selects the gzip wrapper instead of raw zlib
+    if (deflateInit2(&zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    
+    size_t cap = deflateBound(&zs, in_len) + 32;
+    unsigned char *out = malloc(cap);
+    zs.next_in = (unsigned char*)in;
+    zs.avail_in = in_len;
+    zs.next_out = out;
+    zs.avail_out = cap;
+    
+    int ret = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    
+    if (ret != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+// Returns the cached gzip body for an open file, compressing it on first use
+GzipEntry *gzip_for_file(const char *path, int fd, const struct stat *st) {
+    GzipEntry *e = gzip_cache_get(path, st);
+    if (e) return e;
+    
+    size_t size = st->st_size;
+    unsigned char *content = malloc(size);
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(fd, content + got, size - got, got);
+        if (n <= 0) break;
+        got += n;
+    }
+    if (got != size) {
+        free(content);
+        return NULL;
+    }
+    
+    size_t len;
+    unsigned char *compressed = gzip_compress(content, size, &len);
+    free(content);
+    if (!compressed) return NULL;
+    
+    // Bodies that do not shrink are still cached so the work is not repeated
+    return gzip_cache_put(path, st, compressed, len);
+}
+
+bool write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool sendfile_all(int out_fd, int in_fd, off_t offset, size_t len) {
+    while (len > 0) {
+        ssize_t n = sendfile(out_fd, in_fd, &offset, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (n == 0) return false;
+        len -= n;
+    }
+    return true;
+}
+
+// TLS for the HTTP server. One context is shared by every worker so the
+// server-side session cache and ticket keys cover all connections. With
+// kernel TLS the record layer runs in the kernel and files still go out
+// through sendfile.
+#define TLS_SESSION_CACHE_SIZE 20480
+#define TLS_SESSION_TIMEOUT 7200
+
+SSL_CTX *http_tls_ctx = NULL;
+
+bool tls_write_all(SSL *ssl, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        int n = SSL_write(ssl, p, len > INT_MAX ? INT_MAX : (int)len);
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool tls_sendfile_all(SSL *ssl, int in_fd, off_t offset, size_t len) {
+#ifdef SSL_OP_ENABLE_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        while (len > 0) {
+            ossl_ssize_t n = SSL_sendfile(ssl, in_fd, offset, len, 0);
+            if (n <= 0) return false;
+            offset += n;
+            len -= n;
+        }
+        return true;
+    }
+#endif
+    // Without kTLS every byte has to pass through user space to be encrypted
+    char buf[65536];
+    while (len > 0) {
+        ssize_t n = pread(in_fd, buf, len < sizeof(buf) ? len : sizeof(buf), offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || !tls_write_all(ssl, buf, n)) return false;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Prefers h2 when the client offers it
+int http_tls_alpn(SSL *ssl, const unsigned char **out, unsigned char *out_len,
+                  const unsigned char *in, unsigned int in_len, void *arg) {
+    (void)ssl;
+    (void)arg;
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    unsigned char *selected;
+    if (SSL_select_next_proto(&selected, out_len, protos, sizeof(protos) - 1, in, in_len) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+bool http_tls_init(const char *cert, const char *key) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) return false;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1) {
+        printf("Error: Cannot load certificate '%s'\n", cert);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+        printf("Error: Cannot load private key '%s'\n", key);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    
+    long options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_ENABLE_KTLS
+    options |= SSL_OP_ENABLE_KTLS;
+#endif
+    SSL_CTX_set_options(ctx, options);
+    
+    // Resumption: session IDs hit the shared cache, tickets need no server state at all
+    static const unsigned char sid_ctx[] = "zenith";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+    SSL_CTX_set_alpn_select_cb(ctx, http_tls_alpn, NULL);
+    
+    SSL_CTX_free(http_tls_ctx);
+    http_tls_ctx = ctx;
+    return true;
+}
+
+// Incremental request parser. The head is parsed in place: method, path and
+// header slices point into the connection buffer and are never copied.
+#define HTTP_BUFFER_SIZE 16384
+#define HTTP_MAX_HEAD (HTTP_BUFFER_SIZE - 1024)
+#define HTTP_MAX_HEADERS 64
+#define HTTP_BODY_MEMORY_LIMIT (64 * 1024)
+#define HTTP_IO_TIMEOUT 30
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+} HttpSlice;
+
+typedef enum {
+    HTTP_PARSE_HEAD, HTTP_PARSE_BODY, HTTP_PARSE_DONE
+} HttpParseState;
+
+typedef struct {
+    HttpParseState state;
+    size_t scanned;
+    size_t head_len;
+    HttpSlice method;
+    HttpSlice target;
+    HttpSlice path;
+    HttpSlice query;
+    HttpSlice version;
+    HttpSlice header_names[HTTP_MAX_HEADERS];
+    HttpSlice header_values[HTTP_MAX_HEADERS];
+    int header_count;
+    bool chunked;
+    long long content_length;
+    long long body_received;
+    long long chunk_left;
+    long long pending;      // bytes charged against max_pending
+    int error_status;
+} HttpRequest;
+
+typedef struct {
+    int fd;
+    char buf[HTTP_BUFFER_SIZE];
+    size_t len;
+    size_t pos;
+    HttpRequest req;
+    SSL *ssl;
+    struct Http2Stream *h2;
+    bool detached;
+    uint64_t accepted_ns;
+    uint64_t first_byte_ns;
+    uint64_t bytes_sent;
+    int status;
+} HttpConnection;
+
+// An HTTP/2 stream hands its handler a connection view whose output is
+// captured into frames instead of being written to the socket
+struct Http2Stream;
+bool http2_capture(struct Http2Stream *st, const void *buf, size_t len);
+bool http2_capture_file(struct Http2Stream *st, int fd, off_t offset, size_t len);
+ssize_t http2_body_recv(struct Http2Stream *st, void *buf, size_t len);
+
+// Admission accounting for request bytes in flight, defined with the limits below
+bool http_pending_reserve(long long bytes, long long held);
+
+// Log-linear latency histogram in microseconds: each power of two is split
+// into 2^HIST_SUB_BITS buckets, so every bucket is within 12.5% of its value.
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_OCTAVES 32
+#define HIST_BUCKETS ((HIST_OCTAVES + 1) * HIST_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} LatencyHistogram;
+
+int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB_COUNT) return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_SUB_BITS;
+    int index = (shift + 1) * HIST_SUB_COUNT + (int)((value >> shift) & (HIST_SUB_COUNT - 1));
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+// Largest value that lands in bucket i
+uint64_t hist_bucket_upper(int i) {
+    if (i < HIST_SUB_COUNT) return i;
+    int shift = i / HIST_SUB_COUNT - 1;
+    uint64_t sub = i % HIST_SUB_COUNT;
+    return ((HIST_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+// Single writer per histogram; relaxed stores keep readers tear-free without locked ops
+void hist_record(LatencyHistogram *h, uint64_t value) {
+    int i = hist_bucket(value);
+    __atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->total, h->total + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if (value > h->max) __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+void hist_merge(LatencyHistogram *into, const LatencyHistogram *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+    }
+    into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+    into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (max > into->max) into->max = max;
+}
+
+uint64_t hist_percentile(const LatencyHistogram *h, double pct) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)ceil(h->total * pct / 100.0);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t upper = hist_bucket_upper(i);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Per-worker counters, each on its own cache lines and written only by its worker
+typedef struct {
+    uint64_t requests;
+    uint64_t status_classes[6];
+    uint64_t bytes_sent;
+    uint64_t connections_accepted;
+    uint64_t connections_closed;
+    uint64_t tls_handshakes;
+    uint64_t tls_resumed;
+    uint64_t tls_ktls;
+    uint64_t tls_failures;
+    LatencyHistogram first_byte;
+    LatencyHistogram duration;
+} __attribute__((aligned(64))) WorkerMetrics;
+
+WorkerMetrics *http_metrics = NULL;
+int http_metrics_count = 0;
+__thread WorkerMetrics *worker_metrics = NULL;
+
+#define METRIC_INC(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+bool slice_eq(HttpSlice s, const char *str) {
+    size_t n = strlen(str);
+    return s.len == n && memcmp(s.ptr, str, n) == 0;
+}
+
+bool slice_case_eq(HttpSlice s, const char *str) {
+    size_t n = strlen(str);
+    return s.len == n && strncasecmp(s.ptr, str, n) == 0;
+}
+
+// Copies a slice into a NUL-terminated buffer, truncating if needed
+char *slice_copy(HttpSlice s, char *out, size_t out_len) {
+    size_t n = s.len < out_len - 1 ? s.len : out_len - 1;
+    memcpy(out, s.ptr, n);
+    out[n] = 0;
+    return out;
+}
+
+bool http_write_raw(HttpConnection *c, const void *buf, size_t len) {
+    return c->ssl ? tls_write_all(c->ssl, buf, len) : write_all(c->fd, buf, len);
+}
+
+// Every response byte goes through these so timing and accounting stay in one place
+bool http_send(HttpConnection *c, const void *buf, size_t len) {
+    if (!c->first_byte_ns) {
+        c->first_byte_ns = monotonic_ns();
+        if (len > 12 && memcmp(buf, "HTTP/1.", 7) == 0) c->status = atoi((const char*)buf + 9);
+    }
+    if (c->h2) return http2_capture(c->h2, buf, len);
+    if (!http_write_raw(c, buf, len)) return false;
+    c->bytes_sent += len;
+    return true;
+}
+
+bool http_sendfile(HttpConnection *c, int fd, off_t offset, size_t len) {
+    if (c->h2) return http2_capture_file(c->h2, fd, offset, len);
+    if (!(c->ssl ? tls_sendfile_all(c->ssl, fd, offset, len) : sendfile_all(c->fd, fd, offset, len))) {
+        return false;
+    }
+    c->bytes_sent += len;
+    return true;
+}
+
+HttpSlice http_header(const HttpRequest *req, const char *name) {
+    for (int i = 0; i < req->header_count; i++) {
+        if (slice_case_eq(req->header_names[i], name)) return req->header_values[i];
+    }
+    return (HttpSlice){NULL, 0};
+}
+
+bool http_find_header(const HttpRequest *req, const char *name, char *out, size_t out_len) {
+    HttpSlice v = http_header(req, name);
+    if (!v.ptr) return false;
+    slice_copy(v, out, out_len);
+    return true;
+}
+
+HttpSlice slice_trim(const char *start, const char *end) {
+    while (start < end && (*start == ' ' || *start == '\t')) start++;
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    return (HttpSlice){start, end - start};
+}
+
+// Parses the request line and headers once the blank line has arrived
+bool http_parse_head_lines(HttpRequest *req, const char *buf) {
+    const char *end = buf + req->head_len - 2;
+    const char *line_end = memmem(buf, end - buf, "\r\n", 2);
+    const char *sp1 = memchr(buf, ' ', line_end - buf);
+    const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', line_end - sp1 - 1) : NULL;
+    if (!sp1 || !sp2 || sp1 == buf || sp2 == sp1 + 1) return false;
+    
+    req->method = (HttpSlice){buf, sp1 - buf};
+    req->target = (HttpSlice){sp1 + 1, sp2 - sp1 - 1};
+    req->version = (HttpSlice){sp2 + 1, line_end - sp2 - 1};
+    if (req->version.len < 8 || strncmp(req->version.ptr, "HTTP/1.", 7) != 0) return false;
+    
+    const char *q = memchr(req->target.ptr, '?', req->target.len);
+    req->path = (HttpSlice){req->target.ptr, q ? (size_t)(q - req->target.ptr) : req->target.len};
+    req->query = q ? (HttpSlice){q + 1, req->target.ptr + req->target.len - q - 1} : (HttpSlice){"", 0};
+    
+    const char *line = line_end + 2;
+    while (line < end) {
+        line_end = memmem(line, end - line + 2, "\r\n", 2);
+        const char *colon = memchr(line, ':', line_end - line);
+        if (!colon || colon == line) return false;
+        if (req->header_count == HTTP_MAX_HEADERS) {
+            req->error_status = 431;
+            return false;
+        }
+        req->header_names[req->header_count] = (HttpSlice){line, colon - line};
+        req->header_values[req->header_count] = slice_trim(colon + 1, line_end);
+        req->header_count++;
+        line = line_end + 2;
+    }
+    
+    char value[64];
+    if (http_find_header(req, "Transfer-Encoding", value, sizeof(value))) {
+        req->chunked = strcasestr(value, "chunked") != NULL;
+    }
+    if (!req->chunked && http_find_header(req, "Content-Length", value, sizeof(value))) {
+        char *num_end;
+        req->content_length = strtoll(value, &num_end, 10);
+        if (num_end == value || req->content_length < 0) return false;
+    }
+    return true;
+}
+
+// Feeds newly buffered bytes to the parser. Returns 1 once the head is
+// complete, 0 when more input is needed and -1 on a malformed request.
+int http_parse_head(HttpRequest *req, const char *buf, size_t len) {
+    if (req->state != HTTP_PARSE_HEAD) return 1;
+    
+    // Resume the terminator search where the last partial read stopped
+    size_t from = req->scanned > 3 ? req->scanned - 3 : 0;
+    const char *term = len > from ? memmem(buf + from, len - from, "\r\n\r\n", 4) : NULL;
+    if (!term) {
+        req->scanned = len;
+        if (len >= HTTP_MAX_HEAD) {
+            req->error_status = 431;
+            return -1;
+        }
+        return 0;
+    }
+    
+    req->head_len = term + 4 - buf;
+    if (!http_parse_head_lines(req, buf)) {
+        if (!req->error_status) req->error_status = 400;
+        return -1;
+    }
+    req->state = req->chunked || req->content_length > 0 ? HTTP_PARSE_BODY : HTTP_PARSE_DONE;
+    return 1;
+}
+
+ssize_t http_conn_recv(HttpConnection *c, void *buf, size_t len) {
+    if (c->h2) return http2_body_recv(c->h2, buf, len);
+    if (c->ssl) {
+        int n = SSL_read(c->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+        if (n > 0) return n;
+        // A clean close_notify reads as EOF, anything else as an error
+        return SSL_get_error(c->ssl, n) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+    while (1) {
+        ssize_t n = read(c->fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        return n;
+    }
+}
+
+// Reads until the request head is complete
+bool http_read_request(HttpConnection *c) {
+    while (1) {
+        int r = http_parse_head(&c->req, c->buf, c->len);
+        if (r > 0) {
+            c->pos = c->req.head_len;
+            return true;
+        }
+        if (r < 0) return false;
+        
+        ssize_t n = http_conn_recv(c, c->buf + c->len, HTTP_MAX_HEAD - c->len);
+        if (n <= 0) return false;
+        c->len += n;
+    }
+}
+
+// Makes sure at least one unread byte is staged after the head
+bool http_conn_fill(HttpConnection *c) {
+    if (c->pos < c->len) {
+        if (c->len < sizeof(c->buf)) {
+            ssize_t n = http_conn_recv(c, c->buf + c->len, sizeof(c->buf) - c->len);
+            if (n <= 0) return false;
+            c->len += n;
+            return true;
+        }
+        // Compact so a partial chunk-size line can be completed
+        size_t left = c->len - c->pos;
+        memmove(c->buf + c->req.head_len, c->buf + c->pos, left);
+        c->pos = c->req.head_len;
+        c->len = c->pos + left;
+        return c->len < sizeof(c->buf) && http_conn_fill(c);
+    }
+    c->pos = c->len = c->req.head_len;
+    ssize_t n = http_conn_recv(c, c->buf + c->len, sizeof(c->buf) - c->len);
+    if (n <= 0) return false;
+    c->len += n;
+    return true;
+}
+
+// Reads a CRLF-terminated line of the chunked framing
+bool http_conn_line(HttpConnection *c, char *out, size_t out_len) {
+    while (1) {
+        char *nl = memchr(c->buf + c->pos, '\n', c->len - c->pos);
+        if (nl) {
+            size_t n = nl - (c->buf + c->pos);
+            if (n > 0 && nl[-1] == '\r') n--;
+            slice_copy((HttpSlice){c->buf + c->pos, n}, out, out_len);
+            c->pos = nl + 1 - c->buf;
+            return true;
+        }
+        if (!http_conn_fill(c)) return false;
+    }
+}
+
+// Pulls up to cap decoded body bytes. Buffered bytes are drained first; after
+// that large reads go straight from the socket into out. Returns 0 at the end
+// of the body and -1 on error.
+ssize_t http_body_read(HttpConnection *c, char *out, size_t cap) {
+    HttpRequest *req = &c->req;
+    if (req->state != HTTP_PARSE_BODY) return 0;
+    
+    if (req->chunked && req->chunk_left == 0) {
+        char line[128];
+        if (req->body_received > 0 && !http_conn_line(c, line, sizeof(line))) return -1;
+        if (!http_conn_line(c, line, sizeof(line))) return -1;
+        char *end;
+        req->chunk_left = strtoll(line, &end, 16);
+        if (end == line || req->chunk_left < 0) return -1;
+        if (req->chunk_left == 0) {
+            // Skip trailers up to the final blank line
+            do {
+                if (!http_conn_line(c, line, sizeof(line))) return -1;
+            } while (line[0]);
+            req->state = HTTP_PARSE_DONE;
+            return 0;
+        }
+    }
+    
+    long long left = req->chunked ? req->chunk_left : req->content_length - req->body_received;
+    if (left <= 0) {
+        req->state = HTTP_PARSE_DONE;
+        return 0;
+    }
+    size_t want = (long long)cap < left ? cap : (size_t)left;
+    
+    ssize_t n;
+    if (c->pos < c->len) {
+        n = c->len - c->pos < want ? c->len - c->pos : want;
+        memcpy(out, c->buf + c->pos, n);
+        c->pos += n;
+    } else {
+        n = http_conn_recv(c, out, want);
+        if (n <= 0) return -1;
+    }
+    
+    // A chunked body declares no length up front, so it is charged as it arrives
+    if (req->chunked) {
+        if (!http_pending_reserve(n, req->pending)) {
+            req->error_status = 503;
+            return -1;
+        }
+        req->pending += n;
+    }
+    
+    req->body_received += n;
+    if (req->chunked) req->chunk_left -= n;
+    else if (req->body_received == req->content_length) req->state = HTTP_PARSE_DONE;
+    return n;
+}
+
+// Collects a body for route handlers. Small bodies stay in memory; anything
+// larger than HTTP_BODY_MEMORY_LIMIT is streamed into a file under upload_dir.
+bool http_collect_body(HttpConnection *c, char **body, size_t *body_len, char *spill_path, size_t spill_len) {
+    HttpRequest *req = &c->req;
+    *body = NULL;
+    *body_len = 0;
+    spill_path[0] = 0;
+    if (req->state != HTTP_PARSE_BODY) return true;
+    
+    if (http_server.max_body > 0 && req->content_length > http_server.max_body) {
+        req->error_status = 413;
+        return false;
+    }
+    
+    char *mem = malloc(HTTP_BODY_MEMORY_LIMIT + 1);
+    size_t mem_len = 0;
+    int spill_fd = -1;
+    bool to_disk = req->content_length > HTTP_BODY_MEMORY_LIMIT;
+    char chunk[65536];
+    
+    while (1) {
+        ssize_t n = http_body_read(c, chunk, sizeof(chunk));
+        if (n < 0) {
+            if (!req->error_status) req->error_status = 400;
+            break;
+        }
+        if (n == 0) {
+            if (spill_fd >= 0) {
+                close(spill_fd);
+                free(mem);
+                mem = NULL;
+                mem_len = 0;
+            } else {
+                mem[mem_len] = 0;
+            }
+            *body = mem;
+            *body_len = mem_len;
+            return true;
+        }
+        if (http_server.max_body > 0 && req->body_received > http_server.max_body) {
+            req->error_status = 413;
+            break;
+        }
+        
+        if (spill_fd < 0 && (to_disk || mem_len + n > HTTP_BODY_MEMORY_LIMIT)) {
+            snprintf(spill_path, spill_len, "%s/zenith-upload-XXXXXX", http_server.upload_dir);
+            spill_fd = mkstemp(spill_path);
+            if (spill_fd < 0 || !write_all(spill_fd, mem, mem_len)) {
+                req->error_status = 500;
+                break;
+            }
+        }
+        if (spill_fd >= 0) {
+            if (!write_all(spill_fd, chunk, n)) {
+                req->error_status = 500;
+                break;
+            }
+        } else {
+            memcpy(mem + mem_len, chunk, n);
+            mem_len += n;
+        }
+    }
+    
+    if (spill_fd >= 0) {
+        close(spill_fd);
+        unlink(spill_path);
+    }
+    spill_path[0] = 0;
+    free(mem);
+    return false;
+}
+
+// Reads and discards whatever body the client sent
+void http_discard_body(HttpConnection *c) {
+    char chunk[65536];
+    while (http_body_read(c, chunk, sizeof(chunk)) > 0);
+}
+
+// Decodes %XX escapes into a filesystem path and refuses to leave the root
+bool http_decode_path(HttpSlice path, char *out, size_t out_len) {
+    size_t j = 0;
+    for (size_t i = 0; i < path.len; i++) {
+        char ch = path.ptr[i];
+        if (ch == '%' && i + 2 < path.len && isxdigit((unsigned char)path.ptr[i + 1]) &&
+            isxdigit((unsigned char)path.ptr[i + 2])) {
+            char hex[3] = {path.ptr[i + 1], path.ptr[i + 2], 0};
+            ch = (char)strtol(hex, NULL, 16);
+            i += 2;
+        }
+        if (ch == 0 || j + 1 >= out_len) return false;
+        out[j++] = ch;
+    }
+    out[j] = 0;
+    if (out[0] != '/') return false;
+    
+    for (const char *p = out; (p = strstr(p, "..")); p += 2) {
+        if ((p == out || p[-1] == '/') && (p[2] == 0 || p[2] == '/')) return false;
+    }
+    return true;
+}
+
+bool http_accepts_gzip(const HttpRequest *req) {
+    char accept[512];
+    if (!http_find_header(req, "Accept-Encoding", accept, sizeof(accept))) return false;
+    
+    char *save = NULL;
+    for (char *tok = strtok_r(accept, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        while (*tok == ' ') tok++;
+        size_t len = strcspn(tok, " ;");
+        if ((len == 4 && strncasecmp(tok, "gzip", 4) == 0) || (len == 1 && *tok == '*')) {
+            char *q = strstr(tok, "q=");
+            return !q || atof(q + 2) > 0;
+        }
+    }
+    return false;
+}
+
+#define HTTP_MAX_RANGES 16
+
+typedef struct {
+    off_t start;
+    off_t end;
+} HttpRange;
+
+void http_format_date(time_t t, char *out, size_t len) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(out, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+time_t http_parse_date(const char *s) {
+    struct tm tm = {0};
+    if (!strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm)) return -1;
+    return timegm(&tm);
+}
+
+// Validators come straight from stat; gzip bodies get their own strong tag.
+// The nanoseconds keep two writes within one second apart.
+void http_make_etag(const struct stat *st, bool gzip, char *out, size_t len) {
+    snprintf(out, len, "\"%lx-%lx-%lx%s\"", (unsigned long)st->st_size,
+             (unsigned long)st->st_mtim.tv_sec, (unsigned long)st->st_mtim.tv_nsec, gzip ? "-gz" : "");
+}
+
+// An HTTP date only has whole seconds, so it pins the file down once the
+// second it was modified in is over; until then only the ETag is trusted
+bool http_date_is_strong(time_t mtime) {
+    return mtime < time(NULL);
+}
+
+bool http_etag_matches(const char *list, const char *etag) {
+    const char *tag = etag[0] == 'W' ? etag + 2 : etag;
+    size_t tag_len = strlen(tag);
+    const char *p = list;
+    
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        if (*p == '*') return true;
+        if (p[0] == 'W' && p[1] == '/') p += 2;
+        size_t len = strcspn(p, ",");
+        while (len > 0 && p[len - 1] == ' ') len--;
+        if (len == tag_len && strncmp(p, tag, len) == 0) return true;
+        p += strcspn(p, ",");
+    }
+    return false;
+}
+
+// Builds the ETag/Last-Modified block shared by every static file response
+void http_file_validators(const struct stat *st, bool gzip, bool compressible,
+                          char *etag, size_t etag_len, char *out, size_t out_len) {
+    char last_modified[96] = "";
+    http_make_etag(st, gzip, etag, etag_len);
+    if (http_date_is_strong(st->st_mtime)) {
+        char date[64];
+        http_format_date(st->st_mtime, date, sizeof(date));
+        snprintf(last_modified, sizeof(last_modified), "Last-Modified: %s\r\n", date);
+    }
+    snprintf(out, out_len,
+        "ETag: %s\r\n%sAccept-Ranges: bytes\r\n%s",
+        etag, last_modified, compressible ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+bool http_not_modified(const HttpRequest *req, const char *etag, time_t mtime) {
+    char cond[512];
+    if (http_find_header(req, "If-None-Match", cond, sizeof(cond))) {
+        return http_etag_matches(cond, etag);
+    }
+    if (http_find_header(req, "If-Modified-Since", cond, sizeof(cond))) {
+        time_t since = http_parse_date(cond);
+        return since != -1 && mtime <= since && http_date_is_strong(mtime);
+    }
+    return false;
+}
+
+// Returns the number of ranges, 0 when the header should be ignored, -1 when unsatisfiable
+int http_parse_ranges(const char *spec, off_t size, HttpRange *ranges, int max) {
+    if (strncmp(spec, "bytes=", 6) != 0) return 0;
+    const char *p = spec + 6;
+    int n = 0;
+    
+    while (*p) {
+        while (*p == ' ' || *p == ',') p++;
+        if (!*p) break;
+        if (n == max) return 0;
+        
+        char *end;
+        off_t start, last;
+        if (*p == '-') {
+            off_t suffix = strtoll(p + 1, &end, 10);
+            if (end == p + 1) return 0;
+            if (suffix == 0) {
+                p = end;
+                continue;
+            }
+            start = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+        } else {
+            start = strtoll(p, &end, 10);
+            if (end == p || *end != '-') return 0;
+            p = end + 1;
+            last = strtoll(p, &end, 10);
+            if (end == p) last = size - 1;
+            else if (last < start) return 0;
+            if (last >= size) last = size - 1;
+        }
+        p = end;
+        while (*p == ' ') p++;
+        if (*p && *p != ',') return 0;
+        
+        if (start < size) {
+            ranges[n].start = start;
+            ranges[n].end = last;
+            n++;
+        }
+    }
+    return n > 0 ? n : -1;
+}
+
+bool http_send_ranges(HttpConnection *c, int fd, off_t size, const char *mime,
+                      const char *validators, HttpRange *ranges, int n, bool head_only) {
+    char header[8192];
+    int header_len;
+    
+    if (n == 1) {
+        off_t len = ranges[0].end - ranges[0].start + 1;
+        header_len = snprintf(header, sizeof(header),
+            "HTTP/1.1 206 Partial Content\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %ld\r\n"
+            "Content-Range: bytes %ld-%ld/%ld\r\n"
+            "%s"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Connection: close\r\n\r\n", mime, (long)len,
+            (long)ranges[0].start, (long)ranges[0].end, (long)size, validators);
+        if (!http_send(c, header, header_len)) return false;
+        return head_only || http_sendfile(c, fd, ranges[0].start, len);
+    }
+    
+    // Part headers are built up front so Content-Length is exact
+    const char *boundary = "zenith_byteranges_7d3f";
+    char parts[HTTP_MAX_RANGES][256];
+    int part_lens[HTTP_MAX_RANGES];
+    off_t total = 0;
+    for (int i = 0; i < n; i++) {
+        part_lens[i] = snprintf(parts[i], sizeof(parts[i]),
+            "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+            boundary, mime, (long)ranges[i].start, (long)ranges[i].end, (long)size);
+        total += part_lens[i] + (ranges[i].end - ranges[i].start + 1);
+    }
+    char trailer[64];
+    int trailer_len = snprintf(trailer, sizeof(trailer), "\r\n--%s--\r\n", boundary);
+    total += trailer_len;
+    
+    header_len = snprintf(header, sizeof(header),
+        "HTTP/1.1 206 Partial Content\r\n"
+        "Content-Type: multipart/byteranges; boundary=%s\r\n"
+        "Content-Length: %ld\r\n"
+        "%s"
+        "Access-Control-Allow-Origin: *\r\n"
+        "Connection: close\r\n\r\n", boundary, (long)total, validators);
+    if (!http_send(c, header, header_len)) return false;
+    if (head_only) return true;
+    
+    for (int i = 0; i < n; i++) {
+        if (!http_send(c, parts[i], part_lens[i])) return false;
+        if (!http_sendfile(c, fd, ranges[i].start, ranges[i].end - ranges[i].start + 1)) {
+            return false;
+        }
+    }
+    return http_send(c, trailer, trailer_len);
+}
+
+// Admission control. Connections are checked once at accept: a global cap on
+// connections in the system (queued or in service) and an optional per-IP
+// token bucket. Requests are checked again once their head is parsed, against
+// a cap on declared request bytes in flight. Anything turned away gets a
+// tiny canned response instead of waiting in the kernel backlog.
+#define HTTP_LISTEN_BACKLOG 4096
+#define HTTP_DEFAULT_MAX_CONNS 1024
+#define HTTP_DEFAULT_QUEUE_TIMEOUT_MS 1000
+#define RATE_BUCKETS 4096
+#define RATE_PROBES 8
+
+typedef enum {
+    SHED_MAX_CONNS, SHED_RATE_LIMIT, SHED_PENDING_BYTES, SHED_QUEUE_TIMEOUT, SHED_REASONS
+} ShedReason;
+
+const char *shed_reason_names[SHED_REASONS] = {
+    "max_conns", "rate_limit", "pending_bytes", "queue_timeout"
+};
+
+typedef struct {
+    long long active;
+    long long pending_bytes;
+    uint64_t admitted;
+    uint64_t shed[SHED_REASONS];
+} AdmissionState;
+
+// Everything a process counts lives in one MAP_SHARED mapping made before
+// forking, so the metrics endpoint in any worker process sees every process
+// without a message on the request path.
+typedef struct {
+    AdmissionState admission;
+    pid_t pid;
+    uint64_t restarts;
+} __attribute__((aligned(64))) ProcessStats;
+
+ProcessStats *http_processes = NULL;
+int http_process_count = 0;
+size_t http_stats_size = 0;
+bool http_stats_shared = false;
+AdmissionState *http_admission = NULL;
+
+void http_stats_alloc(int processes, int threads) {
+    if (http_metrics && http_stats_shared) munmap(http_metrics, http_stats_size);
+    else free(http_metrics);
+    size_t metrics_size = (size_t)processes * threads * sizeof(WorkerMetrics);
+    http_stats_size = metrics_size + processes * sizeof(ProcessStats);
+    // Anonymous shared pages start zeroed
+    void *mem = mmap(NULL, http_stats_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    http_stats_shared = mem != MAP_FAILED;
+    if (!http_stats_shared) {
+        // Without the shared mapping each process only counts itself
+        mem = aligned_alloc(64, http_stats_size);
+        memset(mem, 0, http_stats_size);
+    }
+    http_metrics = mem;
+    http_metrics_count = processes * threads;
+    http_processes = (ProcessStats*)((char*)mem + metrics_size);
+    http_process_count = processes;
+    http_admission = &http_processes[0].admission;
+}
+
+typedef struct {
+    uint32_t ip;
+    double tokens;
+    uint64_t updated_ns;
+} RateBucket;
+
+RateBucket rate_buckets[RATE_BUCKETS];
+pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Takes one token for ip. Returns 0 when allowed, otherwise the seconds until one is available.
+int rate_limit_take(uint32_t ip, uint64_t now) {
+    double rate = http_server.rate_limit;
+    double burst = http_server.rate_burst > 0 ? http_server.rate_burst : rate;
+    if (burst < 1) burst = 1;
+    
+    pthread_mutex_lock(&rate_lock);
+    unsigned start = (ip * 2654435761u) % RATE_BUCKETS;
+    RateBucket *b = NULL, *oldest = NULL;
+    for (int i = 0; i < RATE_PROBES; i++) {
+        RateBucket *probe = &rate_buckets[(start + i) % RATE_BUCKETS];
+        if (probe->updated_ns && probe->ip == ip) {
+            b = probe;
+            break;
+        }
+        if (!oldest || probe->updated_ns < oldest->updated_ns) oldest = probe;
+    }
+    if (!b) {
+        // Evicting the stalest neighbour only forgets a client that has been quiet longest
+        b = oldest;
+        b->ip = ip;
+        b->tokens = burst;
+        b->updated_ns = now;
+    }
+    
+    b->tokens += (now - b->updated_ns) / 1e9 * rate;
+    if (b->tokens > burst) b->tokens = burst;
+    b->updated_ns = now;
+    int wait = 0;
+    if (b->tokens >= 1) b->tokens -= 1;
+    else wait = (int)ceil((1 - b->tokens) / rate);
+    pthread_mutex_unlock(&rate_lock);
+    return wait;
+}
+
+int http_shed_response(char *out, size_t out_len, ShedReason reason, int retry_after) {
+    int status = reason == SHED_RATE_LIMIT ? 429 : 503;
+    __atomic_fetch_add(&http_admission->shed[reason], 1, __ATOMIC_RELAXED);
+    return snprintf(out, out_len,
+        "HTTP/1.1 %d %s\r\n"
+        "Retry-After: %d\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n\r\n", status,
+        status == 429 ? "Too Many Requests" : "Service Unavailable", retry_after);
+}
+
+// Canned refusal written without blocking; a full socket buffer just loses it.
+// TLS clients are refused by closing, since a handshake would cost more than serving.
+void http_shed(int fd, ShedReason reason, int retry_after) {
+    char response[192];
+    int len = http_shed_response(response, sizeof(response), reason, retry_after);
+    if (!http_tls_ctx) send(fd, response, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+// Decides whether a freshly accepted connection may be served. Refused
+// connections are answered and closed here.
+bool http_admit(int fd, const struct sockaddr_in *peer) {
+    if (http_server.rate_limit > 0) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        if (!peer && getpeername(fd, (struct sockaddr*)&addr, &len) == 0) peer = &addr;
+        int wait = peer && peer->sin_family == AF_INET ?
+                   rate_limit_take(peer->sin_addr.s_addr, monotonic_ns()) : 0;
+        if (wait > 0) {
+            http_shed(fd, SHED_RATE_LIMIT, wait);
+            close(fd);
+            return false;
+        }
+    }
+    if (__atomic_add_fetch(&http_admission->active, 1, __ATOMIC_RELAXED) > http_server.max_conns) {
+        __atomic_sub_fetch(&http_admission->active, 1, __ATOMIC_RELAXED);
+        http_shed(fd, SHED_MAX_CONNS, 1);
+        close(fd);
+        return false;
+    }
+    __atomic_fetch_add(&http_admission->admitted, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void http_admission_release(void) {
+    __atomic_sub_fetch(&http_admission->active, 1, __ATOMIC_RELAXED);
+}
+
+// held is what the same request already has charged
+bool http_pending_reserve(long long bytes, long long held) {
+    long long total = __atomic_add_fetch(&http_admission->pending_bytes, bytes, __ATOMIC_RELAXED);
+    // A lone request bigger than the cap still gets through when nothing else is pending
+    if (http_server.max_pending > 0 && total > http_server.max_pending && total != held + bytes) {
+        __atomic_sub_fetch(&http_admission->pending_bytes, bytes, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+void http_pending_release(long long bytes) {
+    __atomic_sub_fetch(&http_admission->pending_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// Admitted connections wait here for a worker. Admission already bounds the
+// count by max_conns, so the ring never overflows.
+typedef struct {
+    int fd;
+    uint64_t accepted_ns;
+    HttpConnection *conn;   // set when an io_uring worker hands over a parsed head
+} HttpQueued;
+
+typedef struct {
+    HttpQueued *items;
+    int cap;
+    int head;
+    int count;
+    bool enabled;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} HttpQueue;
+
+HttpQueue http_queue = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER };
+// Requests an io_uring worker can't finish without blocking (routes,
+// compression, ranges, HTTP/2) go to a pool of blocking threads through here
+HttpQueue http_handoff = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER };
+
+void http_queue_open(HttpQueue *q, int cap) {
+    q->cap = cap;
+    q->items = malloc(cap * sizeof(HttpQueued));
+    q->head = q->count = 0;
+    q->closed = false;
+    q->enabled = true;
+}
+
+void http_queue_free(HttpQueue *q) {
+    free(q->items);
+    q->items = NULL;
+    q->enabled = false;
+}
+
+void http_queue_push(HttpQueue *q, HttpQueued item) {
+    pthread_mutex_lock(&q->lock);
+    q->items[(q->head + q->count) % q->cap] = item;
+    q->count++;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+bool http_queue_pop(HttpQueue *q, HttpQueued *out) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed) {
+        pthread_cond_wait(&q->ready, &q->lock);
+    }
+    bool ok = q->count > 0;
+    if (ok) {
+        *out = q->items[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+void http_queue_close(HttpQueue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void http_record_request(HttpConnection *c) {
+    WorkerMetrics *m = worker_metrics;
+    uint64_t end = monotonic_ns();
+    
+    if (!c->first_byte_ns) return;
+    METRIC_INC(m->requests, 1);
+    int status_class = c->status / 100;
+    METRIC_INC(m->status_classes[status_class >= 1 && status_class <= 5 ? status_class : 0], 1);
+    METRIC_INC(m->bytes_sent, c->bytes_sent);
+    hist_record(&m->first_byte, (c->first_byte_ns - c->accepted_ns) / 1000);
+    hist_record(&m->duration, (end - c->accepted_ns) / 1000);
+}
+
+// HTTP/2 streams are recorded as they finish; the connection itself only counts as closed
+void http_record_metrics(HttpConnection *c) {
+    METRIC_INC(worker_metrics->connections_closed, 1);
+    http_record_request(c);
+}
+
+// WebSocket endpoints (RFC 6455). After the handshake a connection leaves its
+// worker for the hub thread, which watches every socket with epoll and runs
+// the message handlers. A broadcast frames its message once into a refcounted
+// buffer and each subscriber's queue only takes a reference to it.
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_READ_SIZE 65536
+#define WS_MAX_MESSAGE (16 * 1024 * 1024)
+#define WS_MAX_QUEUED (8 * 1024 * 1024)
+#define WS_MAX_IOV 64
+#define WS_MAX_EVENTS 256
+
+enum {
+    WS_CONTINUATION = 0, WS_TEXT = 1, WS_BINARY = 2, WS_CLOSE = 8, WS_PING = 9, WS_PONG = 10
+};
+
+typedef struct {
+    int refs;
+    size_t len;
+    uint8_t data[];
+} WsFrame;
+
+typedef struct WsOut {
+    WsFrame *frame;
+    struct WsOut *next;
+} WsOut;
+
+typedef struct WsConn {
+    uint64_t id;
+    int fd;
+    SSL *ssl;
+    Route *route;
+    char *path;
+    uint8_t *in;
+    size_t in_len;
+    size_t in_cap;
+    uint8_t *msg;
+    size_t msg_len;
+    size_t msg_cap;
+    uint8_t msg_opcode;
+    WsOut *out;
+    WsOut *out_tail;
+    size_t out_off;
+    size_t out_bytes;
+    bool want_write;
+    bool dirty;
+    bool closing;
+    bool dead;
+    struct WsConn *prev;
+    struct WsConn *next;
+    struct WsConn *dirty_next;
+} WsConn;
+
+typedef struct {
+    char *name;
+    WsConn **members;
+    int count;
+    int capacity;
+} WsChannel;
+
+// Everything but the connections' input side is guarded by lock
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool started;
+    int epfd;
+    int wake_fd;
+    WsConn *conns;
+    WsConn *pending;
+    WsConn *dirty;
+    WsChannel *channels;
+    int channel_count;
+    int channel_capacity;
+    uint64_t next_id;
+    long long open;
+    uint64_t messages_in;
+    uint64_t frames_out;
+} WsHub;
+
+WsHub ws_hub = { .lock = PTHREAD_MUTEX_INITIALIZER, .epfd = -1, .wake_fd = -1 };
+
+// Server frames are never masked, so one encoding serves every recipient
+WsFrame *ws_frame_new(uint8_t opcode, const void *payload, size_t len) {
+    size_t header = len < 126 ? 2 : len <= 0xffff ? 4 : 10;
+    WsFrame *f = malloc(sizeof(WsFrame) + header + len);
+    f->refs = 1;
+    f->len = header + len;
+    f->data[0] = 0x80 | opcode;
+    if (len < 126) {
+        f->data[1] = len;
+    } else if (len <= 0xffff) {
+        f->data[1] = 126;
+        f->data[2] = len >> 8;
+        f->data[3] = len;
+    } else {
+        f->data[1] = 127;
+        for (int i = 0; i < 8; i++) f->data[2 + i] = (uint64_t)len >> (56 - 8 * i);
+    }
+    memcpy(f->data + header, payload, len);
+    return f;
+}
+
+void ws_frame_release(WsFrame *f) {
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) free(f);
+}
+
+void ws_wake(void) {
+    uint64_t one = 1;
+    if (write(ws_hub.wake_fd, &one, sizeof(one)) < 0) return;
+}
+
+// Caller holds ws_hub.lock
+void ws_mark_dirty(WsConn *c) {
+    if (c->dirty) return;
+    c->dirty = true;
+    c->dirty_next = ws_hub.dirty;
+    ws_hub.dirty = c;
+}
+
+// Caller holds ws_hub.lock
+bool ws_enqueue(WsConn *c, WsFrame *f) {
+    if (c->dead || c->closing) return false;
+    if (c->out_bytes + f->len > WS_MAX_QUEUED) {
+        // A subscriber this far behind is dropped rather than buffered without bound
+        c->dead = true;
+        ws_mark_dirty(c);
+        return false;
+    }
+    WsOut *o = malloc(sizeof(WsOut));
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+    o->frame = f;
+    o->next = NULL;
+    if (c->out_tail) c->out_tail->next = o;
+    else c->out = o;
+    c->out_tail = o;
+    c->out_bytes += f->len;
+    ws_mark_dirty(c);
+    return true;
+}
+
+void ws_send_one(WsConn *c, uint8_t opcode, const void *payload, size_t len) {
+    WsFrame *f = ws_frame_new(opcode, payload, len);
+    pthread_mutex_lock(&ws_hub.lock);
+    ws_enqueue(c, f);
+    pthread_mutex_unlock(&ws_hub.lock);
+    ws_frame_release(f);
+}
+
+// Queues a close frame; the connection is dropped once it has been flushed
+void ws_close(WsConn *c, uint16_t code) {
+    uint8_t payload[2] = { code >> 8, code & 0xff };
+    ws_send_one(c, WS_CLOSE, payload, sizeof(payload));
+    pthread_mutex_lock(&ws_hub.lock);
+    c->closing = true;
+    pthread_mutex_unlock(&ws_hub.lock);
+}
+
+// Caller holds ws_hub.lock
+WsChannel *ws_channel(const char *name, bool create) {
+    for (int i = 0; i < ws_hub.channel_count; i++) {
+        if (strcmp(ws_hub.channels[i].name, name) == 0) return &ws_hub.channels[i];
+    }
+    if (!create) return NULL;
+    if (ws_hub.channel_count == ws_hub.channel_capacity) {
+        ws_hub.channel_capacity = ws_hub.channel_capacity ? ws_hub.channel_capacity * 2 : 16;
+        ws_hub.channels = realloc(ws_hub.channels, ws_hub.channel_capacity * sizeof(WsChannel));
+    }
+    WsChannel *ch = &ws_hub.channels[ws_hub.channel_count++];
+    memset(ch, 0, sizeof(*ch));
+    ch->name = strdup(name);
+    return ch;
+}
+
+// Caller holds ws_hub.lock
+void ws_subscribe(WsConn *c, const char *name) {
+    WsChannel *ch = ws_channel(name, true);
+    for (int i = 0; i < ch->count; i++) {
+        if (ch->members[i] == c) return;
+    }
+    if (ch->count == ch->capacity) {
+        ch->capacity = ch->capacity ? ch->capacity * 2 : 64;
+        ch->members = realloc(ch->members, ch->capacity * sizeof(WsConn*));
+    }
+    ch->members[ch->count++] = c;
+}
+
+// Caller holds ws_hub.lock
+WsConn *ws_find(uint64_t id) {
+    for (WsConn *c = ws_hub.conns; c; c = c->next) {
+        if (c->id == id) return c;
+    }
+    return NULL;
+}
+
+// Returns how many subscribers the message was queued for
+int ws_broadcast(const char *channel, const char *text, size_t len) {
+    WsFrame *f = ws_frame_new(WS_TEXT, text, len);
+    int queued = 0;
+    pthread_mutex_lock(&ws_hub.lock);
+    WsChannel *ch = ws_channel(channel, false);
+    for (int i = 0; ch && i < ch->count; i++) {
+        if (ws_enqueue(ch->members[i], f)) queued++;
+    }
+    pthread_mutex_unlock(&ws_hub.lock);
+    if (queued > 0) ws_wake();
+    ws_frame_release(f);
+    return queued;
+}
+
+// Caller holds ws_hub.lock
+void ws_destroy(WsConn *c) {
+    for (int i = 0; i < ws_hub.channel_count; i++) {
+        WsChannel *ch = &ws_hub.channels[i];
+        for (int j = 0; j < ch->count; j++) {
+            if (ch->members[j] == c) {
+                ch->members[j] = ch->members[--ch->count];
+                break;
+            }
+        }
+    }
+    if (c->prev) c->prev->next = c->next;
+    else ws_hub.conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+    
+    while (c->out) {
+        WsOut *o = c->out;
+        c->out = o->next;
+        ws_frame_release(o->frame);
+        free(o);
+    }
+    if (c->ssl) {
+        if (!c->dead) SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+        ERR_clear_error();
+    }
+    close(c->fd);
+    free(c->path);
+    free(c->in);
+    free(c->msg);
+    free(c);
+    ws_hub.open--;
+}
+
+// Writes as much queued output as the socket takes. Caller holds ws_hub.lock.
+bool ws_flush(WsConn *c) {
+    while (c->out) {
+        ssize_t n;
+        if (c->ssl) {
+            WsFrame *f = c->out->frame;
+            int r = SSL_write(c->ssl, f->data + c->out_off, f->len - c->out_off);
+            if (r <= 0) {
+                int err = SSL_get_error(c->ssl, r);
+                if (err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ) return false;
+                break;
+            }
+            n = r;
+        } else {
+            // One writev drains many frames; a shared frame is never copied
+            struct iovec iov[WS_MAX_IOV];
+            int count = 0;
+            size_t off = c->out_off;
+            for (WsOut *o = c->out; o && count < WS_MAX_IOV; o = o->next) {
+                iov[count].iov_base = o->frame->data + off;
+                iov[count].iov_len = o->frame->len - off;
+                count++;
+                off = 0;
+            }
+            n = writev(c->fd, iov, count);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+                break;
+            }
+        }
+        
+        c->out_bytes -= n;
+        while (n > 0) {
+            size_t left = c->out->frame->len - c->out_off;
+            if ((size_t)n < left) {
+                c->out_off += n;
+                break;
+            }
+            n -= left;
+            WsOut *o = c->out;
+            c->out = o->next;
+            if (!c->out) c->out_tail = NULL;
+            c->out_off = 0;
+            ws_frame_release(o->frame);
+            free(o);
+            METRIC_INC(ws_hub.frames_out, 1);
+        }
+    }
+    
+    bool want = c->out != NULL;
+    if (want != c->want_write) {
+        struct epoll_event ev = { .events = EPOLLIN | (want ? EPOLLOUT : 0), .data.ptr = c };
+        epoll_ctl(ws_hub.epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want;
+    }
+    return true;
+}
+
+Value *ws_conn_value(WsConn *c) {
+    Value *v = create_value(VAL_DICT);
+    dict_set(v, "id", make_number((double)c->id));
+    dict_set(v, "path", make_string(c->path));
+    return v;
+}
+
+// Handlers get (ws, message); message is null when the connection opens.
+// Whatever they return is sent back to that client.
+void ws_dispatch(WsConn *c, const uint8_t *data, size_t len) {
+    Value *args[2];
+    args[0] = ws_conn_value(c);
+    if (data) {
+        args[1] = create_value(VAL_STRING);
+        args[1]->data.string = strndup((const char*)data, len);
+    } else {
+        args[1] = create_value(VAL_NULL);
+    }
+    
+    Value *ret = call_function(c->route->handler, args, 2, false);
+    if (ret->type != VAL_NULL && ret->type != VAL_UNDEFINED) {
+        char *text = value_to_string(ret);
+        ws_send_one(c, WS_TEXT, text, strlen(text));
+        free(text);
+    }
+    free_value(ret);
+    free_value(args[0]);
+    free_value(args[1]);
+}
+
+void ws_unmask(uint8_t *p, size_t len, const uint8_t *mask) {
+    uint32_t m32;
+    memcpy(&m32, mask, 4);
+    uint64_t m64 = ((uint64_t)m32 << 32) | m32;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        v ^= m64;
+        memcpy(p + i, &v, 8);
+    }
+    for (; i < len; i++) p[i] ^= mask[i & 3];
+}
+
+void ws_on_frame(WsConn *c, bool fin, uint8_t opcode, uint8_t *payload, size_t len) {
+    if (opcode >= WS_CLOSE) {
+        if (!fin || len > 125) ws_close(c, 1002);
+        else if (opcode == WS_PING) ws_send_one(c, WS_PONG, payload, len);
+        else if (opcode == WS_CLOSE) ws_close(c, len >= 2 ? (payload[0] << 8) | payload[1] : 1000);
+        else if (opcode != WS_PONG) ws_close(c, 1002);
+        return;
+    }
+    
+    if (opcode == WS_CONTINUATION ? !c->msg_opcode : (opcode > WS_BINARY || c->msg_opcode)) {
+        ws_close(c, 1002);
+        return;
+    }
+    if (fin && opcode != WS_CONTINUATION) {
+        // Unfragmented messages go to the handler straight from the read buffer
+        METRIC_INC(ws_hub.messages_in, 1);
+        ws_dispatch(c, payload, len);
+        return;
+    }
+    
+    if (opcode != WS_CONTINUATION) {
+        c->msg_opcode = opcode;
+        c->msg_len = 0;
+    }
+    if (c->msg_len + len > WS_MAX_MESSAGE) {
+        ws_close(c, 1009);
+        return;
+    }
+    if (c->msg_len + len > c->msg_cap) {
+        c->msg_cap = c->msg_len + len > 2 * c->msg_cap ? c->msg_len + len : 2 * c->msg_cap;
+        c->msg = realloc(c->msg, c->msg_cap);
+    }
+    memcpy(c->msg + c->msg_len, payload, len);
+    c->msg_len += len;
+    if (fin) {
+        c->msg_opcode = 0;
+        METRIC_INC(ws_hub.messages_in, 1);
+        ws_dispatch(c, c->msg, c->msg_len);
+    }
+}
+
+// Handles every complete frame in the input buffer
+void ws_process(WsConn *c) {
+    size_t off = 0;
+    while (!c->closing && c->in_len - off >= 2) {
+        uint8_t *p = c->in + off;
+        size_t avail = c->in_len - off;
+        // Clients must mask, and no extension was negotiated that could set RSV bits
+        if (!(p[1] & 0x80) || (p[0] & 0x70)) {
+            ws_close(c, 1002);
+            break;
+        }
+        uint64_t len = p[1] & 0x7f;
+        size_t header = 2;
+        if (len == 126) {
+            if (avail < 4) break;
+            len = (p[2] << 8) | p[3];
+            header = 4;
+        } else if (len == 127) {
+            if (avail < 10) break;
+            len = 0;
+            for (int i = 0; i < 8; i++) len = (len << 8) | p[2 + i];
+            header = 10;
+        }
+        if (len > WS_MAX_MESSAGE) {
+            ws_close(c, 1009);
+            break;
+        }
+        if (avail < header + 4 + len) break;
+        
+        uint8_t *payload = p + header + 4;
+        ws_unmask(payload, len, p + header);
+        off += header + 4 + len;
+        ws_on_frame(c, p[0] & 0x80, p[0] & 0x0f, payload, len);
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+}
+
+// Reads until the socket is drained; false once the connection is gone
+bool ws_read(WsConn *c) {
+    while (!c->closing) {
+        if (c->in_cap - c->in_len < WS_READ_SIZE) {
+            c->in_cap = c->in_len + 2 * WS_READ_SIZE;
+            c->in = realloc(c->in, c->in_cap);
+        }
+        ssize_t n;
+        if (c->ssl) {
+            int r = SSL_read(c->ssl, c->in + c->in_len, WS_READ_SIZE);
+            if (r <= 0) {
+                int err = SSL_get_error(c->ssl, r);
+                if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) return false;
+                break;
+            }
+            n = r;
+        } else {
+            n = read(c->fd, c->in + c->in_len, WS_READ_SIZE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n <= 0) return false;
+        }
+        c->in_len += n;
+        ws_process(c);
+    }
+    return true;
+}
+
+// Sends what is queued and reaps connections that are finished
+void ws_hub_flush(void) {
+    pthread_mutex_lock(&ws_hub.lock);
+    WsConn *c = ws_hub.dirty;
+    ws_hub.dirty = NULL;
+    while (c) {
+        WsConn *next = c->dirty_next;
+        c->dirty = false;
+        if (!c->dead && !ws_flush(c)) c->dead = true;
+        if (c->dead || (c->closing && !c->out)) ws_destroy(c);
+        c = next;
+    }
+    pthread_mutex_unlock(&ws_hub.lock);
+}
+
+void ws_open(WsConn *c) {
+    pthread_mutex_lock(&ws_hub.lock);
+    c->next = ws_hub.conns;
+    if (c->next) c->next->prev = c;
+    ws_hub.conns = c;
+    ws_hub.open++;
+    // Every connection hears broadcasts to its endpoint's path
+    ws_subscribe(c, c->path);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    epoll_ctl(ws_hub.epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    pthread_mutex_unlock(&ws_hub.lock);
+    
+    ws_dispatch(c, NULL, 0);
+    // Frames that arrived with the handshake are already buffered
+    ws_process(c);
+    if (!ws_read(c)) c->dead = true;
+    pthread_mutex_lock(&ws_hub.lock);
+    ws_mark_dirty(c);
+    pthread_mutex_unlock(&ws_hub.lock);
+}
+
+void *ws_hub_thread(void *arg) {
+    (void)arg;
+    interpreter_context_init();
+    struct epoll_event events[WS_MAX_EVENTS];
+    
+    while (http_server.running) {
+        int n = epoll_wait(ws_hub.epfd, events, WS_MAX_EVENTS, 1000);
+        
+        pthread_mutex_lock(&ws_hub.lock);
+        WsConn *fresh = ws_hub.pending;
+        ws_hub.pending = NULL;
+        pthread_mutex_unlock(&ws_hub.lock);
+        while (fresh) {
+            WsConn *c = fresh;
+            fresh = c->next;
+            c->next = NULL;
+            ws_open(c);
+        }
+        
+        for (int i = 0; i < n; i++) {
+            WsConn *c = events[i].data.ptr;
+            if (!c) {
+                uint64_t count;
+                if (read(ws_hub.wake_fd, &count, sizeof(count)) < 0) continue;
+                continue;
+            }
+            bool failed = c->dead;
+            if (!failed && !c->closing && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                failed = !ws_read(c);
+            }
+            // Reaping waits for ws_hub_flush, so later events in this batch stay valid
+            pthread_mutex_lock(&ws_hub.lock);
+            if (failed) c->dead = true;
+            ws_mark_dirty(c);
+            pthread_mutex_unlock(&ws_hub.lock);
+        }
+        ws_hub_flush();
+    }
+    
+    // Going away: say so to everyone still connected, best effort
+    pthread_mutex_lock(&ws_hub.lock);
+    WsConn *pending = ws_hub.pending;
+    ws_hub.pending = NULL;
+    pthread_mutex_unlock(&ws_hub.lock);
+    while (pending) {
+        WsConn *c = pending;
+        pending = c->next;
+        if (c->ssl) SSL_free(c->ssl);
+        close(c->fd);
+        free(c->path);
+        free(c->in);
+        free(c);
+    }
+    for (WsConn *c = ws_hub.conns; c; c = c->next) ws_close(c, 1001);
+    pthread_mutex_lock(&ws_hub.lock);
+    while (ws_hub.conns) {
+        WsConn *c = ws_hub.conns;
+        ws_flush(c);
+        ws_destroy(c);
+    }
+    ws_hub.dirty = NULL;
+    pthread_mutex_unlock(&ws_hub.lock);
+    
+    interpreter_context_free();
+    return NULL;
+}
+
+// Caller holds ws_hub.lock
+bool ws_hub_start(void) {
+    ws_hub.epfd = epoll_create1(EPOLL_CLOEXEC);
+    ws_hub.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ws_hub.epfd < 0 || ws_hub.wake_fd < 0) return false;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(ws_hub.epfd, EPOLL_CTL_ADD, ws_hub.wake_fd, &ev);
+    ws_hub.started = pthread_create(&ws_hub.thread, NULL, ws_hub_thread, NULL) == 0;
+    return ws_hub.started;
+}
+
+void ws_hub_stop(void) {
+    if (!ws_hub.started) return;
+    ws_wake();
+    pthread_join(ws_hub.thread, NULL);
+    close(ws_hub.epfd);
+    close(ws_hub.wake_fd);
+    ws_hub.epfd = ws_hub.wake_fd = -1;
+    ws_hub.started = false;
+}
+
+// Answers the upgrade and hands the socket to the hub. Returns 0 once the
+// request is dealt with, or the status to refuse it with.
+int http_websocket_upgrade(HttpConnection *c, Route *route, const char *path) {
+    HttpRequest *req = &c->req;
+    char upgrade[32], version[8], key[64];
+    if (c->h2 || !slice_eq(req->method, "GET") ||
+        !http_find_header(req, "Upgrade", upgrade, sizeof(upgrade)) || strcasecmp(upgrade, "websocket") != 0 ||
+        !http_find_header(req, "Sec-WebSocket-Key", key, sizeof(key)) ||
+        !http_find_header(req, "Sec-WebSocket-Version", version, sizeof(version)) || strcmp(version, "13") != 0) {
+        return 426;
+    }
+    
+    char accept_src[128];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    char accept[32];
+    int src_len = snprintf(accept_src, sizeof(accept_src), "%s%s", key, WS_GUID);
+    SHA1((unsigned char*)accept_src, src_len, digest);
+    EVP_EncodeBlock((unsigned char*)accept, digest, SHA_DIGEST_LENGTH);
+    
+    pthread_mutex_lock(&ws_hub.lock);
+    bool ready = ws_hub.started || ws_hub_start();
+    pthread_mutex_unlock(&ws_hub.lock);
+    if (!ready) return 503;
+    
+    char response[256];
+    int len = snprintf(response, sizeof(response),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    if (!http_send(c, response, len)) return 0;
+    
+    WsConn *ws = calloc(1, sizeof(WsConn));
+    ws->fd = c->fd;
+    ws->ssl = c->ssl;
+    ws->route = route;
+    ws->path = strdup(path);
+    ws->in_cap = 2 * WS_READ_SIZE;
+    ws->in = malloc(ws->in_cap);
+    // Frames the client sent right behind its handshake are already buffered
+    ws->in_len = c->len - c->pos;
+    memcpy(ws->in, c->buf + c->pos, ws->in_len);
+    fcntl(ws->fd, F_SETFL, fcntl(ws->fd, F_GETFL) | O_NONBLOCK);
+    if (ws->ssl) SSL_set_mode(ws->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    
+    // The socket and TLS session now belong to the hub
+    c->detached = true;
+    c->ssl = NULL;
+    pthread_mutex_lock(&ws_hub.lock);
+    ws->id = ++ws_hub.next_id;
+    ws->next = ws_hub.pending;
+    ws_hub.pending = ws;
+    pthread_mutex_unlock(&ws_hub.lock);
+    ws_wake();
+    return 0;
+}
+
+void http_write_histogram(FILE *out, const char *name, const char *help, const LatencyHistogram *h) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    uint64_t cumulative = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        cumulative += h->counts[i];
+        // One Prometheus bucket per power of two, 1us to ~67s, keeps the series stable
+        uint64_t upper = hist_bucket_upper(i) + 1;
+        if ((i + 1) % HIST_SUB_COUNT == 0 && upper <= (1ull << 26)) {
+            fprintf(out, "%s_bucket{le=\"%.6f\"} %llu\n", name, upper / 1e6,
+                    (unsigned long long)cumulative);
+        }
+    }
+    fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->total);
+    fprintf(out, "%s_sum %.6f\n%s_count %llu\n", name, h->sum / 1e6, name, (unsigned long long)h->total);
+}
+
+// Prometheus text exposition of all worker counters, summed at read time
+void http_send_metrics(HttpConnection *c) {
+    WorkerMetrics sum = {0};
+    for (int w = 0; w < http_metrics_count; w++) {
+        WorkerMetrics *m = &http_metrics[w];
+        sum.requests += __atomic_load_n(&m->requests, __ATOMIC_RELAXED);
+        for (int i = 0; i < 6; i++) {
+            sum.status_classes[i] += __atomic_load_n(&m->status_classes[i], __ATOMIC_RELAXED);
+        }
+        sum.bytes_sent += __atomic_load_n(&m->bytes_sent, __ATOMIC_RELAXED);
+        sum.connections_accepted += __atomic_load_n(&m->connections_accepted, __ATOMIC_RELAXED);
+        sum.connections_closed += __atomic_load_n(&m->connections_closed, __ATOMIC_RELAXED);
+        sum.tls_handshakes += __atomic_load_n(&m->tls_handshakes, __ATOMIC_RELAXED);
+        sum.tls_resumed += __atomic_load_n(&m->tls_resumed, __ATOMIC_RELAXED);
+        sum.tls_ktls += __atomic_load_n(&m->tls_ktls, __ATOMIC_RELAXED);
+        sum.tls_failures += __atomic_load_n(&m->tls_failures, __ATOMIC_RELAXED);
+        hist_merge(&sum.first_byte, &m->first_byte);
+        hist_merge(&sum.duration, &m->duration);
+    }
+    AdmissionState admission = {0};
+    int live_processes = 0;
+    uint64_t restarts = 0;
+    for (int p = 0; p < http_process_count; p++) {
+        AdmissionState *a = &http_processes[p].admission;
+        admission.active += __atomic_load_n(&a->active, __ATOMIC_RELAXED);
+        admission.pending_bytes += __atomic_load_n(&a->pending_bytes, __ATOMIC_RELAXED);
+        admission.admitted += __atomic_load_n(&a->admitted, __ATOMIC_RELAXED);
+        for (int i = 0; i < SHED_REASONS; i++) {
+            admission.shed[i] += __atomic_load_n(&a->shed[i], __ATOMIC_RELAXED);
+        }
+        if (__atomic_load_n(&http_processes[p].pid, __ATOMIC_RELAXED) > 0) live_processes++;
+        restarts += __atomic_load_n(&http_processes[p].restarts, __ATOMIC_RELAXED);
+    }
+    
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    fprintf(out, "# HELP zenith_http_requests_total Requests answered, by status class.\n");
+    fprintf(out, "# TYPE zenith_http_requests_total counter\n");
+    for (int i = 1; i <= 5; i++) {
+        fprintf(out, "zenith_http_requests_total{code=\"%dxx\"} %llu\n", i,
+                (unsigned long long)sum.status_classes[i]);
+    }
+    fprintf(out, "# HELP zenith_http_worker_requests_total Requests answered per worker.\n");
+    fprintf(out, "# TYPE zenith_http_worker_requests_total counter\n");
+    for (int w = 0; w < http_metrics_count; w++) {
+        fprintf(out, "zenith_http_worker_requests_total{worker=\"%d\"} %llu\n", w,
+                (unsigned long long)__atomic_load_n(&http_metrics[w].requests, __ATOMIC_RELAXED));
+    }
+    fprintf(out, "# HELP zenith_http_sent_bytes_total Response bytes written, headers included.\n");
+    fprintf(out, "# TYPE zenith_http_sent_bytes_total counter\n");
+    fprintf(out, "zenith_http_sent_bytes_total %llu\n", (unsigned long long)sum.bytes_sent);
+    fprintf(out, "# HELP zenith_http_connections_accepted_total Connections accepted.\n");
+    fprintf(out, "# TYPE zenith_http_connections_accepted_total counter\n");
+    fprintf(out, "zenith_http_connections_accepted_total %llu\n", (unsigned long long)sum.connections_accepted);
+    fprintf(out, "# HELP zenith_http_open_connections Connections currently being served.\n");
+    fprintf(out, "# TYPE zenith_http_open_connections gauge\n");
+    fprintf(out, "zenith_http_open_connections %llu\n",
+            (unsigned long long)(sum.connections_accepted - sum.connections_closed));
+    fprintf(out, "# HELP zenith_http_connections_admitted_total Connections that passed admission control.\n");
+    fprintf(out, "# TYPE zenith_http_connections_admitted_total counter\n");
+    fprintf(out, "zenith_http_connections_admitted_total %llu\n",
+            (unsigned long long)admission.admitted);
+    fprintf(out, "# HELP zenith_http_connections_shed_total Connections and requests turned away, by reason.\n");
+    fprintf(out, "# TYPE zenith_http_connections_shed_total counter\n");
+    for (int i = 0; i < SHED_REASONS; i++) {
+        fprintf(out, "zenith_http_connections_shed_total{reason=\"%s\"} %llu\n", shed_reason_names[i],
+                (unsigned long long)admission.shed[i]);
+    }
+    fprintf(out, "# HELP zenith_http_admitted_connections Admitted connections waiting or being served.\n");
+    fprintf(out, "# TYPE zenith_http_admitted_connections gauge\n");
+    fprintf(out, "zenith_http_admitted_connections %lld\n", admission.active);
+    fprintf(out, "# HELP zenith_http_pending_request_bytes Declared request bytes currently in flight.\n");
+    fprintf(out, "# TYPE zenith_http_pending_request_bytes gauge\n");
+    fprintf(out, "zenith_http_pending_request_bytes %lld\n", admission.pending_bytes);
+    if (http_process_count > 1) {
+        fprintf(out, "# HELP zenith_http_worker_processes Worker processes currently running.\n");
+        fprintf(out, "# TYPE zenith_http_worker_processes gauge\n");
+        fprintf(out, "zenith_http_worker_processes %d\n", live_processes);
+        fprintf(out, "# HELP zenith_http_worker_process_restarts_total Worker processes replaced after dying.\n");
+        fprintf(out, "# TYPE zenith_http_worker_process_restarts_total counter\n");
+        fprintf(out, "zenith_http_worker_process_restarts_total %llu\n", (unsigned long long)restarts);
+    }
+    if (http_tls_ctx) {
+        fprintf(out, "# HELP zenith_http_tls_handshakes_total TLS handshakes, by outcome.\n");
+        fprintf(out, "# TYPE zenith_http_tls_handshakes_total counter\n");
+        fprintf(out, "zenith_http_tls_handshakes_total{result=\"full\"} %llu\n",
+                (unsigned long long)(sum.tls_handshakes - sum.tls_resumed));
+        fprintf(out, "zenith_http_tls_handshakes_total{result=\"resumed\"} %llu\n",
+                (unsigned long long)sum.tls_resumed);
+        fprintf(out, "zenith_http_tls_handshakes_total{result=\"failed\"} %llu\n",
+                (unsigned long long)sum.tls_failures);
+        fprintf(out, "# HELP zenith_http_tls_ktls_connections_total TLS connections sending through kernel TLS.\n");
+        fprintf(out, "# TYPE zenith_http_tls_ktls_connections_total counter\n");
+        fprintf(out, "zenith_http_tls_ktls_connections_total %llu\n", (unsigned long long)sum.tls_ktls);
+    }
+    if (ws_hub.started) {
+        fprintf(out, "# HELP zenith_websocket_connections Open WebSocket connections.\n");
+        fprintf(out, "# TYPE zenith_websocket_connections gauge\n");
+        fprintf(out, "zenith_websocket_connections %lld\n", __atomic_load_n(&ws_hub.open, __ATOMIC_RELAXED));
+        fprintf(out, "# HELP zenith_websocket_messages_received_total Complete messages received from clients.\n");
+        fprintf(out, "# TYPE zenith_websocket_messages_received_total counter\n");
+        fprintf(out, "zenith_websocket_messages_received_total %llu\n",
+                (unsigned long long)__atomic_load_n(&ws_hub.messages_in, __ATOMIC_RELAXED));
+        fprintf(out, "# HELP zenith_websocket_frames_sent_total Frames written to clients, broadcast copies included.\n");
+        fprintf(out, "# TYPE zenith_websocket_frames_sent_total counter\n");
+        fprintf(out, "zenith_websocket_frames_sent_total %llu\n",
+                (unsigned long long)__atomic_load_n(&ws_hub.frames_out, __ATOMIC_RELAXED));
+    }
+    http_write_histogram(out, "zenith_http_first_byte_seconds",
+                         "Time from accept to the first response byte.", &sum.first_byte);
+    http_write_histogram(out, "zenith_http_request_duration_seconds",
+                         "Time from accept to the end of the response.", &sum.duration);
+    fclose(out);
+    
+    char header[256];
+    int len = snprintf(header, sizeof(header),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", body_len);
+    if (http_send(c, header, len)) http_send(c, body, body_len);
+    free(body);
+}
+
+const char *http_status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        case 414: return "URI Too Long";
+        case 416: return "Range Not Satisfiable";
+        case 426: return "Upgrade Required";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+Route *http_find_route(const char *method, const char *path) {
+    // Pairs with the release store in route(), so a counted slot is fully written
+    int n = __atomic_load_n(&route_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
+        if (strcmp(routes[i].path, path) == 0 &&
+            (!routes[i].method || strcasecmp(routes[i].method, method) == 0)) {
+            return &routes[i];
+        }
+    }
+    return NULL;
+}
+
+void http_send_error(HttpConnection *c, int status) {
+    char body[256], response[512];
+    int body_len = snprintf(body, sizeof(body), "<html><body><h1>%d %s</h1></body></html>",
+                            status, http_status_text(status));
+    int len = snprintf(response, sizeof(response),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: text/html\r\n"
+        "Content-Length: %d\r\n"
+        "Connection: close\r\n\r\n%s", status, http_status_text(status), body_len, body);
+    http_send(c, response, len);
+}
+
+// Builds the req value handed to route handlers
+Value *http_build_request(HttpConnection *c, const char *path, const char *body,
+                          size_t body_len, const char *body_file, bool body_bytes) {
+    HttpRequest *r = &c->req;
+    char scratch[HTTP_BUFFER_SIZE];
+    Value *req = create_value(VAL_DICT);
+    dict_set(req, "method", make_string(slice_copy(r->method, scratch, sizeof(scratch))));
+    dict_set(req, "path", make_string(path));
+    dict_set(req, "query", make_string(slice_copy(r->query, scratch, sizeof(scratch))));
+    
+    Value *headers = create_value(VAL_DICT);
+    for (int i = 0; i < r->header_count; i++) {
+        char name[256];
+        slice_copy(r->header_names[i], name, sizeof(name));
+        for (char *p = name; *p; p++) *p = tolower((unsigned char)*p);
+        dict_set(headers, name, make_string(slice_copy(r->header_values[i], scratch, sizeof(scratch))));
+    }
+    dict_set(req, "headers", headers);
+    
+    dict_set(req, "body", make_text_or_bytes(body ? body : "", body ? body_len : 0, body_bytes));
+    if (body_file && body_file[0]) dict_set(req, "body_file", make_string(body_file));
+    return req;
+}
+
+// Handlers get (req, res); they may fill in res or return a body or response dict
+void http_run_route(HttpConnection *c, Route *route, const char *method, const char *path) {
+    char *body;
+    size_t body_len;
+    char spill_path[1024];
+    if (!http_collect_body(c, &body, &body_len, spill_path, sizeof(spill_path))) {
+        if (c->req.error_status == 503) {
+            // The streamed body pushed pending bytes over max_pending
+            char response[192];
+            http_send(c, response, http_shed_response(response, sizeof(response), SHED_PENDING_BYTES, 1));
+        } else {
+            http_send_error(c, c->req.error_status);
+        }
+        return;
+    }
+    
+    Value *args[2];
+    args[0] = http_build_request(c, path, body, body_len, spill_path, route->body_bytes);
+    free(body);
+    args[1] = create_value(VAL_DICT);
+    dict_set(args[1], "status", make_number(200));
+    dict_set(args[1], "headers", create_value(VAL_DICT));
+    dict_set(args[1], "body", make_string(""));
+    
+    Value *ret = call_function(route->handler, args, 2, true);
+    Value *res = args[1];
+    if (ret->type == VAL_DICT) {
+        res = ret;
+    } else if (ret->type != VAL_NULL && ret->type != VAL_UNDEFINED) {
+        dict_set(res, "body", copy_value(ret));
+    }
+    
+    Value *status_val = dict_get(res, "status");
+    int status = status_val && status_val->type == VAL_NUMBER ? (int)status_val->data.number : 200;
+    Value *body_val = dict_get(res, "body");
+    size_t out_len = 0;
+    char *out_owned = NULL;
+    const char *out = body_val ? value_data(body_val, &out_len, &out_owned) : "";
+    
+    // Handlers set arbitrary headers, so the head is built in a growable buffer
+    char *header = NULL;
+    size_t len = 0;
+    FILE *head = open_memstream(&header, &len);
+    if (!head) {
+        http_send_error(c, 500);
+    } else {
+        fprintf(head, "HTTP/1.1 %d %s\r\n", status, http_status_text(status));
+        bool has_type = false;
+        Value *headers = dict_get(res, "headers");
+        if (headers && headers->type == VAL_DICT) {
+            for (int i = 0; i < headers->data.dict.count; i++) {
+                char *value = value_to_string(headers->data.dict.values[i]);
+                if (strcasecmp(headers->data.dict.keys[i], "Content-Type") == 0) has_type = true;
+                fprintf(head, "%s: %s\r\n", headers->data.dict.keys[i], value);
+                free(value);
+            }
+        }
+        Value *content_type = dict_get(res, "content_type");
+        if (!has_type) {
+            char *type = content_type ? value_to_string(content_type) :
+                         strdup(body_val && body_val->type == VAL_BYTES ? "application/octet-stream" :
+                                "text/plain; charset=utf-8");
+            fprintf(head, "Content-Type: %s\r\n", type);
+            free(type);
+        }
+        fprintf(head,
+            "Content-Length: %zu\r\n"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Connection: close\r\n\r\n", out_len);
+        if (fclose(head) != 0) {
+            http_send_error(c, 500);
+        } else if (http_send(c, header, len) && strcmp(method, "HEAD") != 0) {
+            http_send(c, out, out_len);
+        }
+        free(header);
+    }
+    
+    free(out_owned);
+    free_value(ret);
+    free_value(args[0]);
+    free_value(args[1]);
+    if (spill_path[0]) unlink(spill_path);
+}
+
+void http_serve_request(HttpConnection *c) {
+    HttpRequest *req = &c->req;
+    
+    char method[16], path[1024];
+    slice_copy(req->method, method, sizeof(method));
+    if (req->path.len >= sizeof(path) - 16) {
+        http_send_error(c, 414);
+        return;
+    }
+    if (!http_decode_path(req->path, path, sizeof(path))) {
+        http_send_error(c, 400);
+        return;
+    }
+    
+    if (http_server.metrics && strcmp(path, "/__zenith/metrics") == 0) {
+        http_send_metrics(c);
+        return;
+    }
+    
+    Route *route = http_find_route(method, path);
+    if (route && route->websocket) {
+        int status = http_websocket_upgrade(c, route, path);
+        if (status) http_send_error(c, status);
+        return;
+    }
+    if (route) {
+        http_run_route(c, route, method, path);
+        return;
+    }
+    
+    if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+        http_send_error(c, 405);
+        return;
+    }
+    
+    if (strcmp(path, "/") == 0) {
+        strcpy(path, "/index.html");
+    }
+    
+    char filepath[2048];
+    snprintf(filepath, 2048, "%s%s", http_server.root_dir, path);
+    
+    int fd = open(filepath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        if (fd >= 0) close(fd);
+        char *not_found = 
+            "HTTP/1.1 404 Not Found\r\n"
+            "Content-Type: text/html\r\n\r\n"
+            "<html><body><h1>404 Not Found</h1></body></html>";
+        http_send(c, not_found, strlen(not_found));
+        return;
+    }
+    
+    const char *mime = get_mime_type(filepath);
+    bool head_only = strcmp(method, "HEAD") == 0;
+    bool compressible = is_compressible_path(filepath);
+    
+    // Ranges always address the identity body, so they bypass compression
+    char range_spec[512];
+    bool has_range = http_find_header(req, "Range", range_spec, sizeof(range_spec));
+    bool gzip_ok = compressible && !has_range && http_accepts_gzip(req);
+    
+    int body_fd = fd;
+    off_t body_len = st.st_size;
+    GzipEntry *gz = NULL;
+    
+    if (gzip_ok) {
+        // A precompressed sibling wins over compressing on the fly
+        char gzpath[2064];
+        snprintf(gzpath, sizeof(gzpath), "%s.gz", filepath);
+        int gz_fd = open(gzpath, O_RDONLY);
+        struct stat gz_st;
+        if (gz_fd >= 0 && fstat(gz_fd, &gz_st) == 0 && S_ISREG(gz_st.st_mode) &&
+            mtime_cmp(&gz_st, &st) >= 0) {
+            body_fd = gz_fd;
+            body_len = gz_st.st_size;
+        } else {
+            if (gz_fd >= 0) close(gz_fd);
+            if (st.st_size >= GZIP_MIN_SIZE && st.st_size <= GZIP_MAX_SIZE) {
+                gz = gzip_for_file(filepath, fd, &st);
+                if (gz && gz->len >= (size_t)st.st_size) {
+                    gzip_entry_release(gz);
+                    gz = NULL;
+                }
+            }
+            if (gz) body_len = gz->len;
+            else gzip_ok = false;
+        }
+    }
+    
+    char etag[64], validators[256];
+    http_file_validators(&st, gzip_ok, compressible, etag, sizeof(etag), validators, sizeof(validators));
+    bool not_modified = http_not_modified(req, etag, st.st_mtime);
+    
+    char cond[512];
+    if (has_range && http_find_header(req, "If-Range", cond, sizeof(cond))) {
+        // A stale validator means the client gets the whole new representation
+        if (cond[0] == '"' || cond[0] == 'W') has_range = strcmp(cond, etag) == 0;
+        else has_range = http_parse_date(cond) == st.st_mtime && http_date_is_strong(st.st_mtime);
+    }
+    
+    HttpRange ranges[HTTP_MAX_RANGES];
+    int range_count = 0;
+    if (has_range && !not_modified) {
+        range_count = http_parse_ranges(range_spec, st.st_size, ranges, HTTP_MAX_RANGES);
+    }
+    
+    char response[8192];
+    int header_len;
+    if (not_modified) {
+        header_len = snprintf(response, sizeof(response),
+            "HTTP/1.1 304 Not Modified\r\n%sConnection: close\r\n\r\n", validators);
+        http_send(c, response, header_len);
+    } else if (range_count < 0) {
+        header_len = snprintf(response, sizeof(response),
+            "HTTP/1.1 416 Range Not Satisfiable\r\n"
+            "Content-Range: bytes */%ld\r\n"
+            "Content-Length: 0\r\n"
+            "Connection: close\r\n\r\n", (long)st.st_size);
+        http_send(c, response, header_len);
+    } else if (range_count > 0) {
+        http_send_ranges(c, fd, st.st_size, mime, validators, ranges, range_count, head_only);
+    } else {
+        header_len = snprintf(response, sizeof(response),
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %ld\r\n"
+            "%s%s"
+            "Access-Control-Allow-Origin: *\r\n"
+            "Connection: close\r\n\r\n", mime, (long)body_len,
+            gzip_ok ? "Content-Encoding: gzip\r\n" : "", validators);
+        
+        if (http_send(c, response, header_len) && !head_only) {
+            if (gz) http_send(c, gz->data, gz->len);
+            else http_sendfile(c, body_fd, 0, body_len);
+        }
+    }
+    
+    if (gz) gzip_entry_release(gz);
+    if (body_fd != fd) close(body_fd);
+    close(fd);
+}
+
+void http_serve_pending(HttpConnection *c) {
+    // The declared body counts from now on, before any of it is read
+    long long pending = c->req.head_len + (c->req.content_length > 0 ? c->req.content_length : 0);
+    if (!http_pending_reserve(pending, 0)) {
+        char response[192];
+        http_send(c, response, http_shed_response(response, sizeof(response), SHED_PENDING_BYTES, 1));
+        return;
+    }
+    c->req.pending = pending;
+    http_serve_request(c);
+    http_pending_release(c->req.pending);
+}
+
+// HTTP/2 (RFC 7540) for prior-knowledge and Upgrade: h2c connections, and
+// for TLS connections that pick h2 through ALPN. Each request still runs
+// through http_serve_request; the HTTP/1.1 response it writes is captured per
+// stream (file bodies by reference, not copied), turned into HEADERS and DATA
+// frames, and interleaved across streams under flow control.
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN 24
+#define HTTP2_FRAME_HEADER 9
+#define HTTP2_MAX_FRAME 16384
+#define HTTP2_DEFAULT_WINDOW 65535
+#define HTTP2_MAX_WINDOW 0x7fffffff
+#define HTTP2_MAX_STREAMS 100
+#define HTTP2_MAX_BODY (16 * 1024 * 1024)
+#define HTTP2_MAX_HEADER_BLOCK (64 * 1024)
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+enum {
+    H2_DATA, H2_HEADERS, H2_PRIORITY, H2_RST_STREAM, H2_SETTINGS,
+    H2_PUSH_PROMISE, H2_PING, H2_GOAWAY, H2_WINDOW_UPDATE, H2_CONTINUATION
+};
+
+enum {
+    H2_NO_ERROR, H2_PROTOCOL_ERROR, H2_INTERNAL_ERROR, H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT, H2_STREAM_CLOSED, H2_FRAME_SIZE_ERROR, H2_REFUSED_STREAM,
+    H2_CANCEL, H2_COMPRESSION_ERROR
+};
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+#define H2_SETTINGS_HEADER_TABLE_SIZE 1
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 4
+#define H2_SETTINGS_MAX_FRAME_SIZE 5
+
+typedef struct {
+    uint32_t code;
+    uint8_t bits;
+} HuffmanCode;
+
+// RFC 7541 Appendix B, indexed by symbol (256 is EOS)
+const HuffmanCode hpack_huffman[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+    {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+    {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+    {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+    {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+    {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+    {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+    {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+    {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+    {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+    {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+    {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+    {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+    {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+    {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30}
+};
+
+typedef struct {
+    const char *name;
+    const char *value;
+} HpackStatic;
+
+// RFC 7541 Appendix A; index 0 is unused
+const HpackStatic hpack_static[62] = {
+    {NULL, NULL},
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""}
+};
+
+// The code is canonical, so each length's codes form one contiguous run
+uint32_t huffman_first[31];
+uint16_t huffman_count[31];
+uint16_t huffman_offset[31];
+uint16_t huffman_symbols[257];
+pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+void hpack_build_decoder(void) {
+    int n = 0;
+    for (int bits = 1; bits <= 30; bits++) {
+        huffman_offset[bits] = n;
+        for (int sym = 0; sym < 257; sym++) {
+            if (hpack_huffman[sym].bits != bits) continue;
+            if (huffman_count[bits] == 0) huffman_first[bits] = hpack_huffman[sym].code;
+            huffman_count[bits]++;
+            huffman_symbols[n++] = sym;
+        }
+    }
+}
+
+bool hpack_huffman_decode(const uint8_t *in, size_t len, char *out, size_t cap, size_t *out_len) {
+    pthread_once(&huffman_once, hpack_build_decoder);
+    uint32_t code = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            code = (code << 1) | ((in[i] >> b) & 1);
+            if (++bits > 30) return false;
+            if (huffman_count[bits] && code >= huffman_first[bits] &&
+                code - huffman_first[bits] < huffman_count[bits]) {
+                int sym = huffman_symbols[huffman_offset[bits] + code - huffman_first[bits]];
+                if (sym == 256 || n >= cap) return false;
+                out[n++] = (char)sym;
+                code = 0;
+                bits = 0;
+            }
+        }
+    }
+    // Padding is the most significant bits of EOS: at most 7 bits, all ones
+    if (bits > 7 || code != (1u << bits) - 1) return false;
+    *out_len = n;
+    return true;
+}
+
+size_t hpack_huffman_length(const char *s, size_t len) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < len; i++) bits += hpack_huffman[(uint8_t)s[i]].bits;
+    return (bits + 7) / 8;
+}
+
+size_t hpack_huffman_encode(const char *s, size_t len, uint8_t *out) {
+    uint64_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        const HuffmanCode *h = &hpack_huffman[(uint8_t)s[i]];
+        acc = (acc << h->bits) | h->code;
+        bits += h->bits;
+        while (bits >= 8) {
+            bits -= 8;
+            out[n++] = (uint8_t)(acc >> bits);
+        }
+    }
+    if (bits > 0) out[n++] = (uint8_t)((acc << (8 - bits)) | (0xff >> bits));
+    return n;
+}
+
+size_t hpack_put_int(uint8_t *out, uint8_t flags, int prefix, uint64_t value) {
+    uint8_t max = (1 << prefix) - 1;
+    if (value < max) {
+        out[0] = flags | (uint8_t)value;
+        return 1;
+    }
+    out[0] = flags | max;
+    value -= max;
+    size_t n = 1;
+    while (value >= 128) {
+        out[n++] = (uint8_t)(value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+bool hpack_get_int(const uint8_t **p, const uint8_t *end, int prefix, uint64_t *value) {
+    if (*p >= end) return false;
+    uint8_t max = (1 << prefix) - 1;
+    uint64_t v = **p & max;
+    (*p)++;
+    if (v < max) {
+        *value = v;
+        return true;
+    }
+    for (int shift = 0; shift <= 28; shift += 7) {
+        if (*p >= end) return false;
+        uint8_t b = *(*p)++;
+        v += (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Strings go out Huffman-coded whenever that is shorter
+size_t hpack_put_string(uint8_t *out, const char *s, size_t len) {
+    size_t huff = hpack_huffman_length(s, len);
+    if (huff < len) {
+        size_t n = hpack_put_int(out, 0x80, 7, huff);
+        return n + hpack_huffman_encode(s, len, out + n);
+    }
+    size_t n = hpack_put_int(out, 0x00, 7, len);
+    memcpy(out + n, s, len);
+    return n + len;
+}
+
+// Responses are encoded without touching the dynamic table, so the encoder
+// never has to track the peer's table size
+size_t hpack_encode_header(uint8_t *out, const char *name, size_t name_len, const char *value, size_t value_len) {
+    int index = 0;
+    for (int i = 1; i < 62 && !index; i++) {
+        if (strlen(hpack_static[i].name) == name_len && memcmp(hpack_static[i].name, name, name_len) == 0) {
+            index = i;
+        }
+    }
+    size_t n;
+    if (index) {
+        n = hpack_put_int(out, 0x00, 4, index);
+    } else {
+        out[0] = 0x00;
+        n = 1 + hpack_put_string(out + 1, name, name_len);
+    }
+    return n + hpack_put_string(out + n, value, value_len);
+}
+
+typedef struct {
+    char *name;
+    char *value;
+    size_t name_len;
+    size_t value_len;
+} HpackEntry;
+
+typedef struct {
+    HpackEntry entries[HPACK_MAX_ENTRIES];
+    int head;
+    int count;
+    size_t size;
+    size_t max_size;
+} HpackTable;
+
+void hpack_table_evict(HpackTable *t, size_t limit) {
+    while (t->count > 0 && t->size > limit) {
+        HpackEntry *e = &t->entries[(t->head + t->count - 1) % HPACK_MAX_ENTRIES];
+        t->size -= e->name_len + e->value_len + 32;
+        free(e->name);
+        free(e->value);
+        t->count--;
+    }
+}
+
+void hpack_table_add(HpackTable *t, const char *name, size_t name_len, const char *value, size_t value_len) {
+    size_t size = name_len + value_len + 32;
+    if (size > t->max_size) {
+        hpack_table_evict(t, 0);
+        return;
+    }
+    hpack_table_evict(t, t->max_size - size);
+    t->head = (t->head + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    HpackEntry *e = &t->entries[t->head];
+    e->name = strndup(name, name_len);
+    e->value = strndup(value, value_len);
+    e->name_len = name_len;
+    e->value_len = value_len;
+    t->count++;
+    t->size += size;
+}
+
+bool hpack_table_get(const HpackTable *t, uint64_t index, const char **name, size_t *name_len,
+                     const char **value, size_t *value_len) {
+    if (index == 0) return false;
+    if (index < 62) {
+        *name = hpack_static[index].name;
+        *value = hpack_static[index].value;
+        *name_len = strlen(*name);
+        *value_len = strlen(*value);
+        return true;
+    }
+    index -= 62;
+    if (index >= (uint64_t)t->count) return false;
+    const HpackEntry *e = &t->entries[(t->head + index) % HPACK_MAX_ENTRIES];
+    *name = e->name;
+    *value = e->value;
+    *name_len = e->name_len;
+    *value_len = e->value_len;
+    return true;
+}
+
+typedef struct H2Chunk {
+    struct H2Chunk *next;
+    bool headers;
+    char *data;
+    int fd;
+    off_t offset;
+    size_t len;
+} H2Chunk;
+
+typedef struct Http2Stream {
+    uint32_t id;
+    HttpConnection *view;
+    size_t arena_len;
+    bool pseudo_done;
+    bool request_done;
+    bool finished;
+    int error_status;
+    char *body;
+    size_t body_len;
+    size_t body_cap;
+    size_t body_off;
+    bool body_too_large;
+    int64_t send_window;
+    char *head;
+    size_t head_len;
+    bool head_done;
+    H2Chunk *out;
+    H2Chunk *out_tail;
+    struct Http2Stream *next;
+} Http2Stream;
+
+typedef struct {
+    HttpConnection *c;
+    HpackTable decoder;
+    Http2Stream *streams;
+    int stream_count;
+    uint32_t last_stream_id;
+    uint32_t last_sent_id;
+    int64_t send_window;
+    int64_t peer_initial_window;
+    bool goaway_sent;
+    bool goaway_received;
+    bool peer_closed;
+    uint8_t *rx;
+    size_t rx_len;
+    size_t rx_cap;
+    uint8_t *block;
+    size_t block_len;
+    size_t block_cap;
+    uint32_t block_stream;
+    Http2Stream *block_target;
+    bool block_trailers;
+    bool block_end_stream;
+    uint8_t tx[HTTP2_FRAME_HEADER + HTTP2_MAX_FRAME];
+} Http2Session;
+
+uint32_t h2_get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void h2_put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void http2_frame_header(uint8_t *f, size_t len, uint8_t type, uint8_t flags, uint32_t stream) {
+    f[0] = len >> 16;
+    f[1] = len >> 8;
+    f[2] = len;
+    f[3] = type;
+    f[4] = flags;
+    h2_put32(f + 5, stream & 0x7fffffff);
+}
+
+bool http2_write_frame(Http2Session *s, uint8_t type, uint8_t flags, uint32_t stream,
+                       const void *payload, size_t len) {
+    http2_frame_header(s->tx, len, type, flags, stream);
+    if (len && payload != s->tx + HTTP2_FRAME_HEADER) memcpy(s->tx + HTTP2_FRAME_HEADER, payload, len);
+    return http_write_raw(s->c, s->tx, HTTP2_FRAME_HEADER + len);
+}
+
+// DATA straight from a file descriptor, so static files keep their sendfile path
+bool http2_write_file_frame(Http2Session *s, uint8_t flags, uint32_t stream, int fd, off_t offset, size_t len) {
+    HttpConnection *c = s->c;
+    if (c->ssl) {
+        // TLS copies through user space anyway; one record carries header and payload
+        uint8_t *payload = s->tx + HTTP2_FRAME_HEADER;
+        size_t got = 0;
+        while (got < len) {
+            ssize_t n = pread(fd, payload + got, len - got, offset + got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            got += n;
+        }
+        return http2_write_frame(s, H2_DATA, flags, stream, payload, len);
+    }
+    // MSG_MORE holds the header back so it shares a segment with the payload
+    uint8_t header[HTTP2_FRAME_HEADER];
+    http2_frame_header(header, len, H2_DATA, flags, stream);
+    size_t sent = 0;
+    while (sent < sizeof(header)) {
+        ssize_t n = send(c->fd, header + sent, sizeof(header) - sent, MSG_MORE | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return sendfile_all(c->fd, fd, offset, len);
+}
+
+// Connection errors end the session; always returns false so callers can bail out with it
+bool http2_goaway(Http2Session *s, uint32_t code) {
+    uint8_t payload[8];
+    h2_put32(payload, s->last_stream_id);
+    h2_put32(payload + 4, code);
+    s->goaway_sent = true;
+    http2_write_frame(s, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    return false;
+}
+
+bool http2_window_update(Http2Session *s, uint32_t stream, uint32_t increment) {
+    uint8_t payload[4];
+    h2_put32(payload, increment);
+    return http2_write_frame(s, H2_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+Http2Stream *http2_find_stream(Http2Session *s, uint32_t id) {
+    for (Http2Stream *st = s->streams; st; st = st->next) {
+        if (st->id == id) return st;
+    }
+    return NULL;
+}
+
+void http2_free_stream(Http2Session *s, Http2Stream *st) {
+    for (Http2Stream **p = &s->streams; *p; p = &(*p)->next) {
+        if (*p == st) {
+            *p = st->next;
+            break;
+        }
+    }
+    while (st->out) {
+        H2Chunk *chunk = st->out;
+        st->out = chunk->next;
+        if (chunk->fd >= 0) close(chunk->fd);
+        free(chunk->data);
+        free(chunk);
+    }
+    free(st->view);
+    free(st->body);
+    free(st->head);
+    free(st);
+    s->stream_count--;
+}
+
+bool http2_reset_stream(Http2Session *s, uint32_t id, uint32_t code) {
+    uint8_t payload[4];
+    h2_put32(payload, code);
+    return http2_write_frame(s, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+Http2Stream *http2_new_stream(Http2Session *s, uint32_t id) {
+    Http2Stream *st = calloc(1, sizeof(Http2Stream));
+    st->id = id;
+    st->send_window = s->peer_initial_window;
+    // The view is what http_serve_request sees: a connection carrying one request
+    st->view = calloc(1, sizeof(HttpConnection));
+    st->view->fd = s->c->fd;
+    st->view->accepted_ns = monotonic_ns();
+    st->view->h2 = st;
+    st->next = s->streams;
+    s->streams = st;
+    s->stream_count++;
+    return st;
+}
+
+// Copies a decoded field into the stream's arena (its view's request buffer)
+const char *http2_arena_put(Http2Stream *st, const char *s, size_t len) {
+    if (st->arena_len + len > sizeof(st->view->buf)) return NULL;
+    char *p = st->view->buf + st->arena_len;
+    memcpy(p, s, len);
+    st->arena_len += len;
+    return p;
+}
+
+void http2_add_header(Http2Stream *st, const char *name, size_t name_len, const char *value, size_t value_len) {
+    if (!st || st->error_status) return;
+    HttpRequest *req = &st->view->req;
+    const char *v = http2_arena_put(st, value, value_len);
+    if (!v) {
+        st->error_status = 431;
+        return;
+    }
+    HttpSlice val = {v, value_len};
+    
+    if (name_len > 0 && name[0] == ':') {
+        if (st->pseudo_done) st->error_status = 400;
+        else if (name_len == 7 && memcmp(name, ":method", 7) == 0) req->method = val;
+        else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+            req->target = val;
+            const char *q = memchr(v, '?', value_len);
+            req->path = (HttpSlice){v, q ? (size_t)(q - v) : value_len};
+            req->query = q ? (HttpSlice){q + 1, value_len - (q + 1 - v)} : (HttpSlice){v + value_len, 0};
+        } else if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+            if (req->header_count < HTTP_MAX_HEADERS) {
+                req->header_names[req->header_count] = (HttpSlice){"host", 4};
+                req->header_values[req->header_count++] = val;
+            }
+        } else if (!(name_len == 7 && memcmp(name, ":scheme", 7) == 0)) {
+            st->error_status = 400;
+        }
+        return;
+    }
+    
+    st->pseudo_done = true;
+    const char *n = http2_arena_put(st, name, name_len);
+    if (!n || req->header_count >= HTTP_MAX_HEADERS) {
+        st->error_status = 431;
+        return;
+    }
+    req->header_names[req->header_count] = (HttpSlice){n, name_len};
+    req->header_values[req->header_count++] = val;
+}
+
+// Decodes one header block. Every block must be decoded, even for refused
+// streams, or the dynamic table would drift from the peer's.
+bool hpack_decode_block(HpackTable *t, const uint8_t *p, size_t len, Http2Stream *st) {
+    const uint8_t *end = p + len;
+    char name_buf[HTTP_BUFFER_SIZE], value_buf[HTTP_BUFFER_SIZE];
+    bool first = true;
+    
+    while (p < end) {
+        uint8_t b = *p;
+        uint64_t index;
+        
+        if (b & 0x80) {
+            const char *name, *value;
+            size_t name_len, value_len;
+            if (!hpack_get_int(&p, end, 7, &index) ||
+                !hpack_table_get(t, index, &name, &name_len, &value, &value_len)) return false;
+            http2_add_header(st, name, name_len, value, value_len);
+            first = false;
+            continue;
+        }
+        if ((b & 0xe0) == 0x20) {
+            // Size updates may only open a block and can't exceed what we advertised
+            if (!first || !hpack_get_int(&p, end, 5, &index) || index > HPACK_TABLE_SIZE) return false;
+            t->max_size = index;
+            hpack_table_evict(t, t->max_size);
+            continue;
+        }
+        first = false;
+        
+        bool indexing = (b & 0xc0) == 0x40;
+        if (!hpack_get_int(&p, end, indexing ? 6 : 4, &index)) return false;
+        
+        const char *name;
+        size_t name_len;
+        if (index) {
+            const char *unused;
+            size_t unused_len;
+            if (!hpack_table_get(t, index, &name, &name_len, &unused, &unused_len)) return false;
+        } else {
+            uint64_t slen;
+            bool huff = p < end && (*p & 0x80);
+            if (!hpack_get_int(&p, end, 7, &slen) || slen > (uint64_t)(end - p)) return false;
+            if (huff) {
+                if (!hpack_huffman_decode(p, slen, name_buf, sizeof(name_buf), &name_len)) return false;
+            } else {
+                if (slen > sizeof(name_buf)) return false;
+                memcpy(name_buf, p, slen);
+                name_len = slen;
+            }
+            name = name_buf;
+            p += slen;
+        }
+        
+        uint64_t slen;
+        size_t value_len;
+        bool huff = p < end && (*p & 0x80);
+        if (!hpack_get_int(&p, end, 7, &slen) || slen > (uint64_t)(end - p)) return false;
+        if (huff) {
+            if (!hpack_huffman_decode(p, slen, value_buf, sizeof(value_buf), &value_len)) return false;
+        } else {
+            if (slen > sizeof(value_buf)) return false;
+            memcpy(value_buf, p, slen);
+            value_len = slen;
+        }
+        p += slen;
+        
+        http2_add_header(st, name, name_len, value_buf, value_len);
+        // Adding may evict the entry name points at, so it goes last
+        if (indexing) hpack_table_add(t, name, name_len, value_buf, value_len);
+    }
+    return true;
+}
+
+void http2_queue(Http2Stream *st, H2Chunk *chunk) {
+    if (st->out_tail) st->out_tail->next = chunk;
+    else st->out = chunk;
+    st->out_tail = chunk;
+}
+
+// Re-encodes a captured HTTP/1.1 status line and headers as one HPACK block
+H2Chunk *http2_encode_head(char *head, size_t head_len) {
+    H2Chunk *chunk = calloc(1, sizeof(H2Chunk));
+    chunk->headers = true;
+    chunk->fd = -1;
+    uint8_t *out = malloc(head_len * 3 + 64);
+    chunk->data = (char*)out;
+    size_t n = 0;
+    
+    int status = head_len > 12 && memcmp(head, "HTTP/1.", 7) == 0 ? atoi(head + 9) : 0;
+    if (status < 100 || status > 999) status = 500;
+    int index = 0;
+    for (int i = 8; i <= 14; i++) {
+        if (atoi(hpack_static[i].value) == status) index = i;
+    }
+    if (index) {
+        out[n++] = 0x80 | index;
+    } else {
+        char code[4];
+        snprintf(code, sizeof(code), "%d", status);
+        n += hpack_put_int(out + n, 0x00, 4, 8);
+        n += hpack_put_string(out + n, code, 3);
+    }
+    
+    char *stop = head + head_len - 2;
+    char *eol = memmem(head, head_len, "\r\n", 2);
+    for (char *line = eol + 2; line < stop; line = eol + 2) {
+        eol = memmem(line, stop + 2 - line, "\r\n", 2);
+        char *colon = memchr(line, ':', eol - line);
+        if (!colon) continue;
+        for (char *p = line; p < colon; p++) *p = tolower((unsigned char)*p);
+        HttpSlice name = {line, colon - line};
+        HttpSlice value = slice_trim(colon + 1, eol);
+        // Connection-specific headers are forbidden in HTTP/2
+        if (slice_eq(name, "connection") || slice_eq(name, "keep-alive") || slice_eq(name, "upgrade") ||
+            slice_eq(name, "proxy-connection") || slice_eq(name, "transfer-encoding")) continue;
+        n += hpack_encode_header(out + n, name.ptr, name.len, value.ptr, value.len);
+    }
+    chunk->len = n;
+    return chunk;
+}
+
+// http_send on a stream view lands here: the head becomes a HEADERS block,
+// everything after it is queued as DATA
+bool http2_capture(Http2Stream *st, const void *buf, size_t len) {
+    const char *p = buf;
+    if (!st->head_done) {
+        if (!st->head) st->head = malloc(HTTP_BUFFER_SIZE);
+        size_t old = st->head_len;
+        size_t take = len < HTTP_BUFFER_SIZE - old ? len : HTTP_BUFFER_SIZE - old;
+        memcpy(st->head + old, p, take);
+        st->head_len += take;
+        size_t from = old > 3 ? old - 3 : 0;
+        char *term = memmem(st->head + from, st->head_len - from, "\r\n\r\n", 4);
+        if (!term) return st->head_len < HTTP_BUFFER_SIZE;
+        
+        size_t head_end = term + 4 - st->head;
+        http2_queue(st, http2_encode_head(st->head, head_end));
+        st->head_done = true;
+        p += head_end - old;
+        len -= head_end - old;
+    }
+    if (len == 0) return true;
+    H2Chunk *chunk = calloc(1, sizeof(H2Chunk));
+    chunk->fd = -1;
+    chunk->data = malloc(len);
+    memcpy(chunk->data, p, len);
+    chunk->len = len;
+    http2_queue(st, chunk);
+    return true;
+}
+
+// File bodies are queued by reference and only read when their frames go out
+bool http2_capture_file(Http2Stream *st, int fd, off_t offset, size_t len) {
+    if (!st->head_done) return false;
+    if (len == 0) return true;
+    H2Chunk *chunk = calloc(1, sizeof(H2Chunk));
+    chunk->fd = dup(fd);
+    if (chunk->fd < 0) {
+        free(chunk);
+        return false;
+    }
+    chunk->offset = offset;
+    chunk->len = len;
+    http2_queue(st, chunk);
+    return true;
+}
+
+ssize_t http2_body_recv(Http2Stream *st, void *buf, size_t len) {
+    size_t left = st->body_len - st->body_off;
+    size_t n = len < left ? len : left;
+    memcpy(buf, st->body + st->body_off, n);
+    st->body_off += n;
+    return n;
+}
+
+// Runs the handler as soon as the request is complete. Its output is only
+// queued here; the session loop interleaves it with the other streams.
+void http2_run_stream(Http2Session *s, Http2Stream *st) {
+    HttpConnection *v = st->view;
+    HttpRequest *req = &v->req;
+    st->request_done = true;
+    v->len = v->pos = req->head_len = st->arena_len;
+    req->content_length = st->body_len;
+    req->state = st->body_len > 0 ? HTTP_PARSE_BODY : HTTP_PARSE_DONE;
+    if (!st->error_status && (!req->method.len || !req->path.len)) st->error_status = 400;
+    
+    if (st->error_status) http_send_error(v, st->error_status);
+    else http_serve_pending(v);
+    
+    if (!st->head_done) {
+        http2_reset_stream(s, st->id, H2_INTERNAL_ERROR);
+        http2_free_stream(s, st);
+    }
+}
+
+bool http2_apply_settings(Http2Session *s, const uint8_t *p, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t key = (p[i] << 8) | p[i + 1];
+        uint32_t value = h2_get32(p + i + 2);
+        if (key == H2_SETTINGS_INITIAL_WINDOW_SIZE) {
+            if (value > HTTP2_MAX_WINDOW) return http2_goaway(s, H2_FLOW_CONTROL_ERROR);
+            int64_t delta = (int64_t)value - s->peer_initial_window;
+            for (Http2Stream *st = s->streams; st; st = st->next) st->send_window += delta;
+            s->peer_initial_window = value;
+        } else if (key == H2_SETTINGS_MAX_FRAME_SIZE) {
+            // We never send more than HTTP2_MAX_FRAME, which every peer must accept
+            if (value < HTTP2_MAX_FRAME || value > 0xffffff) return http2_goaway(s, H2_PROTOCOL_ERROR);
+        }
+    }
+    return true;
+}
+
+bool http2_strip_padding(uint8_t flags, uint8_t **p, size_t *len) {
+    if (!(flags & H2_FLAG_PADDED)) return true;
+    if (*len < 1 || (*p)[0] >= *len) return false;
+    *len -= 1 + (*p)[0];
+    (*p)++;
+    return true;
+}
+
+bool http2_append_block(Http2Session *s, const uint8_t *p, size_t len) {
+    if (s->block_len + len > HTTP2_MAX_HEADER_BLOCK) return http2_goaway(s, H2_PROTOCOL_ERROR);
+    if (s->block_len + len > s->block_cap) {
+        s->block_cap = s->block_len + len > 2 * s->block_cap ? s->block_len + len : 2 * s->block_cap;
+        s->block = realloc(s->block, s->block_cap);
+    }
+    memcpy(s->block + s->block_len, p, len);
+    s->block_len += len;
+    return true;
+}
+
+bool http2_end_headers(Http2Session *s) {
+    Http2Stream *st = s->block_target;
+    bool ok = hpack_decode_block(&s->decoder, s->block, s->block_len, s->block_trailers ? NULL : st);
+    s->block_stream = 0;
+    s->block_len = 0;
+    if (!ok) return http2_goaway(s, H2_COMPRESSION_ERROR);
+    if (st && s->block_end_stream) http2_run_stream(s, st);
+    return true;
+}
+
+bool http2_on_headers(Http2Session *s, uint8_t flags, uint32_t id, uint8_t *p, size_t len) {
+    if (id == 0 || !(id & 1) || !http2_strip_padding(flags, &p, &len)) {
+        return http2_goaway(s, H2_PROTOCOL_ERROR);
+    }
+    if (flags & H2_FLAG_PRIORITY) {
+        if (len < 5) return http2_goaway(s, H2_PROTOCOL_ERROR);
+        p += 5;
+        len -= 5;
+    }
+    
+    Http2Stream *st = http2_find_stream(s, id);
+    s->block_trailers = false;
+    if (st) {
+        // A second block on an open stream carries trailers, which must end it
+        if (st->request_done || !(flags & H2_FLAG_END_STREAM)) return http2_goaway(s, H2_PROTOCOL_ERROR);
+        s->block_trailers = true;
+    } else if (id > s->last_stream_id) {
+        s->last_stream_id = id;
+        if (s->goaway_sent || s->stream_count >= HTTP2_MAX_STREAMS) {
+            if (!http2_reset_stream(s, id, H2_REFUSED_STREAM)) return false;
+        } else {
+            st = http2_new_stream(s, id);
+        }
+    }
+    
+    s->block_stream = id;
+    s->block_target = st;
+    s->block_end_stream = flags & H2_FLAG_END_STREAM;
+    s->block_len = 0;
+    if (!http2_append_block(s, p, len)) return false;
+    return !(flags & H2_FLAG_END_HEADERS) || http2_end_headers(s);
+}
+
+bool http2_on_data(Http2Session *s, uint8_t flags, uint32_t id, uint8_t *p, size_t len) {
+    if (id == 0 || id > s->last_stream_id) return http2_goaway(s, H2_PROTOCOL_ERROR);
+    // Padding counts against flow control too
+    size_t flow = len;
+    if (!http2_strip_padding(flags, &p, &len)) return http2_goaway(s, H2_PROTOCOL_ERROR);
+    
+    // Windows are handed straight back; HTTP2_MAX_BODY is what bounds a stream
+    if (flow > 0 && !http2_window_update(s, 0, flow)) return false;
+    Http2Stream *st = http2_find_stream(s, id);
+    if (!st) return true;
+    if (st->request_done) {
+        bool ok = http2_reset_stream(s, id, H2_STREAM_CLOSED);
+        http2_free_stream(s, st);
+        return ok;
+    }
+    if (!(flags & H2_FLAG_END_STREAM) && flow > 0 && !http2_window_update(s, id, flow)) return false;
+    
+    if (st->body_len + len > HTTP2_MAX_BODY) {
+        st->error_status = 413;
+    } else if (!st->error_status && len > 0) {
+        if (st->body_len + len > st->body_cap) {
+            st->body_cap = st->body_len + len > 2 * st->body_cap ? st->body_len + len : 2 * st->body_cap;
+            st->body = realloc(st->body, st->body_cap);
+        }
+        memcpy(st->body + st->body_len, p, len);
+        st->body_len += len;
+    }
+    if (flags & H2_FLAG_END_STREAM) http2_run_stream(s, st);
+    return true;
+}
+
+bool http2_on_window_update(Http2Session *s, uint32_t id, uint8_t *p, size_t len) {
+    if (len != 4) return http2_goaway(s, H2_FRAME_SIZE_ERROR);
+    uint32_t increment = h2_get32(p) & 0x7fffffff;
+    if (id == 0) {
+        if (increment == 0) return http2_goaway(s, H2_PROTOCOL_ERROR);
+        s->send_window += increment;
+        if (s->send_window > HTTP2_MAX_WINDOW) return http2_goaway(s, H2_FLOW_CONTROL_ERROR);
+        return true;
+    }
+    Http2Stream *st = http2_find_stream(s, id);
+    if (!st) return true;
+    st->send_window += increment;
+    if (increment == 0 || st->send_window > HTTP2_MAX_WINDOW) {
+        bool ok = http2_reset_stream(s, id, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+        http2_free_stream(s, st);
+        return ok;
+    }
+    return true;
+}
+
+// Returns false once the connection is done for, with GOAWAY already sent
+bool http2_on_frame(Http2Session *s, uint8_t type, uint8_t flags, uint32_t id, uint8_t *p, size_t len) {
+    if (s->block_stream && type != H2_CONTINUATION) return http2_goaway(s, H2_PROTOCOL_ERROR);
+    
+    switch (type) {
+        case H2_DATA:
+            return http2_on_data(s, flags, id, p, len);
+        case H2_HEADERS:
+            return http2_on_headers(s, flags, id, p, len);
+        case H2_CONTINUATION:
+            if (!s->block_stream || id != s->block_stream) return http2_goaway(s, H2_PROTOCOL_ERROR);
+            if (!http2_append_block(s, p, len)) return false;
+            return !(flags & H2_FLAG_END_HEADERS) || http2_end_headers(s);
+        case H2_PRIORITY:
+            return len == 5 || http2_goaway(s, H2_FRAME_SIZE_ERROR);
+        case H2_RST_STREAM: {
+            if (len != 4) return http2_goaway(s, H2_FRAME_SIZE_ERROR);
+            if (id == 0) return http2_goaway(s, H2_PROTOCOL_ERROR);
+            Http2Stream *st = http2_find_stream(s, id);
+            if (st) http2_free_stream(s, st);
+            return true;
+        }
+        case H2_SETTINGS:
+            if (id != 0) return http2_goaway(s, H2_PROTOCOL_ERROR);
+            if (flags & H2_FLAG_ACK) return len == 0 || http2_goaway(s, H2_FRAME_SIZE_ERROR);
+            if (len % 6) return http2_goaway(s, H2_FRAME_SIZE_ERROR);
+            return http2_apply_settings(s, p, len) && http2_write_frame(s, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+        case H2_PING:
+            if (len != 8) return http2_goaway(s, H2_FRAME_SIZE_ERROR);
+            if (id != 0) return http2_goaway(s, H2_PROTOCOL_ERROR);
+            return (flags & H2_FLAG_ACK) || http2_write_frame(s, H2_PING, H2_FLAG_ACK, 0, p, 8);
+        case H2_GOAWAY:
+            if (id != 0) return http2_goaway(s, H2_PROTOCOL_ERROR);
+            s->goaway_received = true;
+            return true;
+        case H2_WINDOW_UPDATE:
+            return http2_on_window_update(s, id, p, len);
+        case H2_PUSH_PROMISE:
+            return http2_goaway(s, H2_PROTOCOL_ERROR);
+        default:
+            // Unknown frame types must be ignored
+            return true;
+    }
+}
+
+// Handles every complete frame in the receive buffer
+bool http2_process(Http2Session *s) {
+    size_t off = 0;
+    while (s->rx_len - off >= HTTP2_FRAME_HEADER) {
+        uint8_t *f = s->rx + off;
+        size_t len = ((size_t)f[0] << 16) | ((size_t)f[1] << 8) | f[2];
+        if (len > HTTP2_MAX_FRAME) return http2_goaway(s, H2_FRAME_SIZE_ERROR);
+        if (s->rx_len - off < HTTP2_FRAME_HEADER + len) break;
+        if (!http2_on_frame(s, f[3], f[4], h2_get32(f + 5) & 0x7fffffff, f + HTTP2_FRAME_HEADER, len)) {
+            return false;
+        }
+        off += HTTP2_FRAME_HEADER + len;
+    }
+    memmove(s->rx, s->rx + off, s->rx_len - off);
+    s->rx_len -= off;
+    return true;
+}
+
+// Reads what has arrived; without block it returns at once when nothing has
+bool http2_receive(Http2Session *s, bool block) {
+    HttpConnection *c = s->c;
+    if (!block && !(c->ssl && SSL_pending(c->ssl) > 0)) {
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) <= 0) return true;
+    }
+    ssize_t n = http_conn_recv(c, s->rx + s->rx_len, s->rx_cap - s->rx_len);
+    if (n < 0) return false;
+    if (n == 0) {
+        s->peer_closed = true;
+        return true;
+    }
+    s->rx_len += n;
+    return http2_process(s);
+}
+
+bool http2_sendable(Http2Session *s, Http2Stream *st) {
+    H2Chunk *chunk = st->out;
+    return chunk && (chunk->headers || (s->send_window > 0 && st->send_window > 0));
+}
+
+// Round-robin over streams with something to send, one frame per turn
+Http2Stream *http2_next_stream(Http2Session *s) {
+    Http2Stream *next = NULL, *first = NULL;
+    for (Http2Stream *st = s->streams; st; st = st->next) {
+        if (!http2_sendable(s, st)) continue;
+        if (st->id > s->last_sent_id && (!next || st->id < next->id)) next = st;
+        if (!first || st->id < first->id) first = st;
+    }
+    return next ? next : first;
+}
+
+bool http2_send_next(Http2Session *s, Http2Stream *st) {
+    H2Chunk *chunk = st->out;
+    bool last = !chunk->next;
+    s->last_sent_id = st->id;
+    
+    if (chunk->headers) {
+        size_t off = 0;
+        uint8_t type = H2_HEADERS;
+        do {
+            size_t n = chunk->len - off < HTTP2_MAX_FRAME ? chunk->len - off : HTTP2_MAX_FRAME;
+            uint8_t flags = off + n == chunk->len ? H2_FLAG_END_HEADERS : 0;
+            if (type == H2_HEADERS && last) flags |= H2_FLAG_END_STREAM;
+            if (!http2_write_frame(s, type, flags, st->id, chunk->data + off, n)) return false;
+            off += n;
+            type = H2_CONTINUATION;
+        } while (off < chunk->len);
+        chunk->len = 0;
+    } else {
+        size_t n = chunk->len < HTTP2_MAX_FRAME ? chunk->len : HTTP2_MAX_FRAME;
+        if ((int64_t)n > s->send_window) n = s->send_window;
+        if ((int64_t)n > st->send_window) n = st->send_window;
+        uint8_t flags = last && n == chunk->len ? H2_FLAG_END_STREAM : 0;
+        bool ok = chunk->fd >= 0 ?
+                  http2_write_file_frame(s, flags, st->id, chunk->fd, chunk->offset, n) :
+                  http2_write_frame(s, H2_DATA, flags, st->id, chunk->data + chunk->offset, n);
+        if (!ok) return false;
+        chunk->offset += n;
+        chunk->len -= n;
+        s->send_window -= n;
+        st->send_window -= n;
+        st->view->bytes_sent += n;
+    }
+    if (chunk->len > 0) return true;
+    
+    st->out = chunk->next;
+    if (!st->out) st->out_tail = NULL;
+    if (chunk->fd >= 0) close(chunk->fd);
+    free(chunk->data);
+    free(chunk);
+    if (!st->out) {
+        http_record_request(st->view);
+        http2_free_stream(s, st);
+    }
+    return true;
+}
+
+// HTTP2-Settings carries a SETTINGS payload in unpadded base64url
+bool http2_upgrade_settings(Http2Session *s, HttpSlice value) {
+    char b64[256];
+    uint8_t raw[192];
+    if (value.len > 180) return http2_goaway(s, H2_PROTOCOL_ERROR);
+    size_t n = 0;
+    for (size_t i = 0; i < value.len; i++) {
+        char ch = value.ptr[i];
+        b64[n++] = ch == '-' ? '+' : ch == '_' ? '/' : ch;
+    }
+    int pad = 0;
+    while (n % 4) {
+        b64[n++] = '=';
+        pad++;
+    }
+    int len = EVP_DecodeBlock(raw, (const unsigned char*)b64, n);
+    if (len < 0 || (len - pad) % 6) return http2_goaway(s, H2_PROTOCOL_ERROR);
+    return http2_apply_settings(s, raw, len - pad);
+}
+
+void http_slice_rebase(HttpSlice *s, const char *from, const char *to) {
+    if (s->ptr >= from && s->ptr < from + HTTP_BUFFER_SIZE) s->ptr = to + (s->ptr - from);
+}
+
+// Stream 1 of an upgraded connection is the HTTP/1.1 request that asked for it
+void http2_upgrade_stream(Http2Session *s) {
+    HttpConnection *c = s->c;
+    Http2Stream *st = http2_new_stream(s, 1);
+    s->last_stream_id = 1;
+    HttpConnection *v = st->view;
+    HttpRequest *req = &v->req;
+    memcpy(v->buf, c->buf, c->req.head_len);
+    *req = c->req;
+    http_slice_rebase(&req->method, c->buf, v->buf);
+    http_slice_rebase(&req->target, c->buf, v->buf);
+    http_slice_rebase(&req->path, c->buf, v->buf);
+    http_slice_rebase(&req->query, c->buf, v->buf);
+    http_slice_rebase(&req->version, c->buf, v->buf);
+    for (int i = 0; i < req->header_count; i++) {
+        http_slice_rebase(&req->header_names[i], c->buf, v->buf);
+        http_slice_rebase(&req->header_values[i], c->buf, v->buf);
+    }
+    v->accepted_ns = c->accepted_ns;
+    st->arena_len = c->req.head_len;
+    http2_run_stream(s, st);
+}
+
+bool http2_wants_upgrade(HttpConnection *c) {
+    char upgrade[64];
+    return !c->ssl && c->req.state == HTTP_PARSE_DONE &&
+           http_find_header(&c->req, "Upgrade", upgrade, sizeof(upgrade)) && strcasestr(upgrade, "h2c") &&
+           http_header(&c->req, "HTTP2-Settings").ptr;
+}
+
+// The preface fails the HTTP/1 parse on its version, leaving its start buffered
+bool http2_has_preface(HttpConnection *c) {
+    return c->len >= 18 && memcmp(c->buf, HTTP2_PREFACE, c->len < HTTP2_PREFACE_LEN ? c->len : HTTP2_PREFACE_LEN) == 0;
+}
+
+// Runs an HTTP/2 connection until either side ends it. The client preface
+// starts at c->buf + start; upgrade answers the HTTP/1.1 request first.
+void http2_serve(HttpConnection *c, size_t start, bool upgrade) {
+    static const char switching[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n\r\n";
+    if (upgrade && !http_write_raw(c, switching, sizeof(switching) - 1)) return;
+    
+    while (c->len - start < HTTP2_PREFACE_LEN) {
+        ssize_t n = http_conn_recv(c, c->buf + c->len, sizeof(c->buf) - c->len);
+        if (n <= 0) return;
+        c->len += n;
+    }
+    if (memcmp(c->buf + start, HTTP2_PREFACE, HTTP2_PREFACE_LEN) != 0) return;
+    
+    Http2Session *s = calloc(1, sizeof(Http2Session));
+    s->c = c;
+    s->decoder.max_size = HPACK_TABLE_SIZE;
+    s->send_window = HTTP2_DEFAULT_WINDOW;
+    s->peer_initial_window = HTTP2_DEFAULT_WINDOW;
+    s->rx_cap = 2 * (HTTP2_FRAME_HEADER + HTTP2_MAX_FRAME);
+    s->rx = malloc(s->rx_cap);
+    s->rx_len = c->len - start - HTTP2_PREFACE_LEN;
+    memcpy(s->rx, c->buf + start + HTTP2_PREFACE_LEN, s->rx_len);
+    
+    uint8_t settings[6];
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    h2_put32(settings + 2, HTTP2_MAX_STREAMS);
+    bool ok = http2_write_frame(s, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+    if (ok && upgrade) {
+        ok = http2_upgrade_settings(s, http_header(&c->req, "HTTP2-Settings"));
+        if (ok) http2_upgrade_stream(s);
+    }
+    ok = ok && http2_process(s);
+    
+    while (ok && (!s->goaway_received || s->streams)) {
+        bool idle = !http2_next_stream(s);
+        if (idle && s->peer_closed) break;
+        if (!s->peer_closed && !http2_receive(s, idle)) break;
+        Http2Stream *st = http2_next_stream(s);
+        if (st && !http2_send_next(s, st)) break;
+    }
+    if (!s->goaway_sent) http2_goaway(s, H2_NO_ERROR);
+    
+    while (s->streams) http2_free_stream(s, s->streams);
+    hpack_table_evict(&s->decoder, 0);
+    free(s->block);
+    free(s->rx);
+    free(s);
+}
+
+void http_handle_client(HttpConnection *c) {
+    if (!http_read_request(c)) {
+        if (http2_has_preface(c)) http2_serve(c, 0, false);
+        else if (c->req.error_status) http_send_error(c, c->req.error_status);
+        return;
+    }
+    if (http2_wants_upgrade(c)) {
+        http2_serve(c, c->pos, true);
+        return;
+    }
+    http_serve_pending(c);
+}
+
+void http_conn_reset(HttpConnection *c, int fd, uint64_t accepted_ns) {
+    memset(&c->req, 0, sizeof(c->req));
+    c->fd = fd;
+    c->len = c->pos = 0;
+    c->accepted_ns = accepted_ns;
+    c->first_byte_ns = 0;
+    c->bytes_sent = 0;
+    c->status = 0;
+    c->ssl = NULL;
+    c->h2 = NULL;
+    c->detached = false;
+    METRIC_INC(worker_metrics->connections_accepted, 1);
+}
+
+bool http_tls_accept(HttpConnection *c) {
+    c->ssl = SSL_new(http_tls_ctx);
+    if (!c->ssl) return false;
+    SSL_set_fd(c->ssl, c->fd);
+    if (SSL_accept(c->ssl) != 1) {
+        METRIC_INC(worker_metrics->tls_failures, 1);
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+        ERR_clear_error();
+        return false;
+    }
+    METRIC_INC(worker_metrics->tls_handshakes, 1);
+    if (SSL_session_reused(c->ssl)) METRIC_INC(worker_metrics->tls_resumed, 1);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl))) METRIC_INC(worker_metrics->tls_ktls, 1);
+#endif
+    return true;
+}
+
+void http_tls_close(HttpConnection *c) {
+    if (!c->ssl) return;
+    SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+    c->ssl = NULL;
+    ERR_clear_error();
+}
+
+#ifdef HAVE_IO_URING
+// Completion-driven backend: each worker owns a ring with a multishot accept,
+// reads request heads into registered buffers and serves plain static GETs
+// through a linked openat+statx lookup followed by send and splice chains.
+// Everything else (routes, compression, ranges, errors) is handed to the
+// blocking handoff pool so the ring never waits on a script or an encoder.
+#define URING_ENTRIES 256
+#define URING_SLOTS 64
+#define URING_PIPE_SIZE (1024 * 1024)
+#define URING_DATA(slot, tag) (((uint64_t)(slot) << 8) | (tag))
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    void *sq_map, *cq_map;
+    size_t sq_map_len, cq_map_len, sqes_len;
+} Uring;
+
+typedef enum {
+    URING_ACCEPT, URING_READ, URING_TIMEOUT, URING_OPEN, URING_STATX,
+    URING_SEND, URING_SPLICE_IN, URING_SPLICE_OUT, URING_CLOSE
+} UringTag;
+
+typedef enum {
+    URING_SLOT_FREE, URING_SLOT_ACTIVE, URING_SLOT_CLOSING
+} UringSlotState;
+
+typedef struct {
+    HttpConnection conn;
+    UringSlotState state;
+    int inflight;
+    bool failed;
+    bool done;
+    bool file_open;
+    bool has_body;
+    bool handed_off;
+    int lookups;
+    int stat_res;
+    struct statx stx;
+    char path[2048];
+    char header[1024];
+    size_t header_len;
+    off_t file_off;
+    off_t file_size;
+    size_t in_pipe;
+    int pipe[2];
+    size_t pipe_size;
+} UringSlot;
+
+typedef struct {
+    Uring ring;
+    UringSlot *slots;
+    int free_list[URING_SLOTS];
+    int free_count;
+    int active;
+    bool fixed_buffers;
+    bool multishot;
+    bool accept_armed;
+} UringServer;
+
+static const struct __kernel_timespec uring_io_timeout = { .tv_sec = HTTP_IO_TIMEOUT };
+
+void uring_free(Uring *r) {
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->cq_map && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_len);
+    if (r->sq_map && r->sq_map != MAP_FAILED) munmap(r->sq_map, r->sq_map_len);
+    if (r->fd >= 0) close(r->fd);
+}
+
+int uring_setup(Uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+    // Linked file assignment arrived after direct descriptors, so it vouches for both
+    if (!(p.features & IORING_FEAT_LINKED_FILE)) {
+        uring_free(r);
+        return -1;
+    }
+    
+    r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && r->cq_map_len > r->sq_map_len) r->sq_map_len = r->cq_map_len;
+    
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    r->cq_map = single ? r->sq_map : mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+        uring_free(r);
+        return -1;
+    }
+    
+    char *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    return 0;
+}
+
+int uring_register(Uring *r, unsigned op, void *arg, unsigned count) {
+    return syscall(__NR_io_uring_register, r->fd, op, arg, count);
+}
+
+bool uring_probe(Uring *r, const int *ops, int count) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    bool ok = uring_register(r, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int i = 0; ok && i < count; i++) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+// Publishes queued SQEs and optionally waits for completions in the same syscall
+int uring_submit(Uring *r, unsigned wait) {
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    while (1) {
+        unsigned pending = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        int ret = syscall(__NR_io_uring_enter, r->fd, pending, wait,
+                          wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0 && errno == EINTR) continue;
+        return ret;
+    }
+}
+
+// Makes room for a whole chain so a link is never split across submissions
+void uring_reserve(Uring *r, unsigned count) {
+    while (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) + count > r->sq_entries) {
+        if (uring_submit(r, 0) <= 0) break;
+    }
+}
+
+struct io_uring_sqe *uring_sqe(Uring *r, uint8_t opcode, uint64_t user_data) {
+    unsigned idx = r->sqe_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    return sqe;
+}
+
+struct io_uring_sqe *uring_slot_sqe(UringServer *s, int i, uint8_t opcode, UringTag tag) {
+    s->slots[i].inflight++;
+    return uring_sqe(&s->ring, opcode, URING_DATA(i, tag));
+}
+
+void uring_arm_accept(UringServer *s) {
+    struct io_uring_sqe *sqe = uring_sqe(&s->ring, IORING_OP_ACCEPT, URING_DATA(0, URING_ACCEPT));
+    sqe->fd = http_server.listen_fd;
+    if (s->multishot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    s->accept_armed = true;
+}
+
+void uring_read(UringServer *s, int i) {
+    HttpConnection *c = &s->slots[i].conn;
+    uring_reserve(&s->ring, 2);
+    struct io_uring_sqe *sqe = uring_slot_sqe(s, i,
+        s->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ, URING_READ);
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)(c->buf + c->len);
+    sqe->len = HTTP_MAX_HEAD - c->len;
+    sqe->buf_index = i;
+    sqe->flags = IOSQE_IO_LINK;
+    // A client that stalls mid-head gives its slot back instead of holding it
+    sqe = uring_slot_sqe(s, i, IORING_OP_LINK_TIMEOUT, URING_TIMEOUT);
+    sqe->addr = (uintptr_t)&uring_io_timeout;
+    sqe->len = 1;
+}
+
+// Queues the next file -> pipe -> socket hop. When the pipe still holds bytes
+// from a short socket write only the second half is needed.
+void uring_splice_chunk(UringServer *s, int i) {
+    UringSlot *slot = &s->slots[i];
+    size_t out_len = slot->in_pipe;
+    struct io_uring_sqe *sqe;
+    
+    if (out_len == 0) {
+        off_t left = slot->file_size - slot->file_off;
+        out_len = (size_t)left < slot->pipe_size ? (size_t)left : slot->pipe_size;
+        sqe = uring_slot_sqe(s, i, IORING_OP_SPLICE, URING_SPLICE_IN);
+        sqe->fd = slot->pipe[1];
+        sqe->off = (uint64_t)-1;
+        sqe->splice_fd_in = i;
+        sqe->splice_off_in = slot->file_off;
+        sqe->splice_flags = SPLICE_F_FD_IN_FIXED;
+        sqe->len = out_len;
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    sqe = uring_slot_sqe(s, i, IORING_OP_SPLICE, URING_SPLICE_OUT);
+    sqe->fd = slot->conn.fd;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = slot->pipe[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->len = out_len;
+}
+
+bool uring_slot_pipe(UringSlot *slot) {
+    if (slot->pipe[0] >= 0) return true;
+    if (pipe2(slot->pipe, O_CLOEXEC) < 0) {
+        slot->pipe[0] = slot->pipe[1] = -1;
+        return false;
+    }
+    fcntl(slot->pipe[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+    int size = fcntl(slot->pipe[1], F_GETPIPE_SZ);
+    slot->pipe_size = size > 0 ? size : 65536;
+    return true;
+}
+
+// Runs once both halves of the openat+statx lookup have completed
+void uring_respond(UringServer *s, int i) {
+    UringSlot *slot = &s->slots[i];
+    HttpConnection *c = &slot->conn;
+    
+    if (!slot->file_open || slot->stat_res < 0 || !S_ISREG(slot->stx.stx_mode)) {
+        slot->header_len = snprintf(slot->header, sizeof(slot->header),
+            "HTTP/1.1 404 Not Found\r\n"
+            "Content-Type: text/html\r\n\r\n"
+            "<html><body><h1>404 Not Found</h1></body></html>");
+    } else {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_size = slot->stx.stx_size;
+        st.st_mtim.tv_sec = slot->stx.stx_mtime.tv_sec;
+        st.st_mtim.tv_nsec = slot->stx.stx_mtime.tv_nsec;
+        
+        char etag[64], validators[256];
+        http_file_validators(&st, false, is_compressible_path(slot->path),
+                             etag, sizeof(etag), validators, sizeof(validators));
+        if (http_not_modified(&c->req, etag, st.st_mtime)) {
+            slot->header_len = snprintf(slot->header, sizeof(slot->header),
+                "HTTP/1.1 304 Not Modified\r\n%sConnection: close\r\n\r\n", validators);
+        } else {
+            slot->header_len = snprintf(slot->header, sizeof(slot->header),
+                "HTTP/1.1 200 OK\r\n"
+                "Content-Type: %s\r\n"
+                "Content-Length: %ld\r\n"
+                "%s"
+                "Access-Control-Allow-Origin: *\r\n"
+                "Connection: close\r\n\r\n", get_mime_type(slot->path),
+                (long)st.st_size, validators);
+            slot->has_body = !slice_eq(c->req.method, "HEAD") && st.st_size > 0;
+            slot->file_off = 0;
+            slot->file_size = st.st_size;
+        }
+    }
+    
+    if (slot->has_body && !uring_slot_pipe(slot)) {
+        http_send_error(c, 503);
+        slot->done = true;
+        return;
+    }
+    
+    c->first_byte_ns = monotonic_ns();
+    c->status = atoi(slot->header + 9);
+    uring_reserve(&s->ring, 3);
+    struct io_uring_sqe *sqe = uring_slot_sqe(s, i, IORING_OP_SEND, URING_SEND);
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)slot->header;
+    sqe->len = slot->header_len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (slot->has_body ? MSG_MORE : 0);
+    if (slot->has_body) {
+        sqe->flags = IOSQE_IO_LINK;
+        uring_splice_chunk(s, i);
+    }
+}
+
+// Passes the connection to the handoff pool, which re-parses what is buffered.
+// The slot frees up at once; the pool closes, records and releases it.
+void uring_handoff(UringServer *s, int i) {
+    UringSlot *slot = &s->slots[i];
+    HttpConnection *conn = malloc(sizeof(HttpConnection));
+    if (!conn) {
+        http_send_error(&slot->conn, 503);
+        slot->done = true;
+        return;
+    }
+    *conn = slot->conn;
+    http_queue_push(&http_handoff, (HttpQueued){conn->fd, conn->accepted_ns, conn});
+    slot->handed_off = slot->done = true;
+}
+
+// Decides whether the parsed request can stay on the ring
+void uring_dispatch(UringServer *s, int i) {
+    UringSlot *slot = &s->slots[i];
+    HttpConnection *c = &slot->conn;
+    HttpRequest *req = &c->req;
+    char method[16], path[1024], range[8];
+    slice_copy(req->method, method, sizeof(method));
+    
+    bool plain = (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) &&
+                 req->path.len < sizeof(path) - 16 &&
+                 http_decode_path(req->path, path, sizeof(path)) &&
+                 !(http_server.metrics && strcmp(path, "/__zenith/metrics") == 0) &&
+                 !http_find_route(method, path) &&
+                 !http_find_header(req, "Range", range, sizeof(range)) &&
+                 !http_header(req, "Upgrade").ptr;
+    if (plain) {
+        snprintf(slot->path, sizeof(slot->path), "%s%s", http_server.root_dir,
+                 strcmp(path, "/") == 0 ? "/index.html" : path);
+        plain = !(is_compressible_path(slot->path) && http_accepts_gzip(req));
+    }
+    
+    if (!plain) {
+        uring_handoff(s, i);
+        return;
+    }
+    
+    // The file lands straight in the slot's direct descriptor; statx only runs if it opened
+    slot->lookups = 2;
+    uring_reserve(&s->ring, 2);
+    struct io_uring_sqe *sqe = uring_slot_sqe(s, i, IORING_OP_OPENAT, URING_OPEN);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)slot->path;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = i + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = uring_slot_sqe(s, i, IORING_OP_STATX, URING_STATX);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)slot->path;
+    sqe->len = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+    sqe->off = (uintptr_t)&slot->stx;
+}
+
+void uring_on_accept(UringServer *s, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE)) s->accept_armed = false;
+    if (res < 0) {
+        // Kernels without multishot accept reject the flag outright
+        if (res == -EINVAL && s->multishot && http_server.running) s->multishot = false;
+        return;
+    }
+    if (s->free_count == 0) {
+        http_shed(res, SHED_MAX_CONNS, 1);
+        close(res);
+        return;
+    }
+    if (!http_admit(res, NULL)) return;
+    
+    int i = s->free_list[--s->free_count];
+    UringSlot *slot = &s->slots[i];
+    http_conn_reset(&slot->conn, res, monotonic_ns());
+    slot->state = URING_SLOT_ACTIVE;
+    slot->failed = slot->done = slot->file_open = slot->has_body = slot->handed_off = false;
+    slot->in_pipe = 0;
+    s->active++;
+    uring_read(s, i);
+}
+
+void uring_complete(UringServer *s, uint64_t data, int res, unsigned flags) {
+    UringTag tag = data & 0xff;
+    if (tag == URING_ACCEPT) {
+        uring_on_accept(s, res, flags);
+        return;
+    }
+    
+    int i = data >> 8;
+    UringSlot *slot = &s->slots[i];
+    HttpConnection *c = &slot->conn;
+    slot->inflight--;
+    
+    switch (tag) {
+        case URING_READ: {
+            if (res <= 0) {
+                slot->failed = true;
+                break;
+            }
+            c->len += res;
+            int r = http_parse_head(&c->req, c->buf, c->len);
+            if (r == 0) {
+                uring_read(s, i);
+            } else if (r < 0) {
+                // Parse failures include the HTTP/2 preface, which the blocking handler takes over
+                memset(&c->req, 0, sizeof(c->req));
+                uring_handoff(s, i);
+            } else {
+                c->pos = c->req.head_len;
+                uring_dispatch(s, i);
+            }
+            break;
+        }
+        case URING_OPEN:
+            if (res >= 0) slot->file_open = true;
+            if (--slot->lookups == 0) uring_respond(s, i);
+            break;
+        case URING_STATX:
+            slot->stat_res = res;
+            if (--slot->lookups == 0) uring_respond(s, i);
+            break;
+        case URING_SEND:
+            if (res < (int)slot->header_len) {
+                slot->failed = true;
+                break;
+            }
+            c->bytes_sent += res;
+            if (!slot->has_body) slot->done = true;
+            break;
+        case URING_SPLICE_IN:
+            if (res <= 0) {
+                slot->failed = true;
+                break;
+            }
+            slot->in_pipe += res;
+            slot->file_off += res;
+            break;
+        case URING_SPLICE_OUT:
+            // A short file read breaks the link without anything being wrong
+            if (res == -ECANCELED && !slot->failed && slot->in_pipe > 0) res = 0;
+            else if (res <= 0) {
+                slot->failed = true;
+                break;
+            }
+            slot->in_pipe -= res;
+            c->bytes_sent += res;
+            if (slot->in_pipe == 0 && slot->file_off >= slot->file_size) {
+                slot->done = true;
+            } else {
+                uring_reserve(&s->ring, 2);
+                uring_splice_chunk(s, i);
+            }
+            break;
+        default:
+            break;
+    }
+    
+    if (slot->inflight > 0) return;
+    if (slot->state == URING_SLOT_ACTIVE && (slot->failed || slot->done)) {
+        slot->state = URING_SLOT_CLOSING;
+        struct io_uring_sqe *sqe;
+        if (slot->file_open) {
+            sqe = uring_slot_sqe(s, i, IORING_OP_CLOSE, URING_CLOSE);
+            sqe->file_index = i + 1;
+        }
+        // After a WebSocket upgrade the socket belongs to the hub, after a handoff to the pool
+        if (!c->detached && !slot->handed_off) {
+            sqe = uring_slot_sqe(s, i, IORING_OP_CLOSE, URING_CLOSE);
+            sqe->fd = c->fd;
+        }
+        if (slot->inflight > 0) return;
+    }
+    if (slot->state == URING_SLOT_CLOSING) {
+        if (!slot->handed_off) {
+            http_record_metrics(c);
+            http_admission_release();
+        }
+        slot->state = URING_SLOT_FREE;
+        s->free_list[s->free_count++] = i;
+        s->active--;
+    }
+}
+
+const int uring_required_ops[] = {
+    IORING_OP_ACCEPT, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_LINK_TIMEOUT,
+    IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_SEND, IORING_OP_SPLICE, IORING_OP_CLOSE
+};
+#define URING_REQUIRED_OPS (int)(sizeof(uring_required_ops) / sizeof(uring_required_ops[0]))
+
+// Run once before any worker commits to the ring
+bool http_uring_supported(void) {
+    Uring r;
+    if (uring_setup(&r, 4) < 0) return false;
+    bool ok = uring_probe(&r, uring_required_ops, URING_REQUIRED_OPS);
+    uring_free(&r);
+    return ok;
+}
+
+bool uring_server_init(UringServer *s) {
+    if (uring_setup(&s->ring, URING_ENTRIES) < 0) return false;
+    
+    int files[URING_SLOTS];
+    for (int i = 0; i < URING_SLOTS; i++) files[i] = -1;
+    // A sparse table: openat installs into it directly and splice reads from it
+    if (!uring_probe(&s->ring, uring_required_ops, URING_REQUIRED_OPS) ||
+        uring_register(&s->ring, IORING_REGISTER_FILES, files, URING_SLOTS) < 0) {
+        uring_free(&s->ring);
+        return false;
+    }
+    
+    s->slots = calloc(URING_SLOTS, sizeof(UringSlot));
+    struct iovec iov[URING_SLOTS];
+    for (int i = 0; i < URING_SLOTS; i++) {
+        s->slots[i].pipe[0] = s->slots[i].pipe[1] = -1;
+        s->free_list[i] = URING_SLOTS - 1 - i;
+        iov[i].iov_base = s->slots[i].conn.buf;
+        iov[i].iov_len = sizeof(s->slots[i].conn.buf);
+    }
+    s->free_count = URING_SLOTS;
+    // Pinning can exceed RLIMIT_MEMLOCK; plain reads work the same, just with a copy
+    s->fixed_buffers = uring_register(&s->ring, IORING_REGISTER_BUFFERS, iov, URING_SLOTS) == 0;
+    s->multishot = true;
+    return true;
+}
+
+bool uring_fallback_reported = false;
+
+// Returns false without accepting anything when the kernel can't run the ring
+bool http_uring_worker(void) {
+    UringServer *s = calloc(1, sizeof(UringServer));
+    if (!uring_server_init(s)) {
+        free(s);
+        if (!__atomic_exchange_n(&uring_fallback_reported, true, __ATOMIC_RELAXED)) {
+            printf("⚠️  io_uring is unavailable here, falling back to worker threads\n");
+            fflush(stdout);
+        }
+        return false;
+    }
+    
+    while (http_server.running || s->active > 0) {
+        if (http_server.running && !s->accept_armed) uring_arm_accept(s);
+        if (uring_submit(&s->ring, 1) < 0) break;
+        
+        unsigned head = *s->ring.cq_head;
+        while (head != __atomic_load_n(s->ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &s->ring.cqes[head & *s->ring.cq_mask];
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            __atomic_store_n(s->ring.cq_head, ++head, __ATOMIC_RELEASE);
+            uring_complete(s, data, res, flags);
+        }
+    }
+    
+    uring_free(&s->ring);
+    for (int i = 0; i < URING_SLOTS; i++) {
+        if (s->slots[i].pipe[0] >= 0) {
+            close(s->slots[i].pipe[0]);
+            close(s->slots[i].pipe[1]);
+        }
+    }
+    free(s->slots);
+    free(s);
+    return true;
+}
+#endif
+
+// Hands a blocking worker its next admitted connection: from the acceptor's
+// queue, or straight from the listening socket when no acceptor runs
+bool http_next_connection(HttpQueued *next) {
+    if (http_queue.enabled) return http_queue_pop(&http_queue, next);
+    while (http_server.running) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        int fd = accept(http_server.listen_fd, (struct sockaddr*)&peer, &len);
+        if (fd < 0) {
+            if (errno == EINVAL || errno == EBADF) return false;
+            continue;
+        }
+        if (!http_admit(fd, &peer)) continue;
+        *next = (HttpQueued){fd, monotonic_ns(), NULL};
+        return true;
+    }
+    return false;
+}
+
+// Accepts as fast as the kernel hands connections over, so overload is
+// answered with a quick refusal instead of piling up in the backlog
+void http_accept_loop(int server_fd) {
+    while (http_server.running) {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        int fd = accept4(server_fd, (struct sockaddr*)&peer, &len, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINVAL || errno == EBADF) break;
+            continue;
+        }
+        uint64_t now = monotonic_ns();
+        if (http_admit(fd, &peer)) http_queue_push(&http_queue, (HttpQueued){fd, now, NULL});
+    }
+    http_queue_close(&http_queue);
+}
+
+// Each worker owns an interpreter context and serves admitted connections
+void *http_worker_thread(void *arg) {
+    worker_metrics = &http_metrics[(intptr_t)arg];
+    interpreter_context_init();
+#ifdef HAVE_IO_URING
+    if (http_server.io_uring && http_uring_worker()) {
+        interpreter_context_free();
+        return NULL;
+    }
+#endif
+    HttpConnection *conn = malloc(sizeof(HttpConnection));
+    struct timeval timeout = { .tv_sec = HTTP_IO_TIMEOUT };
+    uint64_t queue_timeout = http_server.queue_timeout_ms > 0 ?
+                             (uint64_t)http_server.queue_timeout_ms * 1000000 : 0;
+    HttpQueued next;
+    
+    while (http_next_connection(&next)) {
+        // By now the client has probably given up; a fast refusal beats serving it late
+        if (queue_timeout && monotonic_ns() - next.accepted_ns > queue_timeout) {
+            http_shed(next.fd, SHED_QUEUE_TIMEOUT, 1);
+            close(next.fd);
+            http_admission_release();
+            continue;
+        }
+        http_conn_reset(conn, next.fd, next.accepted_ns);
+        // Slow or stalled clients must not pin a worker forever
+        setsockopt(next.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(next.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (!http_tls_ctx || http_tls_accept(conn)) {
+            http_handle_client(conn);
+            http_tls_close(conn);
+        }
+        // WebSocket connections live on in the hub
+        if (!conn->detached) close(next.fd);
+        http_record_metrics(conn);
+        http_admission_release();
+    }
+    
+    free(conn);
+    interpreter_context_free();
+    return NULL;
+}
+
+// Finishes connections an io_uring worker handed over with their head already read
+void *http_handoff_thread(void *arg) {
+    worker_metrics = &http_metrics[(intptr_t)arg];
+    interpreter_context_init();
+    struct timeval timeout = { .tv_sec = HTTP_IO_TIMEOUT };
+    HttpQueued next;
+    
+    while (http_queue_pop(&http_handoff, &next)) {
+        HttpConnection *conn = next.conn;
+        setsockopt(next.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(next.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        http_handle_client(conn);
+        if (!conn->detached) close(next.fd);
+        http_record_metrics(conn);
+        http_admission_release();
+        free(conn);
+    }
+    
+    interpreter_context_free();
+    return NULL;
+}
+
+// Metrics slots per process: the io_uring backend adds one handoff thread per worker
+int http_thread_slots(void) {
+    return http_server.io_uring ? http_server.threads * 2 : http_server.threads;
+}
+
+// Runs one process's share of the server: its worker threads and, unless
+// they accept on their own io_uring rings, the accept loop feeding them
+void http_serve_process(int server_fd, int slot) {
+    http_admission = &http_processes[slot].admission;
+    if (!http_server.io_uring) http_queue_open(&http_queue, http_server.max_conns);
+    
+    int threads = http_server.threads;
+    pthread_t *handoff = NULL;
+    if (http_server.io_uring) {
+        http_queue_open(&http_handoff, http_server.max_conns);
+        handoff = malloc(threads * sizeof(pthread_t));
+        for (int i = 0; i < threads; i++) {
+            intptr_t metrics_slot = slot * http_thread_slots() + threads + i;
+            pthread_create(&handoff[i], NULL, http_handoff_thread, (void*)metrics_slot);
+        }
+    }
+    
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        intptr_t metrics_slot = slot * http_thread_slots() + i;
+        pthread_create(&workers[i], NULL, http_worker_thread, (void*)metrics_slot);
+    }
+    if (http_queue.enabled) http_accept_loop(server_fd);
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    if (http_queue.enabled) http_queue_free(&http_queue);
+    
+    // The rings have drained, so nothing more can be handed over
+    if (handoff) {
+        http_queue_close(&http_handoff);
+        for (int i = 0; i < threads; i++) {
+            pthread_join(handoff[i], NULL);
+        }
+        free(handoff);
+        http_queue_free(&http_handoff);
+    }
+}
+
+// Prefork mode. The supervisor thread forks processes= workers that all
+// accept on the one listening socket, and replaces any that die.
+#define HTTP_RESTART_INTERVAL_NS 1000000000ull
+#define HTTP_SUPERVISE_POLL_US 50000
+#define HTTP_STOP_GRACE_NS 5000000000ull
+
+void http_worker_process_stop(int sig) {
+    (void)sig;
+    http_server.running = false;
+    shutdown(http_server.listen_fd, SHUT_RDWR);
+}
+
+pid_t http_fork_worker(int server_fd, int slot) {
+    pid_t supervisor = getpid();
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    
+    // Only this thread exists in the child. It must not outlive the supervisor.
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != supervisor) _exit(0);
+    // Ctrl-C reaches the whole process group; workers wait for the supervisor to stop them
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, http_worker_process_stop);
+    http_serve_process(server_fd, slot);
+    ws_hub_stop();
+    fflush(stdout);
+    _exit(0);
+}
+
+// A dead worker's connections are gone; its gauges must not keep counting them
+void http_process_reset(int slot) {
+    for (int i = 0; i < http_thread_slots(); i++) {
+        WorkerMetrics *m = &http_metrics[slot * http_thread_slots() + i];
+        __atomic_store_n(&m->connections_closed, m->connections_accepted, __ATOMIC_RELAXED);
+    }
+    AdmissionState *a = &http_processes[slot].admission;
+    __atomic_store_n(&a->active, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&a->pending_bytes, 0, __ATOMIC_RELAXED);
+}
+
+void http_supervise(int server_fd) {
+    uint64_t *forked_ns = calloc(http_process_count, sizeof(uint64_t));
+    for (int i = 0; i < http_process_count; i++) {
+        http_processes[i].pid = http_fork_worker(server_fd, i);
+        forked_ns[i] = monotonic_ns();
+    }
+    
+    while (http_server.running) {
+        usleep(HTTP_SUPERVISE_POLL_US);
+        for (int i = 0; i < http_process_count; i++) {
+            ProcessStats *p = &http_processes[i];
+            int status;
+            if (p->pid > 0 && waitpid(p->pid, &status, WNOHANG) == p->pid) {
+                // Workers also leave on their own once a stop has shut the socket
+                if (!http_server.running) {
+                    p->pid = 0;
+                    continue;
+                }
+                if (WIFSIGNALED(status)) {
+                    printf("⚠️  Worker process %d killed by signal %d, restarting\n", p->pid, WTERMSIG(status));
+                } else {
+                    printf("⚠️  Worker process %d exited with status %d, restarting\n", p->pid, WEXITSTATUS(status));
+                }
+                fflush(stdout);
+                http_process_reset(i);
+                __atomic_store_n(&p->pid, 0, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&p->restarts, 1, __ATOMIC_RELAXED);
+            }
+            // A worker that dies straight away is restarted at most once a second
+            if (p->pid <= 0 && http_server.running && monotonic_ns() - forked_ns[i] >= HTTP_RESTART_INTERVAL_NS) {
+                __atomic_store_n(&p->pid, http_fork_worker(server_fd, i), __ATOMIC_RELAXED);
+                forked_ns[i] = monotonic_ns();
+            }
+        }
+    }
+    
+    // Workers finish what they are serving, within reason
+    for (int i = 0; i < http_process_count; i++) {
+        if (http_processes[i].pid > 0) kill(http_processes[i].pid, SIGTERM);
+    }
+    uint64_t deadline = monotonic_ns() + HTTP_STOP_GRACE_NS;
+    for (int i = 0; i < http_process_count; i++) {
+        pid_t pid = http_processes[i].pid;
+        while (pid > 0) {
+            pid_t r = waitpid(pid, NULL, WNOHANG);
+            if (r == pid || (r < 0 && errno != EINTR)) break;
+            if (monotonic_ns() > deadline) {
+                kill(pid, SIGKILL);
+                waitpid(pid, NULL, 0);
+                break;
+            }
+            usleep(10000);
+        }
+        http_processes[i].pid = 0;
+    }
+    free(forked_ns);
+}
+
+void *http_server_thread(void *arg) {
+    (void)arg;
+    int server_fd;
+    struct sockaddr_in address;
+    
+    if (http_server.cert || http_server.key) {
+        if (!http_server.cert || !http_server.key) {
+            printf("Error: TLS needs both cert= and key=\n");
+            http_server.running = false;
+            return NULL;
+        }
+        if (!http_tls_init(http_server.cert, http_server.key)) {
+            http_server.running = false;
+            return NULL;
+        }
+    } else if (http_tls_ctx) {
+        SSL_CTX_free(http_tls_ctx);
+        http_tls_ctx = NULL;
+    }
+    
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        http_server.running = false;
+        return NULL;
+    }
+    
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(http_server.port);
+    
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        printf("Error: Cannot bind port %d\n", http_server.port);
+        close(server_fd);
+        http_server.running = false;
+        return NULL;
+    }
+    
+    if (listen(server_fd, HTTP_LISTEN_BACKLOG) < 0) {
+        close(server_fd);
+        http_server.running = false;
+        return NULL;
+    }
+    http_server.listen_fd = server_fd;
+    
+    printf("🚀 HTTP Server running on %s://localhost:%d\n", http_tls_ctx ? "https" : "http", http_server.port);
+    printf("📁 Serving files from: %s\n", http_server.root_dir);
+    if (route_count > 0) {
+        printf("🧵 %d route(s) on %d worker thread(s)\n", route_count, http_server.threads);
+    }
+    if (http_server.processes > 1) {
+        printf("👥 %d worker processes with %d thread(s) each\n", http_server.processes, http_server.threads);
+    }
+    if (http_server.io_uring && http_tls_ctx) {
+        printf("⚠️  The io_uring backend does not do TLS, falling back to worker threads\n");
+        http_server.io_uring = false;
+    }
+#ifdef HAVE_IO_URING
+    if (http_server.io_uring && !http_uring_supported()) {
+        printf("⚠️  io_uring is unavailable here, falling back to worker threads\n");
+        http_server.io_uring = false;
+    }
+    if (http_server.io_uring) printf("⚙️  Backend: io_uring\n");
+#else
+    if (http_server.io_uring) {
+        printf("⚠️  io_uring support not compiled in, falling back to worker threads\n");
+        http_server.io_uring = false;
+    }
+#endif
+    fflush(stdout);
+    
+    int processes = http_server.processes > 1 ? http_server.processes : 1;
+    http_stats_alloc(processes, http_thread_slots());
+    if (processes > 1) http_supervise(server_fd);
+    else http_serve_process(server_fd, 0);
+    
+    close(server_fd);
+    return NULL;
+}
+
+void http_server_start(void) {
+    if (http_server.threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        // Worker processes split the CPUs between them
+        if (http_server.processes > 1) cpus /= http_server.processes;
+        http_server.threads = cpus > 0 ? (cpus > 64 ? 64 : cpus) : 1;
+    }
+    if (!http_server.upload_dir) {
+        const char *tmp = getenv("TMPDIR");
+        http_server.upload_dir = strdup(tmp && tmp[0] ? tmp : "/tmp");
+    }
+    if (http_server.max_conns <= 0) http_server.max_conns = HTTP_DEFAULT_MAX_CONNS;
+    if (http_server.queue_timeout_ms == 0) http_server.queue_timeout_ms = HTTP_DEFAULT_QUEUE_TIMEOUT_MS;
+    // A client hanging up mid-response must not take the process down
+    signal(SIGPIPE, SIG_IGN);
+    // Workers start from the globals as they are now
+    interpreter_snapshot_take();
+    http_server.listen_fd = -1;
+    http_server.running = true;
+    pthread_create(&http_server.thread, NULL, http_server_thread, NULL);
+}
+
+void http_server_stop(void) {
+    if (!http_server.running && !http_server.thread) return;
+    http_server.running = false;
+    // Wakes every worker blocked in accept()
+    if (http_server.listen_fd >= 0) shutdown(http_server.listen_fd, SHUT_RDWR);
+    pthread_join(http_server.thread, NULL);
+    http_server.thread = 0;
+    ws_hub_stop();
+}
+
+bool http_server_set_option(const char *key, const char *value) {
+    if (strcmp(key, "port") == 0) {
+        http_server.port = atoi(value);
+    } else if (strcmp(key, "root") == 0) {
+        free(http_server.root_dir);
+        http_server.root_dir = strdup(value);
+    } else if (strcmp(key, "threads") == 0) {
+        http_server.threads = atoi(value);
+    } else if (strcmp(key, "processes") == 0) {
+        http_server.processes = atoi(value);
+    } else if (strcmp(key, "metrics") == 0) {
+        http_server.metrics = strcmp(value, "on") == 0 || strcmp(value, "true") == 0 || strcmp(value, "1") == 0;
+    } else if (strcmp(key, "max_body") == 0) {
+        http_server.max_body = atoll(value);
+    } else if (strcmp(key, "upload_dir") == 0) {
+        free(http_server.upload_dir);
+        http_server.upload_dir = strdup(value);
+    } else if (strcmp(key, "max_conns") == 0) {
+        http_server.max_conns = atoi(value);
+    } else if (strcmp(key, "max_pending") == 0) {
+        http_server.max_pending = atoll(value);
+    } else if (strcmp(key, "rate_limit") == 0) {
+        http_server.rate_limit = atof(value);
+    } else if (strcmp(key, "rate_burst") == 0) {
+        http_server.rate_burst = atof(value);
+    } else if (strcmp(key, "queue_timeout") == 0) {
+        // 0 or "off" disables the deadline
+        int ms = atoi(value);
+        http_server.queue_timeout_ms = ms > 0 ? ms : -1;
+    } else if (strcmp(key, "cert") == 0) {
+        free(http_server.cert);
+        http_server.cert = strdup(value);
+    } else if (strcmp(key, "key") == 0) {
+        free(http_server.key);
+        http_server.key = strdup(value);
+    } else if (strcmp(key, "backend") == 0) {
+        if (strcmp(value, "io_uring") == 0) http_server.io_uring = true;
+        else if (strcmp(value, "threads") == 0) http_server.io_uring = false;
+        else return false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Load generator for `zenith bench http`. Each thread drives its share of the
+// connections from one epoll loop. Latency is measured from when a request
+// was due, not when it was written, so a stalled server can't hide its
+// queueing delay (coordinated omission).
+#define BENCH_MAX_PIPELINE 64
+#define BENCH_READ_SIZE (64 * 1024)
+
+typedef struct {
+    char host[256];
+    char port[16];
+    char path[2048];
+    int connections;
+    int threads;
+    int duration;
+    int pipeline;
+    double rate;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char *request;
+    size_t request_len;
+} BenchConfig;
+
+typedef enum {
+    BENCH_STATUS, BENCH_HEADERS, BENCH_BODY, BENCH_CHUNK_SIZE, BENCH_CHUNK_DATA,
+    BENCH_CHUNK_END, BENCH_TRAILER, BENCH_UNTIL_CLOSE
+} BenchParseState;
+
+typedef struct {
+    int fd;
+    bool connecting;
+    uint64_t due_ns[BENCH_MAX_PIPELINE];
+    int due_head;
+    int inflight;
+    int unsent;
+    int max_inflight;
+    size_t out_off;
+    uint64_t next_due_ns;
+    uint64_t interval_ns;
+    
+    BenchParseState state;
+    char line[1024];
+    size_t line_len;
+    int status;
+    long long body_left;
+    bool chunked;
+    bool close_after;
+} BenchConn;
+
+typedef struct {
+    const BenchConfig *cfg;
+    int first_conn;
+    int conn_count;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    pthread_t thread;
+    
+    LatencyHistogram latency;
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t connect_errors;
+    uint64_t io_errors;
+    uint64_t bad_status;
+    uint64_t raw_sum_us;
+    bool saw_close;
+} BenchThread;
+
+bool bench_parse_url(BenchConfig *cfg, const char *url) {
+    if (strncmp(url, "http://", 7) != 0) return false;
+    const char *host = url + 7;
+    const char *path = strchr(host, '/');
+    if (!path) path = host + strlen(host);
+    const char *colon = memchr(host, ':', path - host);
+    const char *host_end = colon ? colon : path;
+    
+    if (host_end == host || host_end - host >= (long)sizeof(cfg->host)) return false;
+    memcpy(cfg->host, host, host_end - host);
+    cfg->host[host_end - host] = 0;
+    if (colon) {
+        if (path - colon - 1 <= 0 || path - colon - 1 >= (long)sizeof(cfg->port)) return false;
+        memcpy(cfg->port, colon + 1, path - colon - 1);
+        cfg->port[path - colon - 1] = 0;
+    } else {
+        strcpy(cfg->port, "80");
+    }
+    snprintf(cfg->path, sizeof(cfg->path), "%s", *path ? path : "/");
+    
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(cfg->host, cfg->port, &hints, &res) != 0) return false;
+    memcpy(&cfg->addr, res->ai_addr, res->ai_addrlen);
+    cfg->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return true;
+}
+
+void bench_record(BenchThread *t, uint64_t latency_us) {
+    hist_record(&t->latency, latency_us);
+    t->raw_sum_us += latency_us;
+    t->requests++;
+    // Closed-loop runs have no schedule, so back-fill the samples a stalled
+    // connection would have produced at its usual pace (as HdrHistogram does)
+    if (t->cfg->rate <= 0 && t->requests > 100) {
+        uint64_t expected = t->raw_sum_us / t->requests;
+        if (expected == 0) return;
+        for (uint64_t v = latency_us > expected ? latency_us - expected : 0; v >= expected; v -= expected) {
+            hist_record(&t->latency, v);
+        }
+    }
+}
+
+bool bench_connect(BenchThread *t, BenchConn *c) {
+    const BenchConfig *cfg = t->cfg;
+    c->fd = socket(cfg->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) return false;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (const struct sockaddr*)&cfg->addr, cfg->addr_len) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    c->connecting = true;
+    c->state = BENCH_STATUS;
+    c->line_len = 0;
+    c->out_off = 0;
+    // Requests that were in flight on the old connection go out again with their original due times
+    c->unsent = c->inflight;
+    return true;
+}
+
+// Writes whatever is queued: the unsent tail of the pipeline, one copy of the request each
+bool bench_flush(BenchThread *t, BenchConn *c) {
+    const BenchConfig *cfg = t->cfg;
+    while (c->unsent > 0 && !c->connecting) {
+        ssize_t n = send(c->fd, cfg->request + c->out_off, cfg->request_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        c->out_off += n;
+        if (c->out_off == cfg->request_len) {
+            c->out_off = 0;
+            c->unsent--;
+        }
+    }
+    return true;
+}
+
+// Queues new requests while the pipeline has room and, with a rate, while they are due
+void bench_issue(BenchThread *t, BenchConn *c, uint64_t now) {
+    (void)t;
+    while (c->inflight < c->max_inflight) {
+        uint64_t due = now;
+        if (c->interval_ns) {
+            if (c->next_due_ns > now) break;
+            due = c->next_due_ns;
+            c->next_due_ns += c->interval_ns;
+        }
+        c->due_ns[(c->due_head + c->inflight) % BENCH_MAX_PIPELINE] = due;
+        c->inflight++;
+        c->unsent++;
+    }
+}
+
+void bench_response_done(BenchThread *t, BenchConn *c, uint64_t now) {
+    // Pipelining into a connection the server is about to close only provokes resets
+    if (c->close_after) {
+        c->max_inflight = 1;
+        t->saw_close = true;
+    }
+    if (c->inflight > 0) {
+        uint64_t due = c->due_ns[c->due_head];
+        c->due_head = (c->due_head + 1) % BENCH_MAX_PIPELINE;
+        c->inflight--;
+        if (c->unsent > c->inflight) c->unsent = c->inflight;
+        if (now < t->end_ns) {
+            bench_record(t, (now - due) / 1000);
+            if (c->status < 200 || c->status >= 400) t->bad_status++;
+        }
+    }
+    c->state = BENCH_STATUS;
+    c->line_len = 0;
+}
+
+// Streams response bytes through a small state machine; bodies are counted, never stored.
+// Returns true when the server will close the connection after this response.
+bool bench_parse(BenchThread *t, BenchConn *c, const char *p, size_t n, uint64_t now) {
+    const char *end = p + n;
+    while (p < end) {
+        if (c->state == BENCH_BODY || c->state == BENCH_CHUNK_DATA) {
+            size_t take = (size_t)(end - p) < (unsigned long long)c->body_left ? (size_t)(end - p) : (size_t)c->body_left;
+            p += take;
+            c->body_left -= take;
+            if (c->body_left > 0) continue;
+            if (c->state == BENCH_CHUNK_DATA) {
+                c->state = BENCH_CHUNK_END;
+                continue;
+            }
+            bool closing = c->close_after;
+            bench_response_done(t, c, now);
+            if (closing) return true;
+            continue;
+        }
+        if (c->state == BENCH_UNTIL_CLOSE) return false;
+        
+        // Everything else is line oriented
+        const char *nl = memchr(p, '\n', end - p);
+        size_t take = (nl ? nl + 1 : end) - p;
+        if (c->line_len + take < sizeof(c->line)) memcpy(c->line + c->line_len, p, take);
+        c->line_len += take;
+        p += take;
+        if (!nl) continue;
+        
+        size_t len = c->line_len < sizeof(c->line) ? c->line_len : sizeof(c->line) - 1;
+        while (len > 0 && (c->line[len - 1] == '\n' || c->line[len - 1] == '\r')) len--;
+        c->line[len] = 0;
+        c->line_len = 0;
+        
+        switch (c->state) {
+            case BENCH_STATUS:
+                c->status = strncmp(c->line, "HTTP/1.", 7) == 0 ? atoi(c->line + 9) : 0;
+                c->body_left = -1;
+                c->chunked = false;
+                c->close_after = strncmp(c->line, "HTTP/1.0", 8) == 0;
+                c->state = BENCH_HEADERS;
+                break;
+            case BENCH_HEADERS:
+                if (len == 0) {
+                    bool no_body = c->status == 204 || c->status == 304 || (c->status >= 100 && c->status < 200);
+                    if (no_body || c->body_left == 0) {
+                        bool closing = c->close_after;
+                        bench_response_done(t, c, now);
+                        if (closing) return true;
+                    } else if (c->chunked) {
+                        c->state = BENCH_CHUNK_SIZE;
+                    } else if (c->body_left > 0) {
+                        c->state = BENCH_BODY;
+                    } else {
+                        c->state = BENCH_UNTIL_CLOSE;
+                    }
+                } else if (strncasecmp(c->line, "Content-Length:", 15) == 0) {
+                    c->body_left = atoll(c->line + 15);
+                } else if (strncasecmp(c->line, "Transfer-Encoding:", 18) == 0) {
+                    c->chunked = strcasestr(c->line + 18, "chunked") != NULL;
+                } else if (strncasecmp(c->line, "Connection:", 11) == 0) {
+                    if (strcasestr(c->line + 11, "close")) c->close_after = true;
+                    else if (strcasestr(c->line + 11, "keep-alive")) c->close_after = false;
+                }
+                break;
+            case BENCH_CHUNK_SIZE:
+                c->body_left = strtoll(c->line, NULL, 16);
+                c->state = c->body_left > 0 ? BENCH_CHUNK_DATA : BENCH_TRAILER;
+                break;
+            case BENCH_CHUNK_END:
+                c->state = BENCH_CHUNK_SIZE;
+                break;
+            case BENCH_TRAILER:
+                if (len == 0) {
+                    bool closing = c->close_after;
+                    bench_response_done(t, c, now);
+                    if (closing) return true;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+void bench_reconnect(BenchThread *t, BenchConn *c, int epfd, uint64_t now) {
+    if (c->fd >= 0) close(c->fd);
+    // A body delimited by the close is complete now
+    if (c->state == BENCH_UNTIL_CLOSE) bench_response_done(t, c, now);
+    if (!bench_connect(t, c)) {
+        t->connect_errors++;
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    // Queue before the handshake finishes so connection setup counts toward latency
+    bench_issue(t, c, now);
+}
+
+void *bench_thread(void *arg) {
+    BenchThread *t = arg;
+    const BenchConfig *cfg = t->cfg;
+    BenchConn *conns = calloc(t->conn_count, sizeof(BenchConn));
+    char *buf = malloc(BENCH_READ_SIZE);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event events[256];
+    
+    for (int i = 0; i < t->conn_count; i++) {
+        BenchConn *c = &conns[i];
+        c->fd = -1;
+        c->max_inflight = cfg->pipeline;
+        if (cfg->rate > 0) {
+            // Spread first requests over one interval so connections don't fire in lockstep
+            c->interval_ns = (uint64_t)(1e9 * cfg->connections / cfg->rate);
+            c->next_due_ns = t->start_ns + c->interval_ns * (t->first_conn + i) / cfg->connections;
+        }
+        bench_reconnect(t, c, epfd, t->start_ns);
+    }
+    
+    while (1) {
+        uint64_t now = monotonic_ns();
+        if (now >= t->end_ns) break;
+        
+        int timeout_ms = (int)((t->end_ns - now) / 1000000) + 1;
+        if (cfg->rate > 0) {
+            uint64_t next = t->end_ns;
+            for (int i = 0; i < t->conn_count; i++) {
+                if (conns[i].inflight < conns[i].max_inflight && conns[i].next_due_ns < next) next = conns[i].next_due_ns;
+            }
+            timeout_ms = next > now ? (int)((next - now) / 1000000) : 0;
+        }
+        
+        int n = epoll_wait(epfd, events, 256, timeout_ms);
+        now = monotonic_ns();
+        for (int e = 0; e < n; e++) {
+            BenchConn *c = events[e].data.ptr;
+            if (c->connecting && (events[e].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err) {
+                    t->connect_errors++;
+                    bench_reconnect(t, c, epfd, now);
+                    continue;
+                }
+                c->connecting = false;
+            }
+            if (c->connecting) continue;
+            
+            bool closed = false;
+            if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                while (1) {
+                    ssize_t r = read(c->fd, buf, BENCH_READ_SIZE);
+                    if (r > 0) {
+                        if (now < t->end_ns) t->bytes += r;
+                        if (bench_parse(t, c, buf, r, now)) {
+                            closed = true;
+                            break;
+                        }
+                        continue;
+                    }
+                    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                    if (r < 0) t->io_errors++;
+                    else if (c->state != BENCH_UNTIL_CLOSE && (c->state != BENCH_STATUS || c->line_len)) t->io_errors++;
+                    closed = true;
+                    break;
+                }
+            }
+            if (closed) {
+                bench_reconnect(t, c, epfd, now);
+                continue;
+            }
+            bench_issue(t, c, now);
+            if (!bench_flush(t, c)) {
+                t->io_errors++;
+                bench_reconnect(t, c, epfd, now);
+            }
+        }
+        
+        // Connections that were idle still need their pipelines topped up
+        for (int i = 0; i < t->conn_count; i++) {
+            BenchConn *c = &conns[i];
+            if (c->fd < 0) {
+                bench_reconnect(t, c, epfd, now);
+                continue;
+            }
+            if (c->connecting || c->inflight >= c->max_inflight) continue;
+            int before = c->unsent;
+            bench_issue(t, c, now);
+            if (c->unsent != before && !bench_flush(t, c)) {
+                t->io_errors++;
+                bench_reconnect(t, c, epfd, now);
+            }
+        }
+    }
+    
+    for (int i = 0; i < t->conn_count; i++) {
+        if (conns[i].fd >= 0) close(conns[i].fd);
+    }
+    close(epfd);
+    free(buf);
+    free(conns);
+    return NULL;
+}
+
+void bench_format_bytes(double bytes, char *out, size_t len) {
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int u = 0;
+    while (bytes >= 1024 && u < 4) {
+        bytes /= 1024;
+        u++;
+    }
+    snprintf(out, len, "%.2f %s", bytes, units[u]);
+}
+
+void bench_format_latency(uint64_t us, char *out, size_t len) {
+    if (us >= 1000000) snprintf(out, len, "%.2fs", us / 1e6);
+    else if (us >= 1000) snprintf(out, len, "%.2fms", us / 1e3);
+    else snprintf(out, len, "%luus", (unsigned long)us);
+}
+
+int bench_http(int argc, char *argv[]) {
+    BenchConfig cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.connections = 64;
+    cfg.duration = 10;
+    cfg.pipeline = 1;
+    const char *url = NULL;
+    
+    for (int i = 0; i < argc; i++) {
+        char *eq = strchr(argv[i], '=');
+        if (!eq) {
+            printf("Error: Expected key=value, got '%s'\n", argv[i]);
+            return 1;
+        }
+        char key[32];
+        snprintf(key, sizeof(key), "%.*s", (int)(eq - argv[i]), argv[i]);
+        const char *value = eq + 1;
+        if (strcmp(key, "url") == 0) url = value;
+        else if (strcmp(key, "connections") == 0) cfg.connections = atoi(value);
+        else if (strcmp(key, "duration") == 0) cfg.duration = atoi(value);
+        else if (strcmp(key, "pipeline") == 0) cfg.pipeline = atoi(value);
+        else if (strcmp(key, "threads") == 0) cfg.threads = atoi(value);
+        else if (strcmp(key, "rate") == 0) cfg.rate = atof(value);
+        else {
+            printf("Error: Unknown bench option '%s'\n", key);
+            return 1;
+        }
+    }
+    
+    if (!url) {
+        printf("Usage: zenith bench http url=<http://host:port/path> [connections=64] [duration=10]\n"
+               "                         [pipeline=1] [threads=N] [rate=<requests/s>]\n");
+        return 1;
+    }
+    if (!bench_parse_url(&cfg, url)) {
+        printf("Error: Cannot resolve '%s' (only http:// URLs are supported)\n", url);
+        return 1;
+    }
+    if (cfg.connections < 1) cfg.connections = 1;
+    if (cfg.duration < 1) cfg.duration = 1;
+    if (cfg.pipeline < 1) cfg.pipeline = 1;
+    if (cfg.pipeline > BENCH_MAX_PIPELINE) cfg.pipeline = BENCH_MAX_PIPELINE;
+    if (cfg.threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cfg.threads = cpus > 0 ? cpus : 1;
+    }
+    if (cfg.threads > cfg.connections) cfg.threads = cfg.connections;
+    
+    char request[4096];
+    cfg.request_len = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: zenith-bench/%s\r\nAccept: */*\r\n\r\n",
+        cfg.path, cfg.host, VERSION);
+    cfg.request = request;
+    
+    // Fail fast instead of counting a whole run of connect errors
+    int probe = socket(cfg.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0 || connect(probe, (struct sockaddr*)&cfg.addr, cfg.addr_len) < 0) {
+        printf("Error: Cannot connect to %s:%s\n", cfg.host, cfg.port);
+        if (probe >= 0) close(probe);
+        return 1;
+    }
+    close(probe);
+    signal(SIGPIPE, SIG_IGN);
+    
+    printf("Running %ds test @ %s\n", cfg.duration, url);
+    printf("  %d thread(s), %d connection(s), pipeline %d", cfg.threads, cfg.connections, cfg.pipeline);
+    if (cfg.rate > 0) printf(", target %.0f req/s", cfg.rate);
+    printf("\n");
+    fflush(stdout);
+    
+    BenchThread *threads = calloc(cfg.threads, sizeof(BenchThread));
+    uint64_t start = monotonic_ns();
+    uint64_t end = start + (uint64_t)cfg.duration * 1000000000ull;
+    int next_conn = 0;
+    for (int i = 0; i < cfg.threads; i++) {
+        BenchThread *t = &threads[i];
+        t->cfg = &cfg;
+        t->first_conn = next_conn;
+        t->conn_count = cfg.connections / cfg.threads + (i < cfg.connections % cfg.threads);
+        next_conn += t->conn_count;
+        t->start_ns = start;
+        t->end_ns = end;
+        pthread_create(&t->thread, NULL, bench_thread, t);
+    }
+    
+    LatencyHistogram *latency = calloc(1, sizeof(LatencyHistogram));
+    uint64_t requests = 0, bytes = 0, connect_errors = 0, io_errors = 0, bad_status = 0, raw_sum = 0;
+    bool saw_close = false;
+    for (int i = 0; i < cfg.threads; i++) {
+        BenchThread *t = &threads[i];
+        pthread_join(t->thread, NULL);
+        hist_merge(latency, &t->latency);
+        requests += t->requests;
+        bytes += t->bytes;
+        connect_errors += t->connect_errors;
+        io_errors += t->io_errors;
+        bad_status += t->bad_status;
+        raw_sum += t->raw_sum_us;
+        saw_close |= t->saw_close;
+    }
+    double elapsed = (monotonic_ns() - start) / 1e9;
+    if (elapsed > cfg.duration) elapsed = cfg.duration;
+    
+    char total_bytes[32], rate_bytes[32], p50[32], p99[32], p999[32], max[32], mean[32];
+    bench_format_bytes(bytes, total_bytes, sizeof(total_bytes));
+    bench_format_bytes(bytes / elapsed, rate_bytes, sizeof(rate_bytes));
+    bench_format_latency(hist_percentile(latency, 50), p50, sizeof(p50));
+    bench_format_latency(hist_percentile(latency, 99), p99, sizeof(p99));
+    bench_format_latency(hist_percentile(latency, 99.9), p999, sizeof(p999));
+    bench_format_latency(latency->max, max, sizeof(max));
+    bench_format_latency(requests ? raw_sum / requests : 0, mean, sizeof(mean));
+    
+    printf("  Requests:     %lu in %.2fs\n", (unsigned long)requests, elapsed);
+    printf("  Requests/sec: %.2f\n", requests / elapsed);
+    printf("  Transfer:     %s (%s/s)\n", total_bytes, rate_bytes);
+    printf("  Latency:      mean %s  p50 %s  p99 %s  p99.9 %s  max %s\n", mean, p50, p99, p999, max);
+    if (connect_errors || io_errors || bad_status) {
+        printf("  Errors:       connect %lu, io %lu, status %lu\n", (unsigned long)connect_errors,
+               (unsigned long)io_errors, (unsigned long)bad_status);
+    }
+    if (saw_close && cfg.pipeline > 1) {
+        printf("  Note:         server closes connections after each response, pipelining was dropped\n");
+    }
+    
+    free(latency);
+    free(threads);
+    return 0;
+}
+
+// Below this a read into the heap is cheaper than setting up and tearing down a mapping
+#define FILE_MMAP_THRESHOLD (256 * 1024)
+
+// Maps a regular file as a string value without copying it. The mapping sits
+// in a zeroed anonymous reservation at least one byte longer than the file,
+// so the string is NUL-terminated even when the size is a multiple of the page.
+Value *file_read_mapped(int fd, size_t size, bool binary) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t reserve = (size + page) & ~(page - 1);
+    char *base = mmap(NULL, reserve, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    if (mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, reserve);
+        return NULL;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+    
+    FileMapping *m = malloc(sizeof(FileMapping));
+    m->refs = 1;
+    m->base = base;
+    m->size = reserve;
+    Value *v = create_value(binary ? VAL_BYTES : VAL_STRING);
+    v->mapping = m;
+    if (binary) {
+        v->data.bytes.data = (unsigned char*)base;
+        v->data.bytes.len = size;
+    } else {
+        v->data.string = base;
+    }
+    return v;
+}
+
+// Reads all of fd and closes it; NULL with errno set when a read fails
+Value *file_read_fd(int fd, bool binary) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= FILE_MMAP_THRESHOLD) {
+        Value *v = file_read_mapped(fd, st.st_size, binary);
+        if (v) {
+            close(fd);
+            return v;
+        }
+    }
+    
+    // Small files, and pipes or /proc files whose size is not known up front
+    // Room for the terminator plus the byte that lets the final read see EOF
+    size_t cap = S_ISREG(st.st_mode) && st.st_size > 0 ? st.st_size + 2 : 4096;
+    size_t len = 0;
+    char *buffer = malloc(cap);
+    for (;;) {
+        if (len + 1 >= cap) {
+            cap *= 2;
+            buffer = realloc(buffer, cap);
+        }
+        ssize_t n = read(fd, buffer + len, cap - len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            int saved = errno;
+            free(buffer);
+            close(fd);
+            errno = saved;
+            return NULL;
+        }
+        if (n == 0) break;
+        len += n;
+    }
+    buffer[len] = 0;
+    close(fd);
+    
+    if (binary) {
+        Value *v = create_value(VAL_BYTES);
+        v->data.bytes.data = (unsigned char*)buffer;
+        v->data.bytes.len = len;
+        return v;
+    }
+    Value *v = create_value(VAL_STRING);
+    v->data.string = buffer;
+    return v;
+}
+
+// read(path) gives a string; read(path, "bytes") gives the exact contents as bytes
+Value *file_read(const char *filename, bool binary) {
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    Value *v = fd < 0 ? NULL : file_read_fd(fd, binary);
+    if (!v) return binary ? make_bytes("", 0) : make_string("");
+    return v;
+}
+
+// lines(): one reusable buffer per reader, refilled with large reads, with
+// newlines found by memchr (vectorised in libc). Memory stays bounded by the
+// longest line however big the input is.
+#define LINES_BUFFER_SIZE (1024 * 1024)
+
+typedef struct {
+    int fd;
+    bool close_fd;
+    bool eof;
+    char *buf;
+    size_t cap;
+    size_t start;
+    size_t end;
+} LineReader;
+
+Value *line_reader_next(Iterator *it) {
+    LineReader *r = it->state;
+    size_t scanned = r->start;
+    for (;;) {
+        char *nl = memchr(r->buf + scanned, '\n', r->end - scanned);
+        if (nl || (r->eof && r->start < r->end)) {
+            size_t len = (nl ? nl : r->buf + r->end) - (r->buf + r->start);
+            size_t consumed = len + (nl ? 1 : 0);
+            // CRLF ends a line too, as in files written on Windows
+            if (nl && len > 0 && r->buf[r->start + len - 1] == '\r') len--;
+            Value *line = create_value(VAL_STRING);
+            line->data.string = malloc(len + 1);
+            memcpy(line->data.string, r->buf + r->start, len);
+            line->data.string[len] = 0;
+            r->start += consumed;
+            return line;
+        }
+        if (r->eof) return NULL;
+        
+        // Keep the partial line, moved to the front; grow only for a line longer than the buffer
+        if (r->start > 0) {
+            memmove(r->buf, r->buf + r->start, r->end - r->start);
+            r->end -= r->start;
+            r->start = 0;
+        }
+        if (r->end == r->cap) {
+            r->cap *= 2;
+            r->buf = realloc(r->buf, r->cap);
+        }
+        scanned = r->end;
+        ssize_t n = read(r->fd, r->buf + r->end, r->cap - r->end);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) r->eof = true;
+        else r->end += n;
+    }
+}
+
+void line_reader_release(Iterator *it) {
+    LineReader *r = it->state;
+    if (r->close_fd) close(r->fd);
+    free(r->buf);
+    free(r);
+}
+
+// fd < 0 gives an empty sequence, as read() gives "" for a missing file
+Value *lines_open(int fd, bool close_fd) {
+    LineReader *r = calloc(1, sizeof(LineReader));
+    r->fd = fd;
+    r->close_fd = close_fd && fd >= 0;
+    r->eof = fd < 0;
+    r->cap = LINES_BUFFER_SIZE;
+    r->buf = malloc(r->cap);
+    if (r->close_fd) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    
+    Iterator *it = malloc(sizeof(Iterator));
+    it->refs = 1;
+    it->next = line_reader_next;
+    it->release = line_reader_release;
+    it->state = r;
+    Value *v = create_value(VAL_ITERATOR);
+    v->data.iterator = it;
+    return v;
+}
+
+// walk(): a pool of threads shares a stack of directories still to read.
+// Each directory is listed with getdents64 and d_type tells subdirectories
+// apart without a stat per entry; only filesystems that report DT_UNKNOWN
+// pay for an fstatat. Matching paths reach the script in batches through a
+// bounded queue, so the walk runs only a few batches ahead of the for-in
+// loop. Entries come out in no particular order, and symlinks are listed
+// but not followed.
+#define WALK_BATCH 256
+#define WALK_MAX_BATCHES 64
+#define WALK_DENTS_SIZE (64 * 1024)
+
+struct walk_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct WalkBatch {
+    char *paths[WALK_BATCH];
+    int count;
+    struct WalkBatch *next;
+} WalkBatch;
+
+typedef struct {
+    char **dirs;
+    int dir_count;
+    int dir_cap;
+    // Workers in the middle of a directory; the walk is over when this and dir_count are 0
+    int busy;
+    WalkBatch *head;
+    WalkBatch *tail;
+    int batches;
+    bool cancelled;
+    char *glob;
+    WalkBatch *current;
+    int pos;
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t output;
+    pthread_cond_t space;
+} Walker;
+
+// Takes ownership of batch. Caller holds w->lock.
+void walk_queue_batch(Walker *w, WalkBatch *batch) {
+    while (w->batches >= WALK_MAX_BATCHES && !w->cancelled) pthread_cond_wait(&w->space, &w->lock);
+    if (w->cancelled) {
+        for (int i = 0; i < batch->count; i++) free(batch->paths[i]);
+        free(batch);
+        return;
+    }
+    if (w->tail) w->tail->next = batch;
+    else w->head = batch;
+    w->tail = batch;
+    w->batches++;
+    pthread_cond_signal(&w->output);
+}
+
+void walk_push_dir(Walker *w, char *path) {
+    if (w->dir_count == w->dir_cap) {
+        w->dir_cap = w->dir_cap ? w->dir_cap * 2 : 64;
+        w->dirs = realloc(w->dirs, w->dir_cap * sizeof(char*));
+    }
+    w->dirs[w->dir_count++] = path;
+}
+
+void walk_read_dir(Walker *w, const char *dir, char *dents, WalkBatch **batch) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    size_t dir_len = strlen(dir);
+    if (dir_len > 0 && dir[dir_len - 1] == '/') dir_len--;
+    char **subdirs = NULL;
+    int sub_count = 0, sub_cap = 0;
+    
+    long n;
+    while (!__atomic_load_n(&w->cancelled, __ATOMIC_RELAXED) &&
+           (n = syscall(SYS_getdents64, fd, dents, WALK_DENTS_SIZE)) > 0) {
+        for (long off = 0; off < n; ) {
+            struct walk_dirent64 *d = (struct walk_dirent64*)(dents + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) continue;
+            
+            bool is_dir = d->d_type == DT_DIR;
+            if (d->d_type == DT_UNKNOWN) {
+                struct stat st;
+                is_dir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            bool match = !w->glob || fnmatch(w->glob, name, 0) == 0;
+            if (!is_dir && !match) continue;
+            
+            size_t name_len = strlen(name);
+            char *path = malloc(dir_len + name_len + 2);
+            memcpy(path, dir, dir_len);
+            path[dir_len] = '/';
+            memcpy(path + dir_len + 1, name, name_len + 1);
+            
+            if (is_dir) {
+                if (sub_count == sub_cap) {
+                    sub_cap = sub_cap ? sub_cap * 2 : 16;
+                    subdirs = realloc(subdirs, sub_cap * sizeof(char*));
+                }
+                subdirs[sub_count++] = match ? strdup(path) : path;
+                if (!match) continue;
+            }
+            (*batch)->paths[(*batch)->count++] = path;
+            if ((*batch)->count == WALK_BATCH) {
+                pthread_mutex_lock(&w->lock);
+                walk_queue_batch(w, *batch);
+                pthread_mutex_unlock(&w->lock);
+                *batch = calloc(1, sizeof(WalkBatch));
+            }
+        }
+    }
+    close(fd);
+    
+    if (sub_count > 0) {
+        pthread_mutex_lock(&w->lock);
+        for (int i = 0; i < sub_count; i++) walk_push_dir(w, subdirs[i]);
+        pthread_cond_broadcast(&w->work);
+        pthread_mutex_unlock(&w->lock);
+    }
+    free(subdirs);
+}
+
+void *walk_thread(void *arg) {
+    Walker *w = arg;
+    char *dents = malloc(WALK_DENTS_SIZE);
+    WalkBatch *batch = calloc(1, sizeof(WalkBatch));
+    
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->dir_count == 0 && w->busy > 0 && !w->cancelled) pthread_cond_wait(&w->work, &w->lock);
+        if (w->cancelled || w->dir_count == 0) break;
+        char *dir = w->dirs[--w->dir_count];
+        w->busy++;
+        pthread_mutex_unlock(&w->lock);
+        
+        walk_read_dir(w, dir, dents, &batch);
+        free(dir);
+        
+        pthread_mutex_lock(&w->lock);
+        // A worker about to go idle hands over its partial batch first
+        if (w->dir_count == 0 && batch->count > 0) {
+            walk_queue_batch(w, batch);
+            batch = calloc(1, sizeof(WalkBatch));
+        }
+        if (--w->busy == 0 && w->dir_count == 0) {
+            pthread_cond_broadcast(&w->work);
+            pthread_cond_broadcast(&w->output);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    
+    for (int i = 0; i < batch->count; i++) free(batch->paths[i]);
+    free(batch);
+    free(dents);
+    return NULL;
+}
+
+Value *walk_next(Iterator *it) {
+    Walker *w = it->state;
+    if (!w->current || w->pos == w->current->count) {
+        // Paths already handed out belong to their string values
+        free(w->current);
+        w->current = NULL;
+        pthread_mutex_lock(&w->lock);
+        while (!w->head && (w->dir_count > 0 || w->busy > 0)) pthread_cond_wait(&w->output, &w->lock);
+        WalkBatch *b = w->head;
+        if (b) {
+            w->head = b->next;
+            if (!w->head) w->tail = NULL;
+            w->batches--;
+            pthread_cond_signal(&w->space);
+        }
+        pthread_mutex_unlock(&w->lock);
+        if (!b) return NULL;
+        w->current = b;
+        w->pos = 0;
+    }
+    Value *v = create_value(VAL_STRING);
+    v->data.string = w->current->paths[w->pos++];
+    return v;
+}
+
+// Also runs when a loop stops early: the workers are told to stop and joined
+void walk_release(Iterator *it) {
+    Walker *w = it->state;
+    pthread_mutex_lock(&w->lock);
+    w->cancelled = true;
+    pthread_cond_broadcast(&w->work);
+    pthread_cond_broadcast(&w->space);
+    pthread_mutex_unlock(&w->lock);
+    for (int i = 0; i < w->thread_count; i++) pthread_join(w->threads[i], NULL);
+    
+    for (int i = 0; i < w->dir_count; i++) free(w->dirs[i]);
+    free(w->dirs);
+    if (w->current) {
+        for (int i = w->pos; i < w->current->count; i++) free(w->current->paths[i]);
+        free(w->current);
+    }
+    while (w->head) {
+        WalkBatch *b = w->head;
+        w->head = b->next;
+        for (int i = 0; i < b->count; i++) free(b->paths[i]);
+        free(b);
+    }
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->work);
+    pthread_cond_destroy(&w->output);
+    pthread_cond_destroy(&w->space);
+    free(w->threads);
+    free(w->glob);
+    free(w);
+}
+
+// glob matches entry names (not whole paths); threads <= 0 picks one per CPU, at least 4
+Value *walk_open(const char *root, const char *glob, int threads) {
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 4 ? 4 : (cpus > 64 ? 64 : cpus);
+    }
+    Walker *w = calloc(1, sizeof(Walker));
+    w->glob = glob && *glob ? strdup(glob) : NULL;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->output, NULL);
+    pthread_cond_init(&w->space, NULL);
+    walk_push_dir(w, strdup(root));
+    w->threads = calloc(threads, sizeof(pthread_t));
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&w->threads[w->thread_count], NULL, walk_thread, w) == 0) w->thread_count++;
+    }
+    // Without any worker the walk is simply empty
+    if (w->thread_count == 0) {
+        free(w->dirs[0]);
+        w->dir_count = 0;
+    }
+    
+    Iterator *it = malloc(sizeof(Iterator));
+    it->refs = 1;
+    it->next = walk_next;
+    it->release = walk_release;
+    it->state = w;
+    Value *v = create_value(VAL_ITERATOR);
+    v->data.iterator = it;
+    return v;
+}
+
+// csv_read(): splits records straight out of the read() buffer, which is a
+// file mapping for large files. Column types come from the first
+// CSV_SAMPLE_ROWS records; fields of numeric columns become numbers as they
+// are split, and empty ones read as null. Records are cut or padded with
+// null to the width of the first one.
+#define CSV_SAMPLE_ROWS 100
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+    bool quoted;
+    bool escaped;  // contains "" pairs
+} CsvField;
+
+typedef struct {
+    Value *source;  // keeps the file contents (and any mapping) alive
+    const char *pos, *end;
+    char delim;
+    int columns;
+    char **names;  // NULL without a header row
+    bool *numeric;
+    CsvField *fields;
+    int field_cap;
+} CsvReader;
+
+// Finds the next delimiter, quote or line end
+const char *csv_find_special(const char *p, const char *end, char delim) {
+#ifdef __SSE2__
+    __m128i d = _mm_set1_epi8(delim), q = _mm_set1_epi8('"');
+    __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, d), _mm_cmpeq_epi8(v, q)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && *p != delim && *p != '"' && *p != '\n' && *p != '\r') p++;
+    return p;
+}
+
+// Splits the next record into r->fields and returns the field count, or -1 at end of input
+int csv_next_record(CsvReader *r) {
+    const char *p = r->pos, *end = r->end;
+    if (p >= end) return -1;
+    int n = 0;
+    for (;;) {
+        if (n == r->field_cap) {
+            r->field_cap = r->field_cap ? r->field_cap * 2 : 16;
+            r->fields = realloc(r->fields, r->field_cap * sizeof(CsvField));
+        }
+        CsvField *f = &r->fields[n++];
+        f->quoted = p < end && *p == '"';
+        f->escaped = false;
+        if (f->quoted) {
+            // Runs to the first quote that is not doubled; line ends inside are data
+            f->ptr = ++p;
+            for (;;) {
+                const char *q = memchr(p, '"', end - p);
+                if (!q) {
+                    p = end;
+                    break;
+                }
+                if (q + 1 < end && q[1] == '"') {
+                    f->escaped = true;
+                    p = q + 2;
+                    continue;
+                }
+                p = q;
+                break;
+            }
+            f->len = p - f->ptr;
+            if (p < end) p++;
+            // Stray text between the closing quote and the delimiter is dropped
+            while (p < end && *p != r->delim && *p != '\n' && *p != '\r') p++;
+        } else {
+            f->ptr = p;
+            p = csv_find_special(p, end, r->delim);
+            // A quote that does not open the field is ordinary data
+            while (p < end && *p == '"') p = csv_find_special(p + 1, end, r->delim);
+            f->len = p - f->ptr;
+        }
+        if (p < end && *p == r->delim) {
+            p++;
+            continue;
+        }
+        if (p < end && *p == '\r') p++;
+        if (p < end && *p == '\n') p++;
+        break;
+    }
+    r->pos = p;
+    return n;
+}
+
+// Like csv_next_record() but skips blank lines
+int csv_next_row(CsvReader *r) {
+    int n;
+    do {
+        n = csv_next_record(r);
+    } while (n == 1 && r->fields[0].len == 0 && !r->fields[0].quoted);
+    return n;
+}
+
+char *csv_field_string(CsvField *f) {
+    char *s = malloc(f->len + 1);
+    if (!f->escaped) {
+        memcpy(s, f->ptr, f->len);
+        s[f->len] = 0;
+        return s;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < f->len; i++) {
+        s[n++] = f->ptr[i];
+        if (f->ptr[i] == '"') i++;
+    }
+    s[n] = 0;
+    return s;
+}
+
+// Surrounding blanks are allowed; leading zeros ("007") are not, so codes
+// and zero-padded IDs stay strings
+bool csv_parse_number(CsvField *f, double *out) {
+    const char *s = f->ptr, *end = s + f->len;
+    while (s < end && (*s == ' ' || *s == '\t')) s++;
+    while (end > s && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    const char *digits = s < end && *s == '-' ? s + 1 : s;
+    if (end - digits > 1 && digits[0] == '0' && digits[1] >= '0' && digits[1] <= '9') return false;
+    return s < end && parse_decimal(s, end, out) == end;
+}
+
+Value *csv_field_value(CsvField *f, bool numeric) {
+    if (numeric) {
+        double d;
+        if (f->len == 0) return create_value(VAL_NULL);
+        if (csv_parse_number(f, &d)) return make_number(d);
+    }
+    Value *v = create_value(VAL_STRING);
+    v->data.string = csv_field_string(f);
+    return v;
+}
+
+// A column is numeric when every non-empty sampled field parses as a number
+void csv_infer_types(CsvReader *r) {
+    const char *start = r->pos;
+    bool *seen = calloc(r->columns + 1, sizeof(bool));
+    for (int c = 0; c < r->columns; c++) r->numeric[c] = true;
+    for (int row = 0; row < CSV_SAMPLE_ROWS; row++) {
+        int n = csv_next_row(r);
+        if (n < 0) break;
+        for (int c = 0; c < n && c < r->columns; c++) {
+            double d;
+            if (r->fields[c].len == 0) continue;
+            if (r->numeric[c] && csv_parse_number(&r->fields[c], &d)) seen[c] = true;
+            else r->numeric[c] = false;
+        }
+    }
+    for (int c = 0; c < r->columns; c++) r->numeric[c] = r->numeric[c] && seen[c];
+    free(seen);
+    r->pos = start;
+}
+
+CsvReader *csv_open(const char *path, char delim, bool header) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    Value *source = fd < 0 ? NULL : file_read_fd(fd, true);
+    if (!source) {
+        printf("Error: Cannot open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    
+    CsvReader *r = calloc(1, sizeof(CsvReader));
+    r->source = source;
+    r->pos = (const char*)r->source->data.bytes.data;
+    r->end = r->pos + r->source->data.bytes.len;
+    if (r->end - r->pos >= 3 && memcmp(r->pos, "\xEF\xBB\xBF", 3) == 0) r->pos += 3;
+    r->delim = delim;
+    
+    const char *start = r->pos;
+    int n = csv_next_row(r);
+    if (n > 0) {
+        r->columns = n;
+        if (header) {
+            r->names = malloc(n * sizeof(char*));
+            for (int c = 0; c < n; c++) r->names[c] = csv_field_string(&r->fields[c]);
+        } else {
+            r->pos = start;
+        }
+    }
+    r->numeric = calloc(r->columns + 1, sizeof(bool));
+    csv_infer_types(r);
+    return r;
+}
+
+void csv_close(CsvReader *r) {
+    if (r->names) {
+        for (int c = 0; c < r->columns; c++) free(r->names[c]);
+        free(r->names);
+    }
+    free(r->numeric);
+    free(r->fields);
+    free_value(r->source);
+    free(r);
+}
+
+// A dict keyed by the header, or an array without one
+Value *csv_row_value(CsvReader *r, int n) {
+    int columns = r->columns;
+    Value *row = create_value(r->names ? VAL_DICT : VAL_ARRAY);
+    Value **items;
+    if (r->names) {
+        if (columns > row->data.dict.capacity) {
+            row->data.dict.capacity = columns;
+            row->data.dict.keys = realloc(row->data.dict.keys, columns * sizeof(char*));
+            row->data.dict.values = realloc(row->data.dict.values, columns * sizeof(Value*));
+        }
+        for (int c = 0; c < columns; c++) row->data.dict.keys[c] = strdup(r->names[c]);
+        row->data.dict.count = columns;
+        items = row->data.dict.values;
+    } else {
+        if (columns > row->data.array.capacity) {
+            row->data.array.capacity = columns;
+            row->data.array.items = realloc(row->data.array.items, columns * sizeof(Value*));
+        }
+        row->data.array.count = columns;
+        items = row->data.array.items;
+    }
+    for (int c = 0; c < columns; c++) {
+        items[c] = c < n ? csv_field_value(&r->fields[c], r->numeric[c]) : create_value(VAL_NULL);
+    }
+    return row;
+}
+
+Value *csv_next(Iterator *it) {
+    CsvReader *r = it->state;
+    int n = csv_next_row(r);
+    return n < 0 ? NULL : csv_row_value(r, n);
+}
+
+void csv_release(Iterator *it) {
+    csv_close(it->state);
+}
+
+// mode "rows" streams one row per loop iteration; "all" returns every row in
+// an array and "columns" returns one array per column, keyed by the header
+// when there is one
+Value *csv_read(const char *path, const char *mode, char delim, bool header) {
+    CsvReader *r = csv_open(path, delim, header);
+    if (!r) return create_value(VAL_NULL);
+    if (strcmp(mode, "columns") == 0) {
+        Value **cols = malloc((r->columns + 1) * sizeof(Value*));
+        for (int c = 0; c < r->columns; c++) cols[c] = create_value(VAL_ARRAY);
+        int n;
+        while ((n = csv_next_row(r)) >= 0) {
+            for (int c = 0; c < r->columns; c++) {
+                array_push(cols[c], c < n ? csv_field_value(&r->fields[c], r->numeric[c])
+                                              : create_value(VAL_NULL));
+            }
+        }
+        Value *result = create_value(r->names ? VAL_DICT : VAL_ARRAY);
+        for (int c = 0; c < r->columns; c++) {
+            if (r->names) dict_set(result, r->names[c], cols[c]);
+            else array_push(result, cols[c]);
+        }
+        free(cols);
+        csv_close(r);
+        return result;
+    }
+    if (strcmp(mode, "all") == 0) {
+        Value *result = create_value(VAL_ARRAY);
+        int n;
+        while ((n = csv_next_row(r)) >= 0) array_push(result, csv_row_value(r, n));
+        csv_close(r);
+        return result;
+    }
+    
+    Iterator *it = malloc(sizeof(Iterator));
+    it->refs = 1;
+    it->next = csv_next;
+    it->release = csv_release;
+    it->state = r;
+    Value *v = create_value(VAL_ITERATOR);
+    v->data.iterator = it;
+    return v;
+}
+
+void file_write(const char *filename, const char *content, size_t len) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    write_all(fd, content, len);
+    close(fd);
+}
+
+// append() on a path: one open/write/close, keeping what the file held
+void file_append(const char *filename, const char *content, size_t len) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    write_all(fd, content, len);
+    close(fd);
+}
+
+// open(): buffered write handles. Writes collect in a 1 MB user-space buffer
+// that goes out in one write() when full, on flush() and on close(); a write
+// too big for the space left goes out with the buffer in a single writev().
+// Policies: "fdatasync" syncs at every one of those points, "direct" writes
+// whole aligned blocks with O_DIRECT and only the unaligned tail through the
+// page cache.
+#define FILE_BUFFER_SIZE (1024 * 1024)
+#define FILE_DIRECT_ALIGN 4096
+
+typedef enum { FILE_SYNC_NONE, FILE_SYNC_DATA, FILE_SYNC_DIRECT } FileSyncPolicy;
+
+typedef struct FileHandle {
+    int refs;
+    int fd;
+    FileSyncPolicy policy;
+    bool direct;
+    off_t pos;
+    char *buf;
+    size_t len;
+    pthread_mutex_t lock;
+} FileHandle;
+
+// Direct I/O needs the file offset aligned too, so it is switched off after
+// an unaligned tail and back on once the offset lines up again
+void file_handle_set_direct(FileHandle *h, bool on) {
+    if (h->direct == on) return;
+    int flags = fcntl(h->fd, F_GETFL);
+    if (fcntl(h->fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT) == 0) h->direct = on;
+}
+
+bool file_handle_put(FileHandle *h, const void *data, size_t len) {
+    if (!write_all(h->fd, data, len)) return false;
+    h->pos += len;
+    return true;
+}
+
+// Writes out the buffer; a partial block stays buffered for direct handles
+// unless everything must reach the file now. Caller holds h->lock.
+bool file_handle_drain(FileHandle *h, bool all) {
+    bool ok = true;
+    if (h->policy == FILE_SYNC_DIRECT) {
+        // After an unaligned tail only the bytes up to the next block boundary
+        // go through the page cache; the rest moves back to the aligned buffer start
+        size_t gap = (FILE_DIRECT_ALIGN - h->pos % FILE_DIRECT_ALIGN) % FILE_DIRECT_ALIGN;
+        if (gap > 0) {
+            size_t now = gap < h->len ? gap : h->len;
+            file_handle_set_direct(h, false);
+            ok = file_handle_put(h, h->buf, now);
+            memmove(h->buf, h->buf + now, h->len - now);
+            h->len -= now;
+        }
+        size_t now = h->len & ~(size_t)(FILE_DIRECT_ALIGN - 1);
+        if (ok && now > 0) {
+            file_handle_set_direct(h, true);
+            ok = file_handle_put(h, h->buf, now);
+        }
+        if (ok && all && now < h->len) {
+            file_handle_set_direct(h, false);
+            ok = file_handle_put(h, h->buf + now, h->len - now);
+            now = h->len;
+        }
+        memmove(h->buf, h->buf + now, h->len - now);
+        h->len -= now;
+    } else {
+        ok = file_handle_put(h, h->buf, h->len);
+        h->len = 0;
+        if (h->policy == FILE_SYNC_DATA && fdatasync(h->fd) < 0) ok = false;
+    }
+    return ok;
+}
+
+bool file_handle_write(FileHandle *h, const char *data, size_t len) {
+    pthread_mutex_lock(&h->lock);
+    bool ok = h->fd >= 0;
+    if (ok && h->len + len <= FILE_BUFFER_SIZE) {
+        memcpy(h->buf + h->len, data, len);
+        h->len += len;
+    } else if (ok && h->policy != FILE_SYNC_DIRECT) {
+        struct iovec iov[2] = { { h->buf, h->len }, { (void*)data, len } };
+        int first = 0;
+        while (ok && first < 2) {
+            ssize_t n = writev(h->fd, iov + first, 2 - first);
+            if (n < 0) {
+                ok = errno == EINTR;
+                continue;
+            }
+            h->pos += n;
+            for (; first < 2 && (size_t)n >= iov[first].iov_len; first++) n -= iov[first].iov_len;
+            if (first < 2) {
+                iov[first].iov_base = (char*)iov[first].iov_base + n;
+                iov[first].iov_len -= n;
+            }
+        }
+        h->len = 0;
+        if (ok && h->policy == FILE_SYNC_DATA && fdatasync(h->fd) < 0) ok = false;
+    } else if (ok) {
+        // Direct writes must come from the aligned buffer, so big ones go through it in blocks
+        while (ok && len > 0) {
+            size_t n = FILE_BUFFER_SIZE - h->len < len ? FILE_BUFFER_SIZE - h->len : len;
+            memcpy(h->buf + h->len, data, n);
+            h->len += n;
+            data += n;
+            len -= n;
+            if (h->len == FILE_BUFFER_SIZE) ok = file_handle_drain(h, false);
+        }
+    }
+    pthread_mutex_unlock(&h->lock);
+    return ok;
+}
+
+bool file_handle_flush(FileHandle *h) {
+    pthread_mutex_lock(&h->lock);
+    bool ok = h->fd >= 0 && file_handle_drain(h, true);
+    if (ok && h->policy == FILE_SYNC_DIRECT && fdatasync(h->fd) < 0) ok = false;
+    pthread_mutex_unlock(&h->lock);
+    return ok;
+}
+
+bool file_handle_close(FileHandle *h) {
+    pthread_mutex_lock(&h->lock);
+    bool ok = true;
+    if (h->fd >= 0) {
+        ok = file_handle_drain(h, true);
+        if (close(h->fd) < 0) ok = false;
+        h->fd = -1;
+    }
+    pthread_mutex_unlock(&h->lock);
+    return ok;
+}
+
+void file_handle_retain(FileHandle *h) {
+    __atomic_add_fetch(&h->refs, 1, __ATOMIC_RELAXED);
+}
+
+// A handle nobody refers to any more is closed, so buffered data is never lost
+void file_handle_release(FileHandle *h) {
+    if (__atomic_sub_fetch(&h->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    file_handle_close(h);
+    pthread_mutex_destroy(&h->lock);
+    free(h->buf);
+    free(h);
+}
+
+// mode is "w" (truncate) or "a" (append); policy is "none", "fdatasync" or "direct"
+Value *file_open(const char *filename, const char *mode, const char *policy) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    if (strcmp(mode, "a") == 0) flags |= O_APPEND;
+    else if (strcmp(mode, "w") == 0) flags |= O_TRUNC;
+    else {
+        printf("Error: open() mode must be \"w\" or \"a\", not \"%s\"\n", mode);
+        return create_value(VAL_NULL);
+    }
+    FileSyncPolicy sync = FILE_SYNC_NONE;
+    if (strcmp(policy, "fdatasync") == 0) sync = FILE_SYNC_DATA;
+    else if (strcmp(policy, "direct") == 0) sync = FILE_SYNC_DIRECT;
+    else if (strcmp(policy, "none") != 0) {
+        printf("Error: open() policy must be \"none\", \"fdatasync\" or \"direct\", not \"%s\"\n", policy);
+        return create_value(VAL_NULL);
+    }
+    
+    int fd = open(filename, flags, 0644);
+    if (fd < 0) {
+        printf("Error: Cannot open %s: %s\n", filename, strerror(errno));
+        return create_value(VAL_NULL);
+    }
+    
+    FileHandle *h = calloc(1, sizeof(FileHandle));
+    h->refs = 1;
+    h->fd = fd;
+    h->policy = sync;
+    h->pos = lseek(fd, 0, SEEK_END);
+    if (h->pos < 0) h->pos = 0;
+    pthread_mutex_init(&h->lock, NULL);
+    if (posix_memalign((void**)&h->buf, FILE_DIRECT_ALIGN, FILE_BUFFER_SIZE) != 0) h->buf = malloc(FILE_BUFFER_SIZE);
+    // Filesystems without O_DIRECT (tmpfs) just get buffered writes
+    if (sync == FILE_SYNC_DIRECT) file_handle_set_direct(h, h->pos % FILE_DIRECT_ALIGN == 0);
+    
+    Value *v = create_value(VAL_FILE);
+    v->data.file = h;
+    return v;
+}
+
+// write()/append() on either a path or a handle from open()
+void file_write_value(Value *target, Value *content, bool append) {
+    // Strings and bytes are written in place rather than copied first
+    size_t len;
+    char *owned;
+    const char *cont = value_data(content, &len, &owned);
+    if (target->type == VAL_FILE) {
+        if (!file_handle_write(target->data.file, cont, len)) {
+            printf("Error: %s() failed: %s\n", append ? "append" : "write",
+                   target->data.file->fd < 0 ? "file is closed" : strerror(errno));
+        }
+    } else if (target->type == VAL_NULL) {
+        printf("Error: %s() needs a path or an open file\n", append ? "append" : "write");
+    } else {
+        char *fname = value_to_string(target);
+        if (append) file_append(fname, cont, len);
+        else file_write(fname, cont, len);
+        free(fname);
+    }
+    free(owned);
+}
+
+// kv_open(): an append-only log of records plus an in-memory hash index of
+// where each live key's latest record sits. The log is mapped read-only, so
+// kv_get() hands out values that point straight into the mapping. Every
+// write is a transaction whose last record carries KV_COMMIT; on open the
+// log is replayed and anything after the last intact commit (a torn append)
+// is cut off. Keys and values are stored NUL-terminated so mapped strings
+// need no copy, and each record is padded so the next header is aligned.
+#define KV_MAGIC "ZKVLOG2\n"
+#define KV_MAGIC_LEN 8
+#define KV_DELETE 1
+#define KV_BINARY 2
+#define KV_COMMIT 4
+
+typedef struct {
+    uint32_t crc;  // over the rest of the header and the payload
+    uint32_t key_len;
+    uint32_t value_len;
+    uint32_t flags;
+} KvRecord;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;  // 0 marks an empty slot
+} KvSlot;
+
+typedef struct KvStore {
+    int refs;
+    int fd;
+    char *path;
+    bool sync;
+    uint64_t size;  // committed length of the log
+    uint64_t dead;  // bytes held by overwritten or deleted records
+    FileMapping *map;
+    KvSlot *slots;
+    size_t capacity, count;
+    pthread_mutex_t lock;
+} KvStore;
+
+uint64_t kv_hash(const char *key, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+// Header, NUL-terminated key and value, then zero padding up to the next header
+uint64_t kv_padded_size(uint64_t key_len, uint64_t value_len) {
+    uint64_t size = sizeof(KvRecord) + key_len + 1 + value_len + 1;
+    return (size + _Alignof(KvRecord) - 1) & ~(uint64_t)(_Alignof(KvRecord) - 1);
+}
+
+uint64_t kv_record_size(const KvRecord *r) {
+    return kv_padded_size(r->key_len, r->value_len);
+}
+
+const KvRecord *kv_record_at(KvStore *kv, uint64_t offset) {
+    return (const KvRecord*)((char*)kv->map->base + offset);
+}
+
+uint32_t kv_record_crc(const KvRecord *r) {
+    return crc32_z(0, (const unsigned char*)&r->key_len, kv_record_size(r) - sizeof(uint32_t));
+}
+
+// Maps at least size bytes with room to grow; values from the old mapping keep it alive
+bool kv_remap(KvStore *kv, uint64_t size) {
+    if (kv->map && kv->map->size >= size) return true;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t reserve = size < (1 << 20) ? (1 << 20) : size * 2;
+    reserve = (reserve + page - 1) & ~(page - 1);
+    void *base = mmap(NULL, reserve, PROT_READ, MAP_SHARED, kv->fd, 0);
+    if (base == MAP_FAILED) return false;
+    if (kv->map) file_mapping_release(kv->map);
+    kv->map = malloc(sizeof(FileMapping));
+    kv->map->refs = 1;
+    kv->map->base = base;
+    kv->map->size = reserve;
+    return true;
+}
+
+// Linear probing; returns the key's slot or the empty slot where it would go
+KvSlot *kv_find(KvStore *kv, const char *key, size_t len, uint64_t hash) {
+    size_t mask = kv->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        KvSlot *s = &kv->slots[i];
+        if (!s->offset) return s;
+        if (s->hash != hash) continue;
+        const KvRecord *r = kv_record_at(kv, s->offset);
+        if (r->key_len == len && memcmp(r + 1, key, len) == 0) return s;
+    }
+}
+
+void kv_grow(KvStore *kv) {
+    KvSlot *old = kv->slots;
+    size_t old_capacity = kv->capacity;
+    kv->capacity = old_capacity ? old_capacity * 2 : 1024;
+    kv->slots = calloc(kv->capacity, sizeof(KvSlot));
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old[i].offset) continue;
+        size_t j = old[i].hash & (kv->capacity - 1);
+        while (kv->slots[j].offset) j = (j + 1) & (kv->capacity - 1);
+        kv->slots[j] = old[i];
+    }
+    free(old);
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones
+void kv_remove_slot(KvStore *kv, KvSlot *s) {
+    size_t mask = kv->capacity - 1;
+    size_t hole = s - kv->slots;
+    for (size_t i = (hole + 1) & mask; kv->slots[i].offset; i = (i + 1) & mask) {
+        size_t home = kv->slots[i].hash & mask;
+        // Move the entry back unless its home lies cyclically in (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            kv->slots[hole] = kv->slots[i];
+            hole = i;
+        }
+    }
+    kv->slots[hole].offset = 0;
+    kv->count--;
+}
+
+// Points the index at the record at offset, which must already be mapped
+void kv_apply(KvStore *kv, uint64_t offset) {
+    const KvRecord *r = kv_record_at(kv, offset);
+    const char *key = (const char*)(r + 1);
+    uint64_t hash = kv_hash(key, r->key_len);
+    if ((kv->count + 1) * 2 > kv->capacity) kv_grow(kv);
+    KvSlot *s = kv_find(kv, key, r->key_len, hash);
+    if (s->offset) kv->dead += kv_record_size(kv_record_at(kv, s->offset));
+    if (r->flags & KV_DELETE) {
+        kv->dead += kv_record_size(r);
+        if (s->offset) kv_remove_slot(kv, s);
+        return;
+    }
+    if (!s->offset) kv->count++;
+    s->hash = hash;
+    s->offset = offset;
+}
+
+// Replays every committed transaction and cuts off a torn tail
+bool kv_recover(KvStore *kv, uint64_t file_size) {
+    if (!kv_remap(kv, file_size)) return false;
+    const char *base = kv->map->base;
+    uint64_t off = KV_MAGIC_LEN, committed = KV_MAGIC_LEN;
+    uint64_t *pending = NULL;
+    size_t pending_count = 0, pending_cap = 0;
+    while (file_size - off >= sizeof(KvRecord)) {
+        const KvRecord *r = (const KvRecord*)(base + off);
+        uint64_t rec_size = kv_record_size(r);
+        if (rec_size > file_size - off || kv_record_crc(r) != r->crc) break;
+        if (pending_count == pending_cap) {
+            pending_cap = pending_cap ? pending_cap * 2 : 64;
+            pending = realloc(pending, pending_cap * sizeof(uint64_t));
+        }
+        pending[pending_count++] = off;
+        off += rec_size;
+        if (r->flags & KV_COMMIT) {
+            for (size_t i = 0; i < pending_count; i++) kv_apply(kv, pending[i]);
+            pending_count = 0;
+            committed = off;
+        }
+    }
+    free(pending);
+    if (committed < file_size && ftruncate(kv->fd, committed) < 0) return false;
+    kv->size = committed;
+    return true;
+}
+
+void kv_retain(KvStore *kv) {
+    __atomic_add_fetch(&kv->refs, 1, __ATOMIC_RELAXED);
+}
+
+void kv_release(KvStore *kv) {
+    if (__atomic_sub_fetch(&kv->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (kv->fd >= 0) close(kv->fd);
+    if (kv->map) file_mapping_release(kv->map);
+    pthread_mutex_destroy(&kv->lock);
+    free(kv->slots);
+    free(kv->path);
+    free(kv);
+}
+
+// Drops the index and the file lock; values already read stay valid
+void kv_close(KvStore *kv) {
+    pthread_mutex_lock(&kv->lock);
+    if (kv->fd >= 0) {
+        // The mapping keeps the open file, and with it the lock, alive past close()
+        flock(kv->fd, LOCK_UN);
+        close(kv->fd);
+        kv->fd = -1;
     }
-    hex[length * 2] = 0;
-    
-    Value *v = create_value(VAL_STRING);
-    v->data.string = hex;
-    return v;
+    free(kv->slots);
+    kv->slots = NULL;
+    kv->capacity = kv->count = 0;
+    pthread_mutex_unlock(&kv->lock);
 }
 
-#ifdef HAVE_SDL2
-Value *graphics_create_window(const char *title, int width, int height, bool use_opengl) {
-    if (window_count >= MAX_WINDOWS) {
+// policy is "none" or "fdatasync" (every transaction is durable once it returns)
+Value *kv_open(const char *path, const char *policy) {
+    bool sync = strcmp(policy, "fdatasync") == 0;
+    if (!sync && strcmp(policy, "none") != 0) {
+        printf("Error: kv_open() policy must be \"none\" or \"fdatasync\", not \"%s\"\n", policy);
         return create_value(VAL_NULL);
     }
-    
-    static bool sdl_inited = false;
-    if (!sdl_inited) {
-        if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS) < 0) {
-            printf("SDL Error: %s\n", SDL_GetError());
-            return create_value(VAL_NULL);
-        }
-        sdl_inited = true;
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        printf("Error: Cannot open %s: %s\n", path, strerror(errno));
+        return create_value(VAL_NULL);
     }
-    
-    ZenithWindow *win = &windows[window_count++];
-    win->width = width;
-    win->height = height;
-    win->use_opengl = use_opengl;
-    win->running = true;
-    
-    Uint32 flags = SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE;
-    if (use_opengl) {
-        flags |= SDL_WINDOW_OPENGL;
-        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
-        SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+    // One writer per log; a second process would interleave transactions
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        printf("Error: kv_open() %s is in use by another process\n", path);
+        close(fd);
+        return create_value(VAL_NULL);
     }
-    
-    win->window = SDL_CreateWindow(title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-                                    width, height, flags);
-    
-    if (!win->window) {
-        printf("Window Error: %s\n", SDL_GetError());
+    struct stat st;
+    char magic[KV_MAGIC_LEN];
+    bool ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size == 0) {
+        ok = write_all(fd, KV_MAGIC, KV_MAGIC_LEN);
+        st.st_size = KV_MAGIC_LEN;
+    } else if (ok && (st.st_size < KV_MAGIC_LEN || pread(fd, magic, KV_MAGIC_LEN, 0) != KV_MAGIC_LEN ||
+                      memcmp(magic, KV_MAGIC, KV_MAGIC_LEN) != 0)) {
+        printf("Error: kv_open() %s is not a key-value log\n", path);
+        close(fd);
         return create_value(VAL_NULL);
     }
     
-    if (use_opengl) {
-        win->gl_context = SDL_GL_CreateContext(win->window);
-        if (!win->gl_context) {
-            printf("GL Context Error: %s\n", SDL_GetError());
-            SDL_DestroyWindow(win->window);
-            return create_value(VAL_NULL);
-        }
-        SDL_GL_MakeCurrent(win->window, win->gl_context);
-        glViewport(0, 0, width, height);
-        glMatrixMode(GL_PROJECTION);
-        glLoadIdentity();
-        glOrtho(0, width, height, 0, -1, 1);
-        glMatrixMode(GL_MODELVIEW);
-        glLoadIdentity();
-    } else {
-        win->renderer = SDL_CreateRenderer(win->window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-        if (!win->renderer) {
-            printf("Renderer Error: %s\n", SDL_GetError());
-            SDL_DestroyWindow(win->window);
-            return create_value(VAL_NULL);
-        }
-        SDL_SetRenderDrawBlendMode(win->renderer, SDL_BLENDMODE_BLEND);
+    KvStore *kv = calloc(1, sizeof(KvStore));
+    kv->refs = 1;
+    kv->fd = fd;
+    kv->path = strdup(path);
+    kv->sync = sync;
+    pthread_mutex_init(&kv->lock, NULL);
+    kv_grow(kv);
+    if (!ok || !kv_recover(kv, st.st_size)) {
+        printf("Error: kv_open() cannot load %s: %s\n", path, strerror(errno));
+        kv_release(kv);
+        return create_value(VAL_NULL);
     }
-    
-    Value *v = create_value(VAL_WINDOW);
-    v->data.window = win;
+    Value *v = create_value(VAL_KV);
+    v->data.kv = kv;
     return v;
 }
 
-void graphics_poll_events(ZenithWindow *win) {
-    while (SDL_PollEvent(&win->event)) {
-        if (win->event.type == SDL_QUIT) {
-            win->running = false;
+Value *kv_get(KvStore *kv, const char *key, size_t len) {
+    pthread_mutex_lock(&kv->lock);
+    Value *v = NULL;
+    if (kv->slots) {
+        KvSlot *s = kv_find(kv, key, len, kv_hash(key, len));
+        if (s->offset) {
+            const KvRecord *r = kv_record_at(kv, s->offset);
+            char *data = (char*)(r + 1) + r->key_len + 1;
+            __atomic_add_fetch(&kv->map->refs, 1, __ATOMIC_RELAXED);
+            v = create_value(r->flags & KV_BINARY ? VAL_BYTES : VAL_STRING);
+            v->mapping = kv->map;
+            if (r->flags & KV_BINARY) {
+                v->data.bytes.data = (unsigned char*)data;
+                v->data.bytes.len = r->value_len;
+            } else {
+                v->data.string = data;
+            }
         }
     }
+    pthread_mutex_unlock(&kv->lock);
+    return v ? v : create_value(VAL_NULL);
 }
 
-void graphics_draw_rect(ZenithWindow *win, int x, int y, int w, int h, int r, int g, int b, int a) {
-    if (!win || !win->running) return;
-    
-    if (win->use_opengl) {
-        glColor4ub(r, g, b, a);
-        glBegin(GL_QUADS);
-        glVertex2i(x, y);
-        glVertex2i(x + w, y);
-        glVertex2i(x + w, y + h);
-        glVertex2i(x, y + h);
-        glEnd();
-    } else {
-        SDL_SetRenderDrawColor(win->renderer, r, g, b, a);
-        SDL_Rect rect = {x, y, w, h};
-        SDL_RenderFillRect(win->renderer, &rect);
+void kv_encode(char **buf, size_t *len, size_t *cap, const char *key, size_t key_len,
+               const char *value, size_t value_len, uint32_t flags) {
+    size_t need = kv_padded_size(key_len, value_len);
+    if (*len + need > *cap) {
+        *cap = (*len + need) * 2;
+        *buf = realloc(*buf, *cap);
     }
+    KvRecord *r = (KvRecord*)(*buf + *len);
+    memset((char*)r + need - _Alignof(KvRecord), 0, _Alignof(KvRecord));
+    r->key_len = key_len;
+    r->value_len = value_len;
+    r->flags = flags;
+    char *p = (char*)(r + 1);
+    memcpy(p, key, key_len);
+    p[key_len] = 0;
+    memcpy(p + key_len + 1, value, value_len);
+    p[key_len + 1 + value_len] = 0;
+    r->crc = kv_record_crc(r);
+    *len += need;
 }
 
-void graphics_draw_circle(ZenithWindow *win, int cx, int cy, int radius, int r, int g, int b, int a) {
-    if (!win || !win->running || !win->renderer) return;
-    
-    SDL_SetRenderDrawColor(win->renderer, r, g, b, a);
+// Writes count puts (or deletes, for NULL values) as one transaction:
+// after a crash either all of them are replayed or none
+bool kv_write(KvStore *kv, Value **keys, Value **values, int count) {
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    for (int i = 0; i < count; i++) {
+        size_t key_len, value_len = 0;
+        char *key_owned, *value_owned = NULL;
+        const char *key = value_data(keys[i], &key_len, &key_owned);
+        const char *value = "";
+        uint32_t flags = KV_DELETE;
+        if (values[i] && values[i]->type != VAL_NULL) {
+            value = value_data(values[i], &value_len, &value_owned);
+            flags = values[i]->type == VAL_BYTES ? KV_BINARY : 0;
+        }
+        if (key_len > UINT32_MAX || value_len > UINT32_MAX) {
+            printf("Error: kv_put() keys and values are limited to 4 GB\n");
+            free(key_owned); free(value_owned); free(buf);
+            return false;
+        }
+        if (i == count - 1) flags |= KV_COMMIT;
+        kv_encode(&buf, &len, &cap, key, key_len, value, value_len, flags);
+        free(key_owned); free(value_owned);
+    }
     
-    for (int w = 0; w < radius * 2; w++) {
-        for (int h = 0; h < radius * 2; h++) {
-            int dx = radius - w;
-            int dy = radius - h;
-            if ((dx*dx + dy*dy) <= (radius * radius)) {
-                SDL_RenderDrawPoint(win->renderer, cx + dx, cy + dy);
-            }
+    pthread_mutex_lock(&kv->lock);
+    bool ok = kv->fd >= 0;
+    if (!ok) errno = EBADF;
+    if (ok && len) {
+        ok = write_all(kv->fd, buf, len) && (!kv->sync || fdatasync(kv->fd) == 0);
+        // Never leave half a transaction behind for the next append to follow
+        if (!ok) {
+            int saved = errno;
+            if (ftruncate(kv->fd, kv->size) < 0) { /* replay will drop it */ }
+            errno = saved;
+        }
+    }
+    if (ok && len && kv_remap(kv, kv->size + len)) {
+        for (size_t off = 0; off < len; ) {
+            const KvRecord *r = (const KvRecord*)(buf + off);
+            kv_apply(kv, kv->size + off);
+            off += kv_record_size(r);
         }
+        kv->size += len;
+    } else if (ok && len) {
+        // Unmapped records can't be indexed; drop them so kv->size stays the
+        // end of the log, or at least step over them if they can't be cut off
+        int saved = errno;
+        if (ftruncate(kv->fd, kv->size) < 0) kv->size += len;
+        errno = saved;
+        ok = false;
     }
+    pthread_mutex_unlock(&kv->lock);
+    free(buf);
+    return ok;
 }
 
-void graphics_clear(ZenithWindow *win, int r, int g, int b) {
-    if (!win || !win->running) return;
+// Rewrites the log with only the live records and swaps it in atomically.
+// Returns the bytes reclaimed, or -1 on failure.
+int64_t kv_compact(KvStore *kv) {
+    pthread_mutex_lock(&kv->lock);
+    if (kv->fd < 0 || kv->dead == 0) {
+        pthread_mutex_unlock(&kv->lock);
+        errno = EBADF;
+        return kv->fd < 0 ? -1 : 0;
+    }
+    size_t tmp_len = strlen(kv->path) + 10;
+    char *tmp = malloc(tmp_len);
+    snprintf(tmp, tmp_len, "%s.compact", kv->path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    bool ok = fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0 && write_all(fd, KV_MAGIC, KV_MAGIC_LEN);
     
-    if (win->use_opengl) {
-        glClearColor(r/255.0f, g/255.0f, b/255.0f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT);
-    } else {
-        SDL_SetRenderDrawColor(win->renderer, r, g, b, 255);
-        SDL_RenderClear(win->renderer);
+    // Each live record is copied as its own committed transaction
+    uint64_t *offsets = malloc((kv->capacity + 1) * sizeof(uint64_t));
+    uint64_t size = KV_MAGIC_LEN;
+    size_t cap = 1 << 20, len = 0;
+    char *buf = malloc(cap);
+    for (size_t i = 0; ok && i < kv->capacity; i++) {
+        if (!kv->slots[i].offset) continue;
+        const KvRecord *r = kv_record_at(kv, kv->slots[i].offset);
+        const char *key = (const char*)(r + 1);
+        offsets[i] = size + len;
+        kv_encode(&buf, &len, &cap, key, r->key_len, key + r->key_len + 1, r->value_len,
+                  (r->flags & KV_BINARY) | KV_COMMIT);
+        if (len >= (1 << 20)) {
+            ok = write_all(fd, buf, len);
+            size += len;
+            len = 0;
+        }
+    }
+    if (ok && len) {
+        ok = write_all(fd, buf, len);
+        size += len;
+    }
+    free(buf);
+    ok = ok && fdatasync(fd) == 0;
+    
+    // Map the new log before it replaces the old one so a failure changes nothing
+    int old_fd = kv->fd;
+    FileMapping *old_map = kv->map;
+    if (ok) {
+        kv->fd = fd;
+        kv->map = NULL;
+        ok = kv_remap(kv, size);
+        if (ok && rename(tmp, kv->path) != 0) {
+            file_mapping_release(kv->map);
+            ok = false;
+        }
+        if (!ok) {
+            kv->fd = old_fd;
+            kv->map = old_map;
+        }
     }
+    int64_t reclaimed = -1;
+    if (ok) {
+        for (size_t i = 0; i < kv->capacity; i++) {
+            if (kv->slots[i].offset) kv->slots[i].offset = offsets[i];
+        }
+        reclaimed = kv->size - size;
+        kv->size = size;
+        kv->dead = 0;
+        close(old_fd);
+        // Values read earlier still hold the old mapping
+        file_mapping_release(old_map);
+    } else if (fd >= 0) {
+        int saved = errno;
+        unlink(tmp);
+        close(fd);
+        errno = saved;
+    }
+    free(offsets);
+    free(tmp);
+    pthread_mutex_unlock(&kv->lock);
+    return reclaimed;
 }
 
-void graphics_present(ZenithWindow *win) {
-    if (!win || !win->running) return;
-    
-    graphics_poll_events(win);
-    
-    if (win->use_opengl) {
-        SDL_GL_SwapWindow(win->window);
-    } else {
-        SDL_RenderPresent(win->renderer);
+Value *kv_keys(KvStore *kv) {
+    Value *result = create_value(VAL_ARRAY);
+    pthread_mutex_lock(&kv->lock);
+    for (size_t i = 0; i < kv->capacity; i++) {
+        if (!kv->slots[i].offset) continue;
+        const KvRecord *r = kv_record_at(kv, kv->slots[i].offset);
+        array_push(result, make_string_or_bytes((const char*)(r + 1), r->key_len));
     }
-    
-    SDL_Delay(16);
+    pthread_mutex_unlock(&kv->lock);
+    return result;
 }
-#endif
 
-const char* get_mime_type(const char *path) {
-    const char *ext = strrchr(path, '.');
-    if (!ext) return "application/octet-stream";
-    
-    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0) return "text/html";
-    if (strcmp(ext, ".css") == 0) return "text/css";
-    if (strcmp(ext, ".js") == 0) return "application/javascript";
-    if (strcmp(ext, ".json") == 0) return "application/json";
-    if (strcmp(ext, ".png") == 0) return "image/png";
-    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0) return "image/jpeg";
-    if (strcmp(ext, ".gif") == 0) return "image/gif";
-    if (strcmp(ext, ".svg") == 0) return "image/svg+xml";
-    if (strcmp(ext, ".ico") == 0) return "image/x-icon";
-    if (strcmp(ext, ".txt") == 0) return "text/plain";
-    if (strcmp(ext, ".pdf") == 0) return "application/pdf";
-    if (strcmp(ext, ".zip") == 0) return "application/zip";
-    
-    return "application/octet-stream";
+// async/await. "async read(...)", "async write(...)", "async append(...)" and
+// calls to async functions queue a job on the I/O pool and return a promise
+// at once; await blocks until it settles. The pool grows a thread whenever
+// more jobs are queued than threads are idle, up to ASYNC_POOL_MAX_THREADS,
+// so hundreds of blocking reads can be in flight together. An async function
+// body runs on a pool thread against a copy of the caller's variables.
+#define ASYNC_POOL_MAX_THREADS 256
+
+typedef enum { ASYNC_READ, ASYNC_WRITE, ASYNC_APPEND, ASYNC_CALL } AsyncKind;
+
+typedef struct AsyncJob {
+    AsyncKind kind;
+    Promise *promise;
+    Value *target;
+    Value *content;
+    Function *func;
+    Value **args;
+    int arg_count;
+    Variable *vars;
+    int var_count;
+    struct AsyncJob *next;
+} AsyncJob;
+
+typedef struct {
+    AsyncJob *head;
+    AsyncJob *tail;
+    int queued;
+    int pending;
+    int threads;
+    int idle;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t drained;
+} AsyncPool;
+
+AsyncPool async_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER,
+                         .drained = PTHREAD_COND_INITIALIZER };
+
+void promise_release(Promise *p) {
+    if (__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (p->result) free_value(p->result);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->settled);
+    free(p);
 }
 
-void *http_server_thread(void *arg) {
-    int server_fd, client_fd;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-    
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        return NULL;
-    }
-    
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(http_server.port);
-    
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        close(server_fd);
-        return NULL;
+void promise_settle(Promise *p, Value *result) {
+    pthread_mutex_lock(&p->lock);
+    p->result = result;
+    p->done = true;
+    pthread_cond_broadcast(&p->settled);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Returns a copy of the result, waiting for it if the job is still running
+Value *promise_await(Promise *p) {
+    pthread_mutex_lock(&p->lock);
+    while (!p->done) pthread_cond_wait(&p->settled, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+    return copy_value(p->result);
+}
+
+Value *async_job_run(AsyncJob *job) {
+    if (job->kind == ASYNC_READ) {
+        char *fname = value_to_string(job->target);
+        Value *content = file_read(fname, job->content->type == VAL_STRING &&
+                                          strcmp(job->content->data.string, "bytes") == 0);
+        free(fname);
+        return content;
     }
-    
-    if (listen(server_fd, 10) < 0) {
-        close(server_fd);
-        return NULL;
+    if (job->kind == ASYNC_WRITE || job->kind == ASYNC_APPEND) {
+        file_write_value(job->target, job->content, job->kind == ASYNC_APPEND);
+        return create_value(VAL_NULL);
     }
     
-    printf("🚀 HTTP Server running on http://localhost:%d\n", http_server.port);
-    printf("📁 Serving files from: %s\n", http_server.root_dir);
-    
-    while (http_server.running) {
-        if ((client_fd = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-            continue;
-        }
-        
-        char buffer[8192] = {0};
-        read(client_fd, buffer, 8192);
-        
-        char method[16], path[1024], protocol[16];
-        sscanf(buffer, "%s %s %s", method, path, protocol);
-        
-        if (strcmp(path, "/") == 0) {
-            strcpy(path, "/index.html");
+    // The copied variables become this thread's whole context for the call
+    for (int i = 0; i < job->var_count; i++) vars[i] = job->vars[i];
+    var_count = job->var_count;
+    current_scope = 0;
+    return_val = NULL;
+    is_returning = false;
+    Value *ret = call_function(job->func, job->args, job->arg_count, false);
+    interpreter_context_free();
+    free(job->vars);
+    return ret;
+}
+
+void async_job_finish(AsyncJob *job) {
+    promise_settle(job->promise, async_job_run(job));
+    promise_release(job->promise);
+    if (job->target) free_value(job->target);
+    if (job->content) free_value(job->content);
+    for (int i = 0; i < job->arg_count; i++) free_value(job->args[i]);
+    free(job->args);
+    free(job);
+}
+
+void *async_pool_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&async_pool.lock);
+    for (;;) {
+        while (!async_pool.head) {
+            async_pool.idle++;
+            pthread_cond_wait(&async_pool.ready, &async_pool.lock);
+            async_pool.idle--;
         }
+        AsyncJob *job = async_pool.head;
+        async_pool.head = job->next;
+        if (!async_pool.head) async_pool.tail = NULL;
+        async_pool.queued--;
+        pthread_mutex_unlock(&async_pool.lock);
         
-        char filepath[2048];
-        snprintf(filepath, 2048, "%s%s", http_server.root_dir, path);
-        
-        FILE *file = fopen(filepath, "rb");
-        if (file) {
-            fseek(file, 0, SEEK_END);
-            long fsize = ftell(file);
-            fseek(file, 0, SEEK_SET);
-            
-            char *content = malloc(fsize + 1);
-            fread(content, 1, fsize, file);
-            fclose(file);
-            
-            const char *mime = get_mime_type(filepath);
-            
-            char response[8192];
-            int header_len = snprintf(response, 8192,
-                "HTTP/1.1 200 OK\r\n"
-                "Content-Type: %s\r\n"
-                "Content-Length: %ld\r\n"
-                "Access-Control-Allow-Origin: *\r\n"
-                "Connection: close\r\n\r\n", mime, fsize);
-            
-            write(client_fd, response, header_len);
-            write(client_fd, content, fsize);
-            free(content);
-        } else {
-            char *not_found = 
-                "HTTP/1.1 404 Not Found\r\n"
-                "Content-Type: text/html\r\n\r\n"
-                "<html><body><h1>404 Not Found</h1></body></html>";
-            write(client_fd, not_found, strlen(not_found));
-        }
+        async_job_finish(job);
         
-        close(client_fd);
+        pthread_mutex_lock(&async_pool.lock);
+        if (--async_pool.pending == 0) pthread_cond_broadcast(&async_pool.drained);
     }
-    
-    close(server_fd);
     return NULL;
 }
 
-Value *file_read(const char *filename) {
-    FILE *f = fopen(filename, "r");
-    if (!f) {
-        Value *v = create_value(VAL_STRING);
-        v->data.string = strdup("");
-        return v;
-    }
+// Queues the job and hands back the promise it will settle
+Value *async_submit(AsyncJob *job) {
+    Promise *p = calloc(1, sizeof(Promise));
+    p->refs = 2; // the returned value and the job
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->settled, NULL);
+    job->promise = p;
     
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    pthread_mutex_lock(&async_pool.lock);
+    if (async_pool.tail) async_pool.tail->next = job;
+    else async_pool.head = job;
+    async_pool.tail = job;
+    async_pool.queued++;
+    async_pool.pending++;
+    if (async_pool.queued > async_pool.idle && async_pool.threads < ASYNC_POOL_MAX_THREADS) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, async_pool_thread, NULL) == 0) async_pool.threads++;
+        pthread_attr_destroy(&attr);
+    }
+    pthread_cond_signal(&async_pool.ready);
+    pthread_mutex_unlock(&async_pool.lock);
     
-    char *buffer = malloc(size + 1);
-    fread(buffer, 1, size, f);
-    buffer[size] = 0;
-    fclose(f);
+    if (async_pool.threads == 0) {
+        // No thread could be started: run it here so await still returns
+        pthread_mutex_lock(&async_pool.lock);
+        AsyncJob *head = async_pool.head;
+        async_pool.head = NULL;
+        async_pool.tail = NULL;
+        async_pool.queued = 0;
+        async_pool.pending = 0;
+        pthread_mutex_unlock(&async_pool.lock);
+        while (head) {
+            AsyncJob *next = head->next;
+            async_job_finish(head);
+            head = next;
+        }
+    }
     
-    Value *v = create_value(VAL_STRING);
-    v->data.string = buffer;
+    Value *v = create_value(VAL_PROMISE);
+    v->data.promise = p;
     return v;
 }
 
-void file_write(const char *filename, const char *content) {
-    FILE *f = fopen(filename, "w");
-    if (f) {
-        fprintf(f, "%s", content);
-        fclose(f);
+// Runs func on the pool; args are taken over by the job
+Value *async_call(Function *func, Value **args, int arg_count) {
+    AsyncJob *job = calloc(1, sizeof(AsyncJob));
+    job->kind = ASYNC_CALL;
+    job->func = func;
+    job->args = args;
+    job->arg_count = arg_count;
+    job->vars = malloc((var_count > 0 ? var_count : 1) * sizeof(Variable));
+    for (int i = 0; i < var_count; i++) {
+        job->vars[i] = vars[i];
+        job->vars[i].name = strdup_safe(vars[i].name);
+        job->vars[i].value = copy_value(vars[i].value);
     }
+    job->var_count = var_count;
+    return async_submit(job);
+}
+
+// Lets fire-and-forget writes finish before the script exits
+void async_pool_wait(void) {
+    pthread_mutex_lock(&async_pool.lock);
+    while (async_pool.pending > 0) pthread_cond_wait(&async_pool.drained, &async_pool.lock);
+    pthread_mutex_unlock(&async_pool.lock);
 }
 
 bool file_exists(const char *filename) {
@@ -726,6 +8821,13 @@ Module *load_module(const char *name) {
     return mod;
 }
 
+// Builtins whose names are also common variable names only become keywords
+// when they are called, so `let text = ...` keeps working.
+static int followed_by_call(const char *p) {
+    while (*p == ' ' || *p == '\t') p++;
+    return *p == '(';
+}
+
 Token *tokenize(char *line, int *count) {
     Token *tokens = malloc(MAX_TOKENS * sizeof(Token));
     *count = 0;
@@ -806,14 +8908,49 @@ Token *tokenize(char *line, int *count) {
             else if (strcmp(tok->value, "export") == 0) tok->type = TOK_EXPORT;
             else if (strcmp(tok->value, "module") == 0) tok->type = TOK_MODULE;
             else if (strcmp(tok->value, "server") == 0) tok->type = TOK_SERVER;
+            else if (strcmp(tok->value, "route") == 0 && followed_by_call(p)) tok->type = TOK_ROUTE;
+            else if (strcmp(tok->value, "websocket") == 0 && followed_by_call(p)) tok->type = TOK_WEBSOCKET;
+            else if (strcmp(tok->value, "broadcast") == 0 && followed_by_call(p)) tok->type = TOK_BROADCAST;
+            else if (strcmp(tok->value, "subscribe") == 0 && followed_by_call(p)) tok->type = TOK_SUBSCRIBE;
             else if (strcmp(tok->value, "start") == 0) tok->type = TOK_START;
             else if (strcmp(tok->value, "stop") == 0) tok->type = TOK_STOP;
+            // Only "start http-server" uses it; anywhere else it is a plain name
+            else if (strcmp(tok->value, "http") == 0 && *count > 0 && tokens[*count - 1].type == TOK_START) tok->type = TOK_HTTP;
             else if (strcmp(tok->value, "read") == 0) tok->type = TOK_READ;
             else if (strcmp(tok->value, "write") == 0) tok->type = TOK_WRITE;
             else if (strcmp(tok->value, "delete") == 0) tok->type = TOK_DELETE;
             else if (strcmp(tok->value, "exists") == 0) tok->type = TOK_EXISTS;
             else if (strcmp(tok->value, "mkdir") == 0) tok->type = TOK_MKDIR;
             else if (strcmp(tok->value, "length") == 0) tok->type = TOK_LENGTH;
+            else if (strcmp(tok->value, "lines") == 0 && followed_by_call(p)) tok->type = TOK_LINES;
+            else if (strcmp(tok->value, "open") == 0 && followed_by_call(p)) tok->type = TOK_OPEN;
+            else if (strcmp(tok->value, "append") == 0 && followed_by_call(p)) tok->type = TOK_APPEND;
+            else if (strcmp(tok->value, "flush") == 0 && followed_by_call(p)) tok->type = TOK_FLUSH;
+            else if (strcmp(tok->value, "walk") == 0 && followed_by_call(p)) tok->type = TOK_WALK;
+            else if (strcmp(tok->value, "bytes") == 0 && followed_by_call(p)) tok->type = TOK_BYTES;
+            else if (strcmp(tok->value, "text") == 0 && followed_by_call(p)) tok->type = TOK_TEXT;
+            else if (strcmp(tok->value, "json_parse") == 0) tok->type = TOK_JSON_PARSE;
+            else if (strcmp(tok->value, "json_stringify") == 0) tok->type = TOK_JSON_STRINGIFY;
+            else if (strcmp(tok->value, "csv_read") == 0) tok->type = TOK_CSV_READ;
+            else if (strcmp(tok->value, "kv_open") == 0) tok->type = TOK_KV_OPEN;
+            else if (strcmp(tok->value, "kv_get") == 0) tok->type = TOK_KV_GET;
+            else if (strcmp(tok->value, "kv_put") == 0) tok->type = TOK_KV_PUT;
+            else if (strcmp(tok->value, "kv_delete") == 0) tok->type = TOK_KV_DELETE;
+            else if (strcmp(tok->value, "kv_keys") == 0) tok->type = TOK_KV_KEYS;
+            else if (strcmp(tok->value, "kv_compact") == 0) tok->type = TOK_KV_COMPACT;
+            else if (strcmp(tok->value, "hash_init") == 0) tok->type = TOK_HASH_INIT;
+            else if (strcmp(tok->value, "hash_update") == 0) tok->type = TOK_HASH_UPDATE;
+            else if (strcmp(tok->value, "hash_final") == 0) tok->type = TOK_HASH_FINAL;
+            else if (strcmp(tok->value, "hash_file") == 0) tok->type = TOK_HASH_FILE;
+            else if (strcmp(tok->value, "hmac") == 0 && followed_by_call(p)) tok->type = TOK_HMAC;
+            else if (strcmp(tok->value, "cipher_key") == 0) tok->type = TOK_CIPHER_KEY;
+            else if (strcmp(tok->value, "cipher_encrypt") == 0) tok->type = TOK_CIPHER_ENCRYPT;
+            else if (strcmp(tok->value, "cipher_decrypt") == 0) tok->type = TOK_CIPHER_DECRYPT;
+            else if (strcmp(tok->value, "hex_encode") == 0) tok->type = TOK_HEX_ENCODE;
+            else if (strcmp(tok->value, "hex_decode") == 0) tok->type = TOK_HEX_DECODE;
+            else if (strcmp(tok->value, "base64_encode") == 0) tok->type = TOK_BASE64_ENCODE;
+            else if (strcmp(tok->value, "base64_decode") == 0) tok->type = TOK_BASE64_DECODE;
+            else if (strcmp(tok->value, "close") == 0 && followed_by_call(p)) tok->type = TOK_CLOSE;
             else if (strcmp(tok->value, "push") == 0) tok->type = TOK_PUSH;
             else if (strcmp(tok->value, "pop") == 0) tok->type = TOK_POP;
             else if (strcmp(tok->value, "window") == 0) tok->type = TOK_WINDOW;
@@ -1011,11 +9148,165 @@ Value *compare_operation(Value *left, Value *right, TokenType op) {
             case TOK_NEQEQ: result->data.boolean = (cmp != 0); break;
             default: result->data.boolean = false;
         }
+    } else if (left->type == VAL_BYTES && right->type == VAL_BYTES &&
+               (op == TOK_EQEQ || op == TOK_EQEQEQ || op == TOK_NEQ || op == TOK_NEQEQ)) {
+        bool same = left->data.bytes.len == right->data.bytes.len &&
+                    memcmp(left->data.bytes.data, right->data.bytes.data, left->data.bytes.len) == 0;
+        result->data.boolean = (op == TOK_EQEQ || op == TOK_EQEQEQ) ? same : !same;
+    } else if (op == TOK_EQEQ || op == TOK_EQEQEQ || op == TOK_NEQ || op == TOK_NEQEQ) {
+        // null and booleans compare by value; any other mix of types is unequal
+        bool same = left->type == right->type &&
+                    (left->type == VAL_NULL || left->type == VAL_UNDEFINED ||
+                     (left->type == VAL_BOOL && left->data.boolean == right->data.boolean));
+        result->data.boolean = (op == TOK_EQEQ || op == TOK_EQEQEQ) ? same : !same;
+    }
+    return result;
+}
+
+Value *eval_expr(Token *tokens, int tok_count, int *tok_idx);
+
+// Parses "a, b, c)" after the opening paren of a call
+Value **parse_call_args(Token *tokens, int tok_count, int *tok_idx, int *arg_count) {
+    Value **args = malloc(16 * sizeof(Value*));
+    int arg_cap = 16;
+    *arg_count = 0;
+    
+    while (*tok_idx < tok_count && tokens[*tok_idx].type != TOK_RPAREN) {
+        if (*arg_count >= arg_cap) {
+            arg_cap *= 2;
+            args = realloc(args, arg_cap * sizeof(Value*));
+        }
+        args[(*arg_count)++] = eval_expr(tokens, tok_count, tok_idx);
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_COMMA) (*tok_idx)++;
+    }
+    if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_RPAREN) (*tok_idx)++;
+    return args;
+}
+
+// Runs func with args bound to its params. With write_back set, the final value
+// of each param replaces its arg so callers can observe in-place changes.
+Value *call_function(Function *func, Value **args, int arg_count, bool write_back) {
+    // Save state
+    Value *old_ret = return_val;
+    bool old_is_ret = is_returning;
+    int old_scope = current_scope;
+    int old_var_count = var_count;
+    
+    // Setup new call
+    return_val = NULL;
+    is_returning = false;
+    current_scope++; // Simple scope increment
+    
+    // Bind params as fresh locals so they shadow globals of the same name
+    int bound = 0;
+    for (int i = 0; i < func->param_count && i < arg_count && var_count < MAX_VARS; i++) {
+        vars[var_count].name = strdup_safe(func->params[i]);
+        vars[var_count].value = copy_value(args[i]);
+        vars[var_count].is_const = false;
+        vars[var_count].scope = current_scope;
+        var_count++;
+        bound++;
+    }
+    
+    // Execute body
+    int f_idx = 0;
+    execute_block(func->body_tokens, func->body_token_count, &f_idx);
+    
+    // Get result
+    Value *ret = return_val ? return_val : create_value(VAL_NULL);
+    
+    if (write_back) {
+        for (int i = 0; i < bound; i++) {
+            free_value(args[i]);
+            args[i] = copy_value(vars[old_var_count + i].value);
+        }
+    }
+    
+    // Pop stack vars
+    while (var_count > old_var_count) {
+        var_count--;
+        free(vars[var_count].name);
+        free_value(vars[var_count].value);
+    }
+    
+    // Restore state
+    return_val = old_ret;
+    is_returning = old_is_ret;
+    current_scope = old_scope;
+    
+    return ret;
+}
+
+// Applies an operator that follows an already evaluated operand; takes ownership of left
+Value *apply_binary_tail(Value *left, Token *tokens, int tok_count, int *tok_idx) {
+    if (*tok_idx >= tok_count) return left;
+    TokenType op = tokens[*tok_idx].type;
+    
+    if (op == TOK_PLUS) {
+        (*tok_idx)++;
+        Value *right = eval_expr(tokens, tok_count, tok_idx);
+        // Joining onto bytes keeps the result binary-safe
+        if (left->type == VAL_BYTES || right->type == VAL_BYTES) {
+            size_t left_len, right_len;
+            char *left_owned, *right_owned;
+            const char *l = value_data(left, &left_len, &left_owned);
+            const char *r = value_data(right, &right_len, &right_owned);
+            Value *joined = create_value(VAL_BYTES);
+            joined->data.bytes.len = left_len + right_len;
+            joined->data.bytes.data = malloc(joined->data.bytes.len ? joined->data.bytes.len : 1);
+            memcpy(joined->data.bytes.data, l, left_len);
+            memcpy(joined->data.bytes.data + left_len, r, right_len);
+            free(left_owned);
+            free(right_owned);
+            free_value(left);
+            free_value(right);
+            return joined;
+        }
+        if (left->type != VAL_STRING && right->type != VAL_STRING) {
+            Value *sum = math_operation(left, right, op);
+            free_value(left);
+            free_value(right);
+            return sum;
+        }
+        char *left_str = value_to_string(left);
+        char *right_str = value_to_string(right);
+        Value *joined = create_value(VAL_STRING);
+        joined->data.string = malloc(strlen(left_str) + strlen(right_str) + 1);
+        sprintf(joined->data.string, "%s%s", left_str, right_str);
+        free(left_str);
+        free(right_str);
+        free_value(left);
+        free_value(right);
+        return joined;
     }
+    
+    // Comparisons sit inside the arithmetic token range, so test them first
+    Value *result = NULL;
+    if (op >= TOK_EQEQ && op <= TOK_GTE) {
+        (*tok_idx)++;
+        Value *right = eval_expr(tokens, tok_count, tok_idx);
+        result = compare_operation(left, right, op);
+        free_value(right);
+    } else if (op >= TOK_PLUS && op <= TOK_RSHIFT && op != TOK_EQ) {
+        (*tok_idx)++;
+        Value *right = eval_expr(tokens, tok_count, tok_idx);
+        result = math_operation(left, right, op);
+        free_value(right);
+    } else {
+        return left;
+    }
+    free_value(left);
     return result;
 }
 
+Value *eval_primary(Token *tokens, int tok_count, int *tok_idx);
+
 Value *eval_expr(Token *tokens, int tok_count, int *tok_idx) {
+    Value *v = eval_primary(tokens, tok_count, tok_idx);
+    return apply_binary_tail(v, tokens, tok_count, tok_idx);
+}
+
+Value *eval_primary(Token *tokens, int tok_count, int *tok_idx) {
     if (*tok_idx >= tok_count) return create_value(VAL_NULL);
     
     Token *tok = &tokens[*tok_idx];
@@ -1025,25 +9316,7 @@ Value *eval_expr(Token *tokens, int tok_count, int *tok_idx) {
         Value *v = create_value(VAL_NUMBER);
         v->data.number = atof(tok->value);
         
-        if (*tok_idx < tok_count) {
-            Token *op = &tokens[*tok_idx];
-            if (op->type >= TOK_PLUS && op->type <= TOK_RSHIFT) {
-                (*tok_idx)++;
-                Value *right = eval_expr(tokens, tok_count, tok_idx);
-                Value *result = math_operation(v, right, op->type);
-                free_value(v);
-                free_value(right);
-                return result;
-            } else if (op->type >= TOK_EQEQ && op->type <= TOK_GTE) {
-                (*tok_idx)++;
-                Value *right = eval_expr(tokens, tok_count, tok_idx);
-                Value *result = compare_operation(v, right, op->type);
-                free_value(v);
-                free_value(right);
-                return result;
-            }
-        }
-        return v;
+        return apply_binary_tail(v, tokens, tok_count, tok_idx);
     }
     
     if (tok->type == TOK_STRING) {
@@ -1099,64 +9372,14 @@ Value *eval_expr(Token *tokens, int tok_count, int *tok_idx) {
             Function *func = find_function(var_name);
             if (func) {
                 (*tok_idx)++; // Skip '('
-                 
-                 // Create args
-                 Value **args = malloc(16 * sizeof(Value*));
-                 int arg_count = 0;
-                 int arg_cap = 16;
-                 
-                 while (*tok_idx < tok_count && tokens[*tok_idx].type != TOK_RPAREN) {
-                     if (arg_count >= arg_cap) {
-                         arg_cap *= 2;
-                         args = realloc(args, arg_cap * sizeof(Value*));
-                     }
-                     args[arg_count++] = eval_expr(tokens, tok_count, tok_idx);
-                     if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_COMMA) (*tok_idx)++;
-                 }
-                 if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_RPAREN) (*tok_idx)++;
-                 
-                 // Save state
-                 Value *old_ret = return_val;
-                 bool old_is_ret = is_returning;
-                 int old_scope = current_scope;
-                 int old_var_count = var_count;
-                 
-                 // Setup new call
-                 return_val = NULL;
-                 is_returning = false;
-                 current_scope++; // Simple scope increment
-                 
-                 // Bind params
-                 for (int i = 0; i < func->param_count; i++) {
-                     if (i < arg_count) {
-                         set_var(func->params[i], args[i], false);
-                     }
-                 }
-                 
-                 // Execute body
-                 int f_idx = 0;
-                 execute_block(func->body_tokens, func->body_token_count, &f_idx);
-                 
-                 // Get result
-                 Value *ret = return_val ? return_val : create_value(VAL_NULL);
-                 
-                 // Cleanup args
-                 for(int i=0; i<arg_count; i++) free_value(args[i]);
-                 free(args);
-
-                 // Pop stack vars
-                 while (var_count > old_var_count) {
-                    var_count--;
-                    free(vars[var_count].name);
-                    free_value(vars[var_count].value);
-                 }
-                 
-                 // Restore state
-                 return_val = old_ret;
-                 is_returning = old_is_ret;
-                 current_scope = old_scope;
-                 
-                 return ret;
+                int arg_count;
+                Value **args = parse_call_args(tokens, tok_count, tok_idx, &arg_count);
+                if (func->is_async) return async_call(func, args, arg_count);
+                Value *ret = call_function(func, args, arg_count, false);
+                
+                for (int i = 0; i < arg_count; i++) free_value(args[i]);
+                free(args);
+                return ret;
             }
         }
         
@@ -1185,41 +9408,51 @@ Value *eval_expr(Token *tokens, int tok_count, int *tok_idx) {
                 Token *op = &tokens[*tok_idx];
                 
                 if (op->type >= TOK_PLUS && op->type <= TOK_RSHIFT) {
-                    (*tok_idx)++;
-                    Value *right = eval_expr(tokens, tok_count, tok_idx);
-                    Value *result = math_operation(var, right, op->type);
-                    free_value(right);
-                    return result;
-                }
-                
-                if (op->type >= TOK_EQEQ && op->type <= TOK_GTE) {
-                    (*tok_idx)++;
-                    Value *right = eval_expr(tokens, tok_count, tok_idx);
-                    Value *result = compare_operation(var, right, op->type);
-                    free_value(right);
-                    return result;
+                    return apply_binary_tail(copy_value(var), tokens, tok_count, tok_idx);
                 }
                 
                 if (op->type == TOK_LBRACKET) {
-                    (*tok_idx)++;
-                    Value *index = eval_expr(tokens, tok_count, tok_idx);
-                    if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_RBRACKET) {
+                    // Chained lookups such as req["headers"]["host"]
+                    Value *item = var;
+                    while (item && *tok_idx < tok_count && tokens[*tok_idx].type == TOK_LBRACKET) {
                         (*tok_idx)++;
-                    }
-                    
-                    if (var->type == VAL_ARRAY && index->type == VAL_NUMBER) {
-                        int idx = (int)index->data.number;
-                        if (idx >= 0 && idx < var->data.array.count) {
-                            Value *result = copy_value(var->data.array.items[idx]);
+                        Value *index = eval_expr(tokens, tok_count, tok_idx);
+                        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_RBRACKET) {
+                            (*tok_idx)++;
+                        }
+                        
+                        Value *next = NULL;
+                        if (item->type == VAL_BYTES && index->type == VAL_NUMBER) {
+                            // A byte reads as its numeric value
+                            double i = index->data.number;
                             free_value(index);
-                            return result;
+                            Value *byte = i >= 0 && i < item->data.bytes.len ?
+                                          make_number(item->data.bytes.data[(size_t)i]) : create_value(VAL_NULL);
+                            return apply_binary_tail(byte, tokens, tok_count, tok_idx);
                         }
+                        if (item->type == VAL_ARRAY && index->type == VAL_NUMBER) {
+                            int idx = (int)index->data.number;
+                            if (idx >= 0 && idx < item->data.array.count) next = item->data.array.items[idx];
+                        } else if (item->type == VAL_DICT && index->type == VAL_STRING) {
+                            next = dict_get(item, index->data.string);
+                        }
+                        free_value(index);
+                        item = next;
                     }
-                    free_value(index);
+                    return apply_binary_tail(item ? copy_value(item) : create_value(VAL_NULL),
+                                             tokens, tok_count, tok_idx);
                 }
             }
             return copy_value(var);
         }
+        
+        // A bare function name evaluates to the function itself, e.g. route("/", handler)
+        Function *func = find_function(var_name);
+        if (func) {
+            Value *v = create_value(VAL_FUNCTION);
+            v->data.function = func;
+            return v;
+        }
         return create_value(VAL_NULL);
     }
     
@@ -1335,6 +9568,8 @@ Value *eval_expr(Token *tokens, int tok_count, int *tok_idx) {
                 len->data.number = val->data.array.count;
             } else if (val->type == VAL_STRING) {
                 len->data.number = strlen(val->data.string);
+            } else if (val->type == VAL_BYTES) {
+                len->data.number = val->data.bytes.len;
             }
             free_value(val);
             return len;
@@ -1346,18 +9581,297 @@ Value *eval_expr(Token *tokens, int tok_count, int *tok_idx) {
         if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
             (*tok_idx)++;
             Value *filename = eval_expr(tokens, tok_count, tok_idx);
+            Value *mode = NULL;
+            if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_COMMA) {
+                (*tok_idx)++;
+                mode = eval_expr(tokens, tok_count, tok_idx);
+            }
             if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_RPAREN) {
                 (*tok_idx)++;
             }
             
             char *fname = value_to_string(filename);
-            Value *content = file_read(fname);
+            Value *content = file_read(fname, mode && mode->type == VAL_STRING &&
+                                              strcmp(mode->data.string, "bytes") == 0);
             free(fname);
             free_value(filename);
+            if (mode) free_value(mode);
             return content;
         }
     }
     
+    if (tok->type == TOK_ASYNC) {
+        (*tok_idx)++;
+        Token *op = *tok_idx < tok_count ? &tokens[*tok_idx] : NULL;
+        Function *func = op && op->type == TOK_IDENT ? find_function(op->value) : NULL;
+        bool io = op && (op->type == TOK_READ || op->type == TOK_WRITE || op->type == TOK_APPEND);
+        if ((io || func) && *tok_idx + 1 < tok_count && tokens[*tok_idx + 1].type == TOK_LPAREN) {
+            *tok_idx += 2;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            if (func) return async_call(func, args, argc);
+            
+            AsyncJob *job = calloc(1, sizeof(AsyncJob));
+            job->kind = op->type == TOK_READ ? ASYNC_READ : op->type == TOK_WRITE ? ASYNC_WRITE : ASYNC_APPEND;
+            job->target = argc > 0 ? args[0] : create_value(VAL_NULL);
+            job->content = argc > 1 ? args[1] : create_value(VAL_NULL);
+            for (int i = 2; i < argc; i++) free_value(args[i]);
+            free(args);
+            return async_submit(job);
+        }
+        printf("Error: async expects read(), write(), append() or a function call\n");
+        return create_value(VAL_NULL);
+    }
+    
+    if (tok->type == TOK_AWAIT) {
+        (*tok_idx)++;
+        Value *v = eval_primary(tokens, tok_count, tok_idx);
+        if (v->type == VAL_PROMISE) {
+            Value *result = promise_await(v->data.promise);
+            free_value(v);
+            return result;
+        }
+        // Awaiting an array waits for every promise in it
+        if (v->type == VAL_ARRAY) {
+            for (int i = 0; i < v->data.array.count; i++) {
+                Value *item = v->data.array.items[i];
+                if (item->type != VAL_PROMISE) continue;
+                v->data.array.items[i] = promise_await(item->data.promise);
+                free_value(item);
+            }
+        }
+        return v;
+    }
+    
+    if (tok->type == TOK_OPEN) {
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            char *fname = argc > 0 ? value_to_string(args[0]) : strdup("");
+            char *mode = argc > 1 ? value_to_string(args[1]) : strdup("w");
+            char *policy = argc > 2 ? value_to_string(args[2]) : strdup("none");
+            Value *handle = file_open(fname, mode, policy);
+            free(fname); free(mode); free(policy);
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return handle;
+        }
+    }
+    
+    if (tok->type == TOK_LINES) {
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            Value *it;
+            // lines(stdin), unless the script has its own variable by that name
+            if (*tok_idx + 1 < tok_count && tokens[*tok_idx].type == TOK_IDENT &&
+                strcmp(tokens[*tok_idx].value, "stdin") == 0 &&
+                tokens[*tok_idx + 1].type == TOK_RPAREN && !get_var("stdin")) {
+                (*tok_idx)++;
+                it = lines_open(STDIN_FILENO, false);
+            } else {
+                Value *filename = eval_expr(tokens, tok_count, tok_idx);
+                char *fname = value_to_string(filename);
+                it = lines_open(open(fname, O_RDONLY | O_CLOEXEC), true);
+                free(fname);
+                free_value(filename);
+            }
+            if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_RPAREN) {
+                (*tok_idx)++;
+            }
+            return it;
+        }
+    }
+    
+    if (tok->type == TOK_BYTES || tok->type == TOK_TEXT) {
+        bool to_text = tok->type == TOK_TEXT;
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            Value *val = eval_expr(tokens, tok_count, tok_idx);
+            if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_RPAREN) (*tok_idx)++;
+            
+            Value *result;
+            if (to_text) {
+                // text(b): the bytes as a string, cut at the first NUL if there is one
+                char *s = value_to_string(val);
+                result = create_value(VAL_STRING);
+                result->data.string = s;
+            } else if (val->type == VAL_ARRAY) {
+                // bytes([72, 105]) builds from byte values
+                result = create_value(VAL_BYTES);
+                result->data.bytes.len = val->data.array.count;
+                result->data.bytes.data = malloc(val->data.array.count ? val->data.array.count : 1);
+                for (int i = 0; i < val->data.array.count; i++) {
+                    Value *item = val->data.array.items[i];
+                    result->data.bytes.data[i] = item->type == VAL_NUMBER ? (unsigned char)(int)item->data.number : 0;
+                }
+            } else if (val->type == VAL_NUMBER) {
+                // bytes(n) is n zero bytes
+                size_t n = val->data.number > 0 ? (size_t)val->data.number : 0;
+                result = create_value(VAL_BYTES);
+                result->data.bytes.data = calloc(n ? n : 1, 1);
+                result->data.bytes.len = n;
+            } else {
+                size_t len;
+                char *owned;
+                const char *data = value_data(val, &len, &owned);
+                result = make_bytes(data, len);
+                free(owned);
+            }
+            free_value(val);
+            return result;
+        }
+    }
+    
+    if (tok->type == TOK_JSON_PARSE || tok->type == TOK_JSON_STRINGIFY) {
+        bool parse = tok->type == TOK_JSON_PARSE;
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            Value *result;
+            if (parse) {
+                // Parses in place, so a mapped read() is never copied
+                size_t len = 0;
+                char *owned = NULL;
+                const char *text = argc > 0 ? value_data(args[0], &len, &owned) : "";
+                result = json_parse(text, len);
+                if (!result) result = create_value(VAL_NULL);
+                free(owned);
+            } else {
+                int indent = argc > 1 && args[1]->type == VAL_NUMBER ? (int)args[1]->data.number : 0;
+                result = create_value(VAL_STRING);
+                result->data.string = json_stringify(argc > 0 ? args[0] : NULL, indent);
+            }
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return result;
+        }
+    }
+    
+    if (tok->type == TOK_WALK) {
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            // Options are a glob and a thread count, or a dict with those keys
+            Value *glob = argc > 1 ? args[1] : NULL;
+            Value *threads = argc > 2 ? args[2] : NULL;
+            if (glob && glob->type == VAL_DICT) {
+                threads = dict_get(glob, "threads");
+                glob = dict_get(glob, "glob");
+            }
+            char *root = argc > 0 ? value_to_string(args[0]) : strdup(".");
+            Value *it = walk_open(root, glob && glob->type == VAL_STRING ? glob->data.string : NULL,
+                                  threads && threads->type == VAL_NUMBER ? (int)threads->data.number : 0);
+            free(root);
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return it;
+        }
+    }
+    
+    if (tok->type == TOK_KV_OPEN) {
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            char *path = argc > 0 ? value_to_string(args[0]) : strdup("");
+            char *policy = argc > 1 ? value_to_string(args[1]) : strdup("none");
+            Value *db = kv_open(path, policy);
+            free(path); free(policy);
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return db;
+        }
+    }
+    
+    if (tok->type == TOK_KV_GET || tok->type == TOK_KV_PUT || tok->type == TOK_KV_DELETE ||
+        tok->type == TOK_KV_KEYS || tok->type == TOK_KV_COMPACT) {
+        TokenType op = tok->type;
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            Value *result = NULL;
+            if (argc < 1 || args[0]->type != VAL_KV) {
+                printf("Error: %s() expects a store from kv_open()\n", tok->value);
+            } else if (op == TOK_KV_KEYS) {
+                result = kv_keys(args[0]->data.kv);
+            } else if (op == TOK_KV_COMPACT) {
+                int64_t reclaimed = kv_compact(args[0]->data.kv);
+                if (reclaimed < 0) printf("Error: kv_compact() failed: %s\n", strerror(errno));
+                else result = make_number(reclaimed);
+            } else if (argc < 2) {
+                printf("Error: %s() expects a key\n", tok->value);
+            } else if (op == TOK_KV_GET) {
+                size_t len;
+                char *owned;
+                const char *key = value_data(args[1], &len, &owned);
+                result = kv_get(args[0]->data.kv, key, len);
+                free(owned);
+            } else {
+                // kv_put(db, key, value), kv_delete(db, key), or kv_put(db, dict) to
+                // write every entry as one transaction (null values delete)
+                Value **keys = &args[1], **values = NULL;
+                int count = 1;
+                if (op == TOK_KV_PUT && args[1]->type == VAL_DICT) {
+                    count = args[1]->data.dict.count;
+                    keys = malloc((count + 1) * sizeof(Value*));
+                    for (int i = 0; i < count; i++) keys[i] = make_string(args[1]->data.dict.keys[i]);
+                    values = args[1]->data.dict.values;
+                } else if (op == TOK_KV_PUT) {
+                    values = argc > 2 ? &args[2] : NULL;
+                }
+                Value *deleted = NULL;
+                if (!values) values = &deleted;
+                bool ok = kv_write(args[0]->data.kv, keys, values, count);
+                if (!ok) printf("Error: %s() failed: %s\n", tok->value, strerror(errno));
+                if (keys != &args[1]) {
+                    for (int i = 0; i < count; i++) free_value(keys[i]);
+                    free(keys);
+                }
+                result = create_value(VAL_BOOL);
+                result->data.boolean = ok;
+            }
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return result ? result : create_value(VAL_NULL);
+        }
+    }
+    
+    if (tok->type == TOK_CSV_READ) {
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            // Options are a mode string, or a dict of mode, delimiter and header
+            Value *mode = argc > 1 ? args[1] : NULL;
+            Value *delim = NULL, *header = NULL;
+            if (mode && mode->type == VAL_DICT) {
+                delim = dict_get(mode, "delimiter");
+                header = dict_get(mode, "header");
+                mode = dict_get(mode, "mode");
+            }
+            char *path = argc > 0 ? value_to_string(args[0]) : strdup("");
+            Value *result = csv_read(path, mode && mode->type == VAL_STRING ? mode->data.string : "rows",
+                                     delim && delim->type == VAL_STRING && delim->data.string[0] ? delim->data.string[0] : ',',
+                                     !header || header->type != VAL_BOOL || header->data.boolean);
+            free(path);
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return result;
+        }
+    }
+    
     if (tok->type == TOK_EXISTS) {
         (*tok_idx)++;
         if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
@@ -1382,63 +9896,309 @@ Value *eval_expr(Token *tokens, int tok_count, int *tok_idx) {
         (*tok_idx)++;
         if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
             (*tok_idx)++;
-            Value *data = eval_expr(tokens, tok_count, tok_idx);
-            
-            Value *algorithm = NULL;
-            if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_COMMA) {
-                (*tok_idx)++;
-                algorithm = eval_expr(tokens, tok_count, tok_idx);
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            // hash(data, algo, encoding)
+            Value *hash = NULL;
+            CodecEncoding encoding;
+            if (codec_encoding(argc > 2 ? args[2] : NULL, &encoding)) {
+                size_t data_len = 0;
+                char *data_owned = NULL;
+                const char *data_str = argc > 0 ? value_data(args[0], &data_len, &data_owned) : "";
+                char *algo_str = argc > 1 && args[1]->type != VAL_NULL ? value_to_string(args[1]) : strdup("sha256");
+                hash = crypto_hash(data_str, data_len, algo_str, encoding);
+                free(data_owned);
+                free(algo_str);
             }
-            
-            if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_RPAREN) {
-                (*tok_idx)++;
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return hash ? hash : create_value(VAL_NULL);
+        }
+    }
+    
+    if (tok->type == TOK_HMAC) {
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            // hmac(key, data, algo, encoding); the algorithm defaults to sha256
+            Value *mac = NULL;
+            CodecEncoding encoding;
+            if (codec_encoding(argc > 3 ? args[3] : NULL, &encoding)) {
+                size_t key_len = 0, data_len = 0;
+                char *key_owned = NULL, *data_owned = NULL;
+                const char *key = argc > 0 ? value_data(args[0], &key_len, &key_owned) : "";
+                const char *data = argc > 1 ? value_data(args[1], &data_len, &data_owned) : "";
+                char *algo = argc > 2 && args[2]->type != VAL_NULL ? value_to_string(args[2]) : strdup("sha256");
+                mac = crypto_hmac(key, key_len, data, data_len, algo, encoding);
+                free(key_owned); free(data_owned); free(algo);
             }
-            
-            char *data_str = value_to_string(data);
-            char *algo_str = algorithm ? value_to_string(algorithm) : strdup("sha256");
-            Value *hash = crypto_hash(data_str, algo_str);
-            
-            free(data_str);
-            free(algo_str);
-            free_value(data);
-            if (algorithm) free_value(algorithm);
-            return hash;
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return mac ? mac : create_value(VAL_NULL);
         }
     }
     
-    if (tok->type == TOK_ENCRYPT) {
+    if (tok->type == TOK_HASH_INIT || tok->type == TOK_HASH_FILE) {
+        TokenType op = tok->type;
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            // hash_init(algo) and hash_file(path, algo, encoding); the algorithm defaults to sha256
+            int algo_arg = op == TOK_HASH_INIT ? 0 : 1;
+            char *algo = argc > algo_arg && args[algo_arg]->type != VAL_NULL ? value_to_string(args[algo_arg]) : strdup("sha256");
+            Value *result = NULL;
+            CodecEncoding encoding;
+            if (op == TOK_HASH_INIT) {
+                result = hash_init(algo);
+            } else if (codec_encoding(argc > 2 ? args[2] : NULL, &encoding)) {
+                char *path = argc > 0 ? value_to_string(args[0]) : strdup("");
+                result = hash_file(path, algo, encoding);
+                free(path);
+            }
+            free(algo);
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return result ? result : create_value(VAL_NULL);
+        }
+    }
+    
+    if (tok->type == TOK_HASH_UPDATE || tok->type == TOK_HASH_FINAL) {
+        TokenType op = tok->type;
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            Value *result = NULL;
+            if (argc < 1 || args[0]->type != VAL_HASH) {
+                printf("Error: %s() expects a handle from hash_init()\n", tok->value);
+            } else if (op == TOK_HASH_UPDATE) {
+                size_t len = 0;
+                char *owned = NULL;
+                const char *data = argc > 1 ? value_data(args[1], &len, &owned) : "";
+                if (hash_update(args[0]->data.hash, data, len)) {
+                    result = create_value(VAL_BOOL);
+                    result->data.boolean = true;
+                } else {
+                    printf("Error: hash_update() after hash_final()\n");
+                }
+                free(owned);
+            } else {
+                // hash_final(h, encoding)
+                CodecEncoding encoding;
+                if (codec_encoding(argc > 1 ? args[1] : NULL, &encoding)) {
+                    result = hash_final(args[0]->data.hash, encoding);
+                    if (!result) printf("Error: hash_final() was already called on this handle\n");
+                }
+            }
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return result ? result : create_value(VAL_NULL);
+        }
+    }
+    
+    if (tok->type == TOK_BROADCAST) {
         (*tok_idx)++;
         if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
             (*tok_idx)++;
-            Value *data = eval_expr(tokens, tok_count, tok_idx);
+            Value *channel = eval_expr(tokens, tok_count, tok_idx);
             if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_COMMA) (*tok_idx)++;
-            Value *key = eval_expr(tokens, tok_count, tok_idx);
+            Value *message = eval_expr(tokens, tok_count, tok_idx);
             if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_RPAREN) (*tok_idx)++;
             
-            char *data_str = value_to_string(data);
-            char *key_str = value_to_string(key);
-            Value *encrypted = crypto_encrypt_aes(data_str, key_str);
-            free(data_str); free(key_str);
-            free_value(data); free_value(key);
-            return encrypted;
+            char *channel_str = value_to_string(channel);
+            char *message_str = value_to_string(message);
+            Value *sent = make_number(ws_broadcast(channel_str, message_str, strlen(message_str)));
+            free(channel_str); free(message_str);
+            free_value(channel); free_value(message);
+            return sent;
         }
     }
     
-    if (tok->type == TOK_DECRYPT) {
+    if (tok->type == TOK_SUBSCRIBE) {
         (*tok_idx)++;
         if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
             (*tok_idx)++;
-            Value *data = eval_expr(tokens, tok_count, tok_idx);
+            Value *ws = eval_expr(tokens, tok_count, tok_idx);
             if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_COMMA) (*tok_idx)++;
-            Value *key = eval_expr(tokens, tok_count, tok_idx);
+            Value *channel = eval_expr(tokens, tok_count, tok_idx);
             if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_RPAREN) (*tok_idx)++;
             
-            char *data_str = value_to_string(data);
-            char *key_str = value_to_string(key);
-            Value *decrypted = crypto_decrypt_aes(data_str, key_str);
-            free(data_str); free(key_str);
-            free_value(data); free_value(key);
-            return decrypted;
+            // Takes the ws value a handler was given, or its id
+            Value *id = ws->type == VAL_DICT ? dict_get(ws, "id") : ws;
+            char *channel_str = value_to_string(channel);
+            Value *ok = create_value(VAL_BOOL);
+            pthread_mutex_lock(&ws_hub.lock);
+            WsConn *c = id && id->type == VAL_NUMBER ? ws_find((uint64_t)id->data.number) : NULL;
+            if (c) ws_subscribe(c, channel_str);
+            pthread_mutex_unlock(&ws_hub.lock);
+            ok->data.boolean = c != NULL;
+            free(channel_str);
+            free_value(ws); free_value(channel);
+            return ok;
+        }
+    }
+    
+    if (tok->type == TOK_ENCRYPT) {
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            // encrypt(data, key, encoding)
+            Value *encrypted = NULL;
+            CodecEncoding encoding;
+            if (argc >= 2 && codec_encoding(argc > 2 ? args[2] : NULL, &encoding)) {
+                size_t data_len, key_len;
+                char *data_owned, *key_owned;
+                const char *data_str = value_data(args[0], &data_len, &data_owned);
+                const char *key_str = value_data(args[1], &key_len, &key_owned);
+                encrypted = crypto_encrypt_aes(data_str, data_len, key_str, key_len, encoding);
+                free(data_owned); free(key_owned);
+            }
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return encrypted ? encrypted : create_value(VAL_NULL);
+        }
+    }
+    
+    if (tok->type == TOK_DECRYPT) {
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            // decrypt(data, key, output): takes the hex text encrypt() returns, or its
+            // raw bytes, and gives text unless output is "bytes"
+            Value *decrypted = NULL;
+            bool as_bytes;
+            if (argc >= 2 && text_or_bytes(argc > 2 ? args[2] : NULL, "decrypt", &as_bytes)) {
+                size_t data_len, key_len;
+                char *data_owned, *key_owned;
+                const char *data_str = value_data(args[0], &data_len, &data_owned);
+                const char *key_str = value_data(args[1], &key_len, &key_owned);
+                if (args[0]->type == VAL_BYTES) {
+                    decrypted = crypto_decrypt_aes((const unsigned char*)data_str, data_len, key_str, key_len, as_bytes);
+                } else {
+                    size_t raw_len;
+                    unsigned char *raw = crypto_unhex(data_str, data_len, &raw_len);
+                    if (raw) decrypted = crypto_decrypt_aes(raw, raw_len, key_str, key_len, as_bytes);
+                    else printf("Error: decrypt() expects hex text or bytes\n");
+                    free(raw);
+                }
+                free(data_owned); free(key_owned);
+            }
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return decrypted ? decrypted : create_value(VAL_NULL);
+        }
+    }
+    
+    if (tok->type == TOK_CIPHER_KEY) {
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            // cipher_key(key, algo, salt); the algorithm defaults to aes-256-gcm
+            size_t key_len = 0, salt_len = 0;
+            char *key_owned = NULL, *salt_owned = NULL;
+            const char *key = argc > 0 ? value_data(args[0], &key_len, &key_owned) : "";
+            const char *salt = argc > 2 && args[2]->type != VAL_NULL ? value_data(args[2], &salt_len, &salt_owned) : NULL;
+            char *algo = argc > 1 && args[1]->type != VAL_NULL ? value_to_string(args[1]) : strdup("aes-256-gcm");
+            Value *handle = cipher_key_new(key, key_len, argc > 0 && args[0]->type == VAL_BYTES, salt, salt_len, algo);
+            free(key_owned); free(salt_owned); free(algo);
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return handle;
+        }
+    }
+    
+    if (tok->type == TOK_CIPHER_ENCRYPT || tok->type == TOK_CIPHER_DECRYPT) {
+        TokenType op = tok->type;
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            // (key, data, aad, encoding): decrypt takes the hex text encrypt returned, or raw
+            // bytes, and its last argument is the output, "text" (default) or "bytes"
+            Value *result = NULL;
+            if (argc < 1 || args[0]->type != VAL_CIPHER) {
+                printf("Error: %s() expects a key from cipher_key()\n", tok->value);
+            } else {
+                size_t len = 0, aad_len = 0;
+                char *owned = NULL, *aad_owned = NULL;
+                const char *data = argc > 1 ? value_data(args[1], &len, &owned) : "";
+                const char *aad = argc > 2 && args[2]->type != VAL_NULL ? value_data(args[2], &aad_len, &aad_owned) : NULL;
+                CodecEncoding encoding;
+                bool as_bytes;
+                if (op == TOK_CIPHER_ENCRYPT) {
+                    if (codec_encoding(argc > 3 ? args[3] : NULL, &encoding)) {
+                        result = cipher_encrypt(args[0]->data.cipher, data, len, aad, aad_len, encoding);
+                    }
+                } else if (text_or_bytes(argc > 3 ? args[3] : NULL, "cipher_decrypt", &as_bytes)) {
+                    if (argc > 1 && args[1]->type == VAL_BYTES) {
+                        result = cipher_decrypt(args[0]->data.cipher, (const unsigned char*)data, len, aad, aad_len, as_bytes);
+                    } else {
+                        size_t raw_len;
+                        unsigned char *raw = crypto_unhex(data, len, &raw_len);
+                        if (raw) result = cipher_decrypt(args[0]->data.cipher, raw, raw_len, aad, aad_len, as_bytes);
+                        else printf("Error: cipher_decrypt() expects hex text or bytes\n");
+                        free(raw);
+                    }
+                }
+                free(owned); free(aad_owned);
+            }
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return result ? result : create_value(VAL_NULL);
+        }
+    }
+    
+    if (tok->type == TOK_HEX_ENCODE || tok->type == TOK_HEX_DECODE ||
+        tok->type == TOK_BASE64_ENCODE || tok->type == TOK_BASE64_DECODE) {
+        TokenType op = tok->type;
+        (*tok_idx)++;
+        if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
+            (*tok_idx)++;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            size_t len = 0;
+            char *owned = NULL;
+            const char *data = argc > 0 ? value_data(args[0], &len, &owned) : "";
+            Value *result = NULL;
+            if (op == TOK_HEX_ENCODE) {
+                result = codec_encode((const unsigned char*)data, len, CODEC_HEX);
+            } else if (op == TOK_BASE64_ENCODE) {
+                // base64_encode(data, "url") uses the URL-safe alphabet without padding
+                bool url = argc > 1 && args[1]->type == VAL_STRING && strcmp(args[1]->data.string, "url") == 0;
+                result = create_value(VAL_STRING);
+                result->data.string = malloc((len + 2) / 3 * 4 + 1);
+                result->data.string[base64_encode_into((const unsigned char*)data, len, result->data.string, url)] = 0;
+            } else {
+                // Decoding always gives bytes; text() turns them back into a string
+                size_t out_len = len / 2;
+                unsigned char *out = malloc(len / 4 * 3 + 3);
+                bool ok = op == TOK_HEX_DECODE ? hex_decode_into(data, len, out)
+                                               : base64_decode_into(data, len, out, &out_len);
+                if (ok) {
+                    result = create_value(VAL_BYTES);
+                    result->data.bytes.data = out;
+                    result->data.bytes.len = out_len;
+                } else {
+                    printf("Error: %s() input is not valid %s\n", tok->value, op == TOK_HEX_DECODE ? "hex" : "base64");
+                    free(out);
+                }
+            }
+            free(owned);
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return result ? result : create_value(VAL_NULL);
         }
     }
     
@@ -1446,12 +10206,18 @@ Value *eval_expr(Token *tokens, int tok_count, int *tok_idx) {
         (*tok_idx)++;
         if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_LPAREN) {
             (*tok_idx)++;
-            Value *length = eval_expr(tokens, tok_count, tok_idx);
-            if (*tok_idx < tok_count && tokens[*tok_idx].type == TOK_RPAREN) (*tok_idx)++;
-            int len = (int)length->data.number;
-            Value *salt = crypto_generate_salt(len > 0 ? len : 32);
-            free_value(length);
-            return salt;
+            int argc;
+            Value **args = parse_call_args(tokens, tok_count, tok_idx, &argc);
+            // salt(length, encoding)
+            Value *salt = NULL;
+            CodecEncoding encoding;
+            if (codec_encoding(argc > 1 ? args[1] : NULL, &encoding)) {
+                int len = argc > 0 && args[0]->type == VAL_NUMBER ? (int)args[0]->data.number : 0;
+                salt = crypto_generate_salt(len > 0 ? len : 32, encoding);
+            }
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+            return salt ? salt : create_value(VAL_NULL);
         }
     }
     
@@ -1491,6 +10257,31 @@ Value *eval_expr(Token *tokens, int tok_count, int *tok_idx) {
     return create_value(VAL_NULL);
 }
 
+// Reassembles an option value such as ./public or /var/www from its tokens
+char *parse_option_value(Token *tokens, int count, int *idx) {
+    char value[1024] = "";
+    size_t len = 0;
+    bool after_word = false;
+    
+    while (*idx < count) {
+        Token *t = &tokens[*idx];
+        bool is_sep = t->type == TOK_DOT || t->type == TOK_SLASH ||
+                      t->type == TOK_MINUS || t->type == TOK_COLON;
+        bool is_word = t->type == TOK_STRING || t->type == TOK_NUMBER ||
+                       (t->value && (isalnum((unsigned char)t->value[0]) || t->value[0] == '_'));
+        // Two words in a row means the value ended and the next one belongs to someone else
+        if ((!is_sep && !is_word) || (is_word && after_word)) break;
+        
+        size_t n = strlen(t->value);
+        if (len + n >= sizeof(value)) break;
+        memcpy(value + len, t->value, n + 1);
+        len += n;
+        after_word = is_word;
+        (*idx)++;
+    }
+    return strdup(value);
+}
+
 // Helper to skip a block of code {...}
 void skip_block(Token *tokens, int count, int *idx) {
     if (*idx >= count) return;
@@ -1507,7 +10298,8 @@ void skip_block(Token *tokens, int count, int *idx) {
 }
 
 Function *find_function(const char *name) {
-    for (int i = 0; i < func_count; i++) {
+    int n = __atomic_load_n(&func_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n; i++) {
         if (strcmp(funcs[i].name, name) == 0) {
             return &funcs[i];
         }
@@ -1537,8 +10329,15 @@ void execute_statement(Token *tokens, int count, int *idx) {
     
     Token *tok = &tokens[*idx];
     
+    // "async func" declares a function whose calls run on the I/O pool
+    if (tok->type == TOK_ASYNC && *idx + 1 < count && tokens[*idx + 1].type == TOK_FUNC) {
+        (*idx)++;
+        tok = &tokens[*idx];
+    }
+    
     // Function Definition
     if (tok->type == TOK_FUNC) {
+        bool is_async = *idx > 0 && tokens[*idx - 1].type == TOK_ASYNC;
         (*idx)++;
         if (*idx < count && tokens[*idx].type == TOK_IDENT) {
             char *name = tokens[*idx].value;
@@ -1548,6 +10347,7 @@ void execute_statement(Token *tokens, int count, int *idx) {
             func.name = strdup_safe(name);
             func.params = calloc(16, sizeof(char*));
             func.param_count = 0;
+            func.is_async = is_async;
             
             if (*idx < count && tokens[*idx].type == TOK_LPAREN) {
                 (*idx)++;
@@ -1577,9 +10377,12 @@ void execute_statement(Token *tokens, int count, int *idx) {
                 }
             }
             
+            pthread_mutex_lock(&funcs_lock);
             if (func_count < MAX_FUNCTIONS) {
-                funcs[func_count++] = func;
+                funcs[func_count] = func;
+                __atomic_store_n(&func_count, func_count + 1, __ATOMIC_RELEASE);
             }
+            pthread_mutex_unlock(&funcs_lock);
         }
         return;
     }
@@ -1597,7 +10400,7 @@ void execute_statement(Token *tokens, int count, int *idx) {
         return;
     }
     
-    if (tok->type == TOK_IF) {
+    if (tok->type == TOK_IF || tok->type == TOK_ELIF) {
         (*idx)++;
         if (*idx < count && tokens[*idx].type == TOK_LPAREN) (*idx)++; // Optional parens
         
@@ -1634,11 +10437,8 @@ void execute_statement(Token *tokens, int count, int *idx) {
                     (*idx)++;
                     execute_block(tokens, count, idx);
                 } else if (tokens[*idx].type == TOK_ELIF) {
-                    // Recursive IF logic... basically treat as new IF
-                    // Simple hack: change ELIF to IF and don't advance idx, let next loop handle it?
-                    // No, we are in a single pass.
-                    // Recursive call to execute_statement_ptr? 
-                    tokens[*idx].type = TOK_IF; // Hack: Transform ELIF to IF for recursion
+                    // ELIF runs as a nested IF; tokens stay untouched since loop
+                    // and function bodies run the same chain again
                     execute_statement(tokens, count, idx);
                 }
             }
@@ -1680,6 +10480,44 @@ void execute_statement(Token *tokens, int count, int *idx) {
         return;
     }
 
+    // for (name in sequence) { ... } over arrays, dict keys and iterators
+    if (tok->type == TOK_FOR) {
+        (*idx)++;
+        bool parens = *idx < count && tokens[*idx].type == TOK_LPAREN;
+        if (parens) (*idx)++;
+        if (*idx + 1 >= count || tokens[*idx].type != TOK_IDENT || tokens[*idx + 1].type != TOK_IN) {
+            printf("Error: for expects 'for (name in sequence) { ... }'\n");
+            while (*idx < count && tokens[*idx].type != TOK_LBRACE) (*idx)++;
+            skip_block(tokens, count, idx);
+            return;
+        }
+        char *var_name = tokens[*idx].value;
+        *idx += 2;
+        Value *seq = eval_expr(tokens, count, idx);
+        if (parens && *idx < count && tokens[*idx].type == TOK_RPAREN) (*idx)++;
+        int body_idx = *idx;
+        
+        for (int i = 0; !is_returning; i++) {
+            Value *item = NULL;
+            if (seq->type == VAL_ITERATOR) {
+                item = seq->data.iterator->next(seq->data.iterator);
+            } else if (seq->type == VAL_ARRAY && i < seq->data.array.count) {
+                item = copy_value(seq->data.array.items[i]);
+            } else if (seq->type == VAL_DICT && i < seq->data.dict.count) {
+                item = make_string(seq->data.dict.keys[i]);
+            }
+            if (!item) break;
+            set_var(var_name, item, false);
+            free_value(item);
+            int block_idx = body_idx;
+            execute_block(tokens, count, &block_idx);
+        }
+        free_value(seq);
+        skip_block(tokens, count, &body_idx);
+        *idx = body_idx;
+        return;
+    }
+
     if (tok->type == TOK_LET || tok->type == TOK_CONST || tok->type == TOK_VAR) {
         bool is_const = (tok->type == TOK_CONST);
         (*idx)++;
@@ -1702,9 +10540,15 @@ void execute_statement(Token *tokens, int count, int *idx) {
             (*idx)++;
             while ((*idx) < count && tokens[(*idx)].type != TOK_RPAREN) {
                 Value *val = eval_expr(tokens, count, idx);
-                char *str = value_to_string(val);
-                printf("%s", str);
-                free(str);
+                if (val->type == VAL_STRING && val->data.string) {
+                    fputs(val->data.string, stdout);
+                } else if (val->type == VAL_BYTES) {
+                    fwrite(val->data.bytes.data, 1, val->data.bytes.len, stdout);
+                } else {
+                    char *str = value_to_string(val);
+                    printf("%s", str);
+                    free(str);
+                }
                 free_value(val);
                 if ((*idx) < count && tokens[(*idx)].type == TOK_COMMA) {
                     (*idx)++;
@@ -1745,18 +10589,41 @@ void execute_statement(Token *tokens, int count, int *idx) {
                  // ... handles += etc ...
             }
         } else if ((*idx) + 1 < count && tokens[(*idx) + 1].type == TOK_LBRACKET) {
-            // Array/Dict assignment: var[idx] = val
+            // Array/Dict assignment: var[idx] = val, or var[a][b] = val into nested containers
             char *var_name = tok->value;
             (*idx)++; // Skip name
-            (*idx)++; // Skip [
-            Value *index = eval_expr(tokens, count, idx);
-            if ((*idx) < count && tokens[(*idx)].type == TOK_RBRACKET) (*idx)++;
+            Value *indexes[16];
+            int index_count = 0;
+            while ((*idx) < count && tokens[(*idx)].type == TOK_LBRACKET && index_count < 16) {
+                (*idx)++; // Skip [
+                indexes[index_count++] = eval_expr(tokens, count, idx);
+                if ((*idx) < count && tokens[(*idx)].type == TOK_RBRACKET) (*idx)++;
+            }
+            Value *index = indexes[index_count - 1];
             
-            if ((*idx) < count && tokens[(*idx)].type == TOK_EQ) {
+            if ((*idx) < count && tokens[(*idx)].type == TOK_LBRACKET) {
+                printf("Error: Too many indexes in assignment to '%s'\n", var_name);
+            } else if ((*idx) < count && tokens[(*idx)].type == TOK_EQ) {
                 (*idx)++;
                 Value *val = eval_expr(tokens, count, idx);
                 
+                // Walk down to the container the last index refers into
                 Value *var = get_var(var_name);
+                for (int k = 0; var && k < index_count - 1; k++) {
+                    Value *next = NULL;
+                    if (var->type == VAL_ARRAY && indexes[k]->type == VAL_NUMBER) {
+                        int i = (int)indexes[k]->data.number;
+                        if (i >= 0 && i < var->data.array.count) next = var->data.array.items[i];
+                    } else if (var->type == VAL_DICT && indexes[k]->type == VAL_STRING) {
+                        next = dict_get(var, indexes[k]->data.string);
+                    }
+                    if (!next) {
+                        char *key = value_to_string(indexes[k]);
+                        printf("Error: Cannot assign into '%s': no element [%s]\n", var_name, key);
+                        free(key);
+                    }
+                    var = next;
+                }
                 if (var) {
                     if (var->type == VAL_ARRAY && index->type == VAL_NUMBER) {
                         int i = (int)index->data.number;
@@ -1765,12 +10632,12 @@ void execute_statement(Token *tokens, int count, int *idx) {
                             var->data.array.items[i] = copy_value(val);
                         }
                     } else if (var->type == VAL_DICT && index->type == VAL_STRING) {
-                        // Implement dict set
+                        dict_set(var, index->data.string, copy_value(val));
                     }
                 }
                 free_value(val);
             }
-            free_value(index);
+            for (int k = 0; k < index_count; k++) free_value(indexes[k]);
         } else {
             // Expression statement
             // Expression statement (e.g. function call)
@@ -1787,25 +10654,22 @@ void execute_statement(Token *tokens, int count, int *idx) {
                 if ((*idx) < count && tokens[(*idx)].type == TOK_SERVER) {
                     (*idx)++;
                     
-                    int port = 8000;
-                    char *root = ".";
+                    http_server.port = 8000;
+                    free(http_server.root_dir);
+                    http_server.root_dir = strdup(".");
                     
-                    while ((*idx) < count) {
-                        if (tokens[(*idx)].type == TOK_IDENT) {
-                            char *arg = tokens[(*idx)].value;
-                            if (strncmp(arg, "port=", 5) == 0) {
-                                port = atoi(arg + 5);
-                            } else if (strncmp(arg, "root=", 5) == 0) {
-                                root = arg + 5;
-                            }
-                        }
-                        (*idx)++;
+                    // Options are written as key=value, e.g. port=5000 root=./public
+                    while ((*idx) + 1 < count && tokens[(*idx)].type == TOK_IDENT &&
+                           tokens[(*idx) + 1].type == TOK_EQ) {
+                        int opt_idx = (*idx) + 2;
+                        char *value = parse_option_value(tokens, count, &opt_idx);
+                        bool known = http_server_set_option(tokens[(*idx)].value, value);
+                        free(value);
+                        if (!known) break;
+                        *idx = opt_idx;
                     }
                     
-                    http_server.port = port;
-                    http_server.root_dir = strdup(root);
-                    http_server.running = true;
-                    pthread_create(&http_server.thread, NULL, http_server_thread, NULL);
+                    http_server_start();
                 }
             }
         } else if ((*idx) < count && tokens[(*idx)].type == TOK_SERVER) {
@@ -1816,9 +10680,9 @@ void execute_statement(Token *tokens, int count, int *idx) {
                 if ((*idx) < count && tokens[(*idx)].type == TOK_RPAREN) (*idx)++;
                 
                 http_server.port = (int)port->data.number;
+                free(http_server.root_dir);
                 http_server.root_dir = strdup(".");
-                http_server.running = true;
-                pthread_create(&http_server.thread, NULL, http_server_thread, NULL);
+                http_server_start();
                 free_value(port);
             }
         }
@@ -1826,25 +10690,88 @@ void execute_statement(Token *tokens, int count, int *idx) {
     else if (tok->type == TOK_STOP) {
         (*idx)++;
         if ((*idx) < count && tokens[(*idx)].type == TOK_SERVER) {
-            http_server.running = false;
-            pthread_join(http_server.thread, NULL);
+            (*idx)++;
+            http_server_stop();
             printf("Server stopped\n");
         }
     }
-    else if (tok->type == TOK_WRITE) {
+    else if (tok->type == TOK_ROUTE || tok->type == TOK_WEBSOCKET) {
+        bool websocket = tok->type == TOK_WEBSOCKET;
         (*idx)++;
         if ((*idx) < count && tokens[(*idx)].type == TOK_LPAREN) {
             (*idx)++;
-            Value *filename = eval_expr(tokens, count, idx);
+            int argc;
+            Value **args = parse_call_args(tokens, count, idx, &argc);
+            
+            // route(path, handler, method, body): body "bytes" hands the handler raw bytes
+            bool body_bytes = false;
+            if (argc < 2 || args[0]->type != VAL_STRING || args[1]->type != VAL_FUNCTION) {
+                printf("Error: %s() expects a path and a handler function\n", websocket ? "websocket" : "route");
+            } else if (route_count >= MAX_ROUTES) {
+                printf("Error: Too many routes\n");
+            } else if (websocket || text_or_bytes(argc > 3 ? args[3] : NULL, "route", &body_bytes)) {
+                // Workers may already be matching routes; only publish the slot once it is filled
+                Route *r = &routes[route_count];
+                r->path = strdup_safe(args[0]->data.string);
+                r->handler = args[1]->data.function;
+                r->method = !websocket && argc > 2 && args[2]->type == VAL_STRING ?
+                            strdup_safe(args[2]->data.string) : NULL;
+                r->websocket = websocket;
+                r->body_bytes = body_bytes;
+                __atomic_store_n(&route_count, route_count + 1, __ATOMIC_RELEASE);
+            }
+            for (int i = 0; i < argc; i++) free_value(args[i]);
+            free(args);
+        }
+    }
+    else if (tok->type == TOK_WRITE || tok->type == TOK_APPEND) {
+        bool append = tok->type == TOK_APPEND;
+        (*idx)++;
+        if ((*idx) < count && tokens[(*idx)].type == TOK_LPAREN) {
+            (*idx)++;
+            Value *target = eval_expr(tokens, count, idx);
             if ((*idx) < count && tokens[(*idx)].type == TOK_COMMA) (*idx)++;
             Value *content = eval_expr(tokens, count, idx);
             if ((*idx) < count && tokens[(*idx)].type == TOK_RPAREN) (*idx)++;
             
-            char *fname = value_to_string(filename);
-            char *cont = value_to_string(content);
-            file_write(fname, cont);
-            free(fname); free(cont);
-            free_value(filename); free_value(content);
+            file_write_value(target, content, append);
+            free_value(target); free_value(content);
+        }
+    }
+    else if (tok->type == TOK_FLUSH || tok->type == TOK_CLOSE) {
+        bool closing = tok->type == TOK_CLOSE;
+        (*idx)++;
+        if ((*idx) < count && tokens[(*idx)].type == TOK_LPAREN) {
+            (*idx)++;
+            Value *handle = eval_expr(tokens, count, idx);
+            if ((*idx) < count && tokens[(*idx)].type == TOK_RPAREN) (*idx)++;
+            
+            if (closing && handle->type == VAL_KV) {
+                kv_close(handle->data.kv);
+            } else if (handle->type != VAL_FILE) {
+                printf("Error: %s() expects a file from open()\n", closing ? "close" : "flush");
+            } else if (!(closing ? file_handle_close(handle->data.file) : file_handle_flush(handle->data.file))) {
+                printf("Error: %s() failed: %s\n", closing ? "close" : "flush", strerror(errno));
+            }
+            free_value(handle);
+        }
+    }
+    else if (tok->type == TOK_PUSH) {
+        // push(array, value) appends in place, e.g. to collect promises
+        (*idx)++;
+        if ((*idx) + 1 < count && tokens[(*idx)].type == TOK_LPAREN && tokens[(*idx) + 1].type == TOK_IDENT) {
+            Value *arr = get_var(tokens[(*idx) + 1].value);
+            (*idx) += 2;
+            if ((*idx) < count && tokens[(*idx)].type == TOK_COMMA) (*idx)++;
+            Value *item = eval_expr(tokens, count, idx);
+            if ((*idx) < count && tokens[(*idx)].type == TOK_RPAREN) (*idx)++;
+            
+            if (!arr || arr->type != VAL_ARRAY) {
+                printf("Error: push() expects an array variable\n");
+                free_value(item);
+            } else {
+                array_push(arr, item);
+            }
         }
     }
     else if (tok->type == TOK_DELETE) {
@@ -1990,8 +10917,10 @@ void execute_statement(Token *tokens, int count, int *idx) {
     else {
         // Fallback: Expression Statement
         // For any other token, try to evaluate it as an expression and discard result
+        int start = *idx;
         Value *v = eval_expr(tokens, count, idx);
         free_value(v);
+        if (*idx == start) (*idx)++; // Unknown token, don't spin on it
     }
 }
 
@@ -2038,12 +10967,26 @@ void print_help() {
     printf("Commands:\n");
     printf("  start http-server [options]  Start HTTP file server\n");
     printf("  stop server                   Stop running server\n");
-    printf("  compile [options]             Compile to binary\n\n");
+    printf("  compile [options]             Compile to binary\n");
+    printf("  bench http url=<url> [options] Load test an HTTP endpoint\n");
+    printf("                                (connections=, duration=, pipeline=, threads=, rate=)\n\n");
     printf("Options:\n");
     printf("  -v, --version                 Show version\n");
     printf("  -h, --help                    Show help\n");
     printf("  port=<num>                    Server port (default: 8000)\n");
     printf("  root=<dir>                    Server root directory (default: .)\n");
+    printf("  threads=<num>                 Worker threads per process (default: CPU count / processes)\n");
+    printf("  processes=<num>               Prefork worker processes, restarted if they die (default: 1)\n");
+    printf("  metrics=on                    Expose /__zenith/metrics (Prometheus format)\n");
+    printf("  max_body=<bytes>              Largest accepted request body (default: no limit)\n");
+    printf("  upload_dir=<dir>              Where large request bodies are spooled (default: /tmp)\n");
+    printf("  backend=io_uring|threads      Server I/O backend (default: threads)\n");
+    printf("  cert=<file> key=<file>        Serve HTTPS with this PEM certificate chain and key\n");
+    printf("  max_conns=<num>               Connections queued or in service before shedding (default: 1024)\n");
+    printf("  max_pending=<bytes>           Request bytes in flight before shedding (default: no limit)\n");
+    printf("  rate_limit=<req/s>            Per-client-IP token bucket rate (default: off)\n");
+    printf("  rate_burst=<num>              Token bucket size (default: rate_limit)\n");
+    printf("  queue_timeout=<ms>            Shed connections that waited longer for a worker (default: 1000)\n");
     printf("  --tcc                         Use TCC compiler\n");
     printf("  --gcc                         Use GCC compiler\n");
     printf("  -o <file>                     Output file\n\n");
@@ -2052,6 +10995,7 @@ void print_help() {
     printf("  zenith start http-server port=5000     # Start server on port 5000\n");
     printf("  zenith start http-server root=./public # Serve from ./public\n");
     printf("  zenith compile app.zt --tcc -o myapp   # Compile with TCC\n");
+    printf("  zenith bench http url=http://127.0.0.1:5000/ connections=64 duration=10\n");
     printf("  zenith                                 # Start REPL\n");
 }
 
@@ -2099,11 +11043,17 @@ int main(int argc, char *argv[]) {
             if (http_server.running) {
                 printf("\nPress Enter to stop server...\n");
                 getchar();
-                http_server.running = false;
-                pthread_join(http_server.thread, NULL);
+                http_server_stop();
             }
             return 0;
         }
+        if (strcmp(argv[1], "bench") == 0) {
+            if (argc < 3 || strcmp(argv[2], "http") != 0) {
+                printf("Usage: zenith bench http url=<http://host:port/path> [options]\n");
+                return 1;
+            }
+            return bench_http(argc - 3, argv + 3);
+        }
         if (strcmp(argv[1], "compile") == 0) {
             if (argc < 3) {
                 printf("Usage: zenith compile <file.zt> [-o output]\n");
@@ -2171,7 +11121,7 @@ int main(int argc, char *argv[]) {
 #ifdef HAVE_TCC
             strcat(cmd, " -ltcc -ldl");
 #endif
-             strcat(cmd, " -lssl -lcrypto");
+             strcat(cmd, " -lssl -lcrypto -lz");
 
             int ret = system(cmd);
             if (ret == 0) {
@@ -2187,6 +11137,12 @@ int main(int argc, char *argv[]) {
         }
         
         execute_file(argv[1]);
+        async_pool_wait();
+        
+        // Scripts that start a server keep serving their routes until it stops
+        if (http_server.running) {
+            pthread_join(http_server.thread, NULL);
+        }
         
 #ifdef HAVE_SDL2
         for (int i = 0; i < window_count; i++) {
@@ -2226,7 +11182,7 @@ int main(int argc, char *argv[]) {
         free_tokens(tokens, count);
     }
     
-    http_server.running = false;
+    http_server_stop();
     
 #ifdef HAVE_SDL2
     for (int i = 0; i < window_count; i++) {